@@ -1,7 +1,14 @@
 #include "common-ggml.h"
 
-#include <regex>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <regex>
+#include <sstream>
+#include <thread>
 
 static const std::map<std::string, enum ggml_ftype> GGML_FTYPE_MAP = {
     {"q4_0", GGML_FTYPE_MOSTLY_Q4_0},
@@ -33,12 +40,481 @@ enum ggml_ftype ggml_parse_ftype(const char * str) {
     return ftype;
 }
 
+static enum ggml_ftype ggml_ftype_from_type(ggml_type type) {
+    switch (type) {
+        case GGML_TYPE_F32:  return GGML_FTYPE_ALL_F32;
+        case GGML_TYPE_F16:  return GGML_FTYPE_MOSTLY_F16;
+        case GGML_TYPE_Q4_0: return GGML_FTYPE_MOSTLY_Q4_0;
+        case GGML_TYPE_Q4_1: return GGML_FTYPE_MOSTLY_Q4_1;
+        case GGML_TYPE_Q5_0: return GGML_FTYPE_MOSTLY_Q5_0;
+        case GGML_TYPE_Q5_1: return GGML_FTYPE_MOSTLY_Q5_1;
+        case GGML_TYPE_Q8_0: return GGML_FTYPE_MOSTLY_Q8_0;
+        case GGML_TYPE_Q2_K: return GGML_FTYPE_MOSTLY_Q2_K;
+        case GGML_TYPE_Q3_K: return GGML_FTYPE_MOSTLY_Q3_K;
+        case GGML_TYPE_Q4_K: return GGML_FTYPE_MOSTLY_Q4_K;
+        case GGML_TYPE_Q5_K: return GGML_FTYPE_MOSTLY_Q5_K;
+        case GGML_TYPE_Q6_K: return GGML_FTYPE_MOSTLY_Q6_K;
+        default:             return GGML_FTYPE_UNKNOWN;
+    }
+}
+
+static bool ggml_parse_quant_type(const std::string & str, ggml_type & type) {
+    std::string lower = str;
+    std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+
+    for (int i = 0; i < GGML_TYPE_COUNT; ++i) {
+        const char * type_name = ggml_type_name((ggml_type) i);
+        if (type_name == nullptr) {
+            continue;
+        }
+
+        std::string name = type_name;
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+
+        if (name != lower) {
+            continue;
+        }
+
+        type = (ggml_type) i;
+
+        // the weights are stored in F16 or in one of the quantized types that have a ftype
+        if (type != GGML_TYPE_F16 && (!ggml_is_quantized(type) || ggml_ftype_from_type(type) == GGML_FTYPE_UNKNOWN)) {
+            break;
+        }
+
+#ifndef GGML_USE_K_QUANTS
+        if (type >= GGML_TYPE_Q2_K && type <= GGML_TYPE_Q6_K) {
+            fprintf(stderr, "%s: type '%s' requires ggml to be built with GGML_USE_K_QUANTS\n", __func__, str.c_str());
+            return false;
+        }
+#endif
+
+        return true;
+    }
+
+    fprintf(stderr, "%s: unsupported type '%s'\n", __func__, str.c_str());
+    return false;
+}
+
+bool ggml_parse_quant_profile(const std::string & fname, std::vector<ggml_quant_rule> & rules) {
+    std::ifstream fin(fname);
+    if (!fin) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname.c_str());
+        return false;
+    }
+
+    rules.clear();
+
+    std::string line;
+    for (int n_line = 1; std::getline(fin, line); ++n_line) {
+        line = line.substr(0, line.find('#'));
+
+        std::istringstream iss(line);
+
+        std::string pattern;
+        std::string type;
+        std::string extra;
+
+        if (!(iss >> pattern)) {
+            continue;
+        }
+
+        if (!(iss >> type) || (iss >> extra)) {
+            fprintf(stderr, "%s: %s:%d: expected '<pattern> <type>'\n", __func__, fname.c_str(), n_line);
+            return false;
+        }
+
+        ggml_quant_rule rule;
+        rule.pattern = pattern;
+
+        if (!ggml_parse_quant_type(type, rule.type)) {
+            fprintf(stderr, "%s: %s:%d: invalid type\n", __func__, fname.c_str(), n_line);
+            return false;
+        }
+
+        try {
+            std::regex re(pattern);
+        } catch (const std::regex_error & e) {
+            fprintf(stderr, "%s: %s:%d: invalid pattern '%s': %s\n", __func__, fname.c_str(), n_line, pattern.c_str(), e.what());
+            return false;
+        }
+
+        rules.push_back(rule);
+    }
+
+    if (rules.empty()) {
+        fprintf(stderr, "%s: no rules in '%s'\n", __func__, fname.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+enum ggml_ftype ggml_quant_profile_ftype(const std::vector<ggml_quant_rule> & rules, enum ggml_ftype ftype_src) {
+    ggml_type wtype = GGML_TYPE_COUNT;
+
+    bool catch_all = false;
+
+    for (const auto & rule : rules) {
+        if (wtype == GGML_TYPE_COUNT || ggml_type_sizef(rule.type) > ggml_type_sizef(wtype)) {
+            wtype = rule.type;
+        }
+
+        catch_all = catch_all || rule.pattern == ".*";
+    }
+
+    // the weights that no rule matches keep the type of the input
+    if (!catch_all) {
+        switch (ftype_src) {
+            case GGML_FTYPE_ALL_F32:              return GGML_FTYPE_ALL_F32;
+            case GGML_FTYPE_MOSTLY_Q4_1_SOME_F16: return GGML_FTYPE_MOSTLY_F16;
+            case GGML_FTYPE_UNKNOWN:              return GGML_FTYPE_UNKNOWN;
+            default:
+                {
+                    const ggml_type wtype_src = ggml_ftype_to_ggml_type(ftype_src);
+                    if (ggml_type_sizef(wtype_src) > ggml_type_sizef(wtype)) {
+                        wtype = wtype_src;
+                    }
+                } break;
+        }
+    }
+
+    return ggml_ftype_from_type(wtype);
+}
+
+// a tensor on its way through the quantization pipeline: read -> quantize -> write
+struct ggml_common_tensor {
+    int32_t n_dims;
+    int32_t length;
+    int32_t ttype;
+    int32_t ttype_org;
+    int32_t ne[4];
+    int32_t nelements;
+
+    std::string name;
+
+    bool quantize;
+
+    ggml_type qtype; // the type to convert to, if quantize is set
+
+    std::vector<uint8_t> data; // as read from the input
+    std::vector<uint8_t> work; // quantized data
+
+    size_t cur_size = 0;
+
+    std::vector<int64_t> hist;
+};
+
+// bounded queue between two stages of the pipeline - the capacity limits the tensors held in memory
+class ggml_common_queue {
+public:
+    ggml_common_queue(size_t n_max) : m_n_max(n_max) {}
+
+    void push(std::unique_ptr<ggml_common_tensor> tensor) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cv.wait(lock, [&] { return m_queue.size() < m_n_max; });
+        m_queue.push_back(std::move(tensor));
+        m_cv.notify_all();
+    }
+
+    // returns nullptr after close(), once the queue is empty
+    std::unique_ptr<ggml_common_tensor> pop() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cv.wait(lock, [&] { return !m_queue.empty() || m_closed; });
+        if (m_queue.empty()) {
+            return nullptr;
+        }
+        auto tensor = std::move(m_queue.front());
+        m_queue.pop_front();
+        m_cv.notify_all();
+        return tensor;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closed = true;
+        m_cv.notify_all();
+    }
+
+private:
+    size_t m_n_max;
+    bool   m_closed = false;
+
+    std::mutex              m_mutex;
+    std::condition_variable m_cv;
+
+    std::deque<std::unique_ptr<ggml_common_tensor>> m_queue;
+};
+
+// quantize the rows of a 2D tensor in n_threads chunks with ggml_quantize_chunk()
+static void ggml_common_quantize_tensor(ggml_common_tensor & tensor, ggml_type qtype, int n_threads) {
+    const int64_t n_per_row = tensor.ne[0];
+    const int64_t nrows     = tensor.nelements/n_per_row;
+
+    n_threads = std::max(1, (int) std::min<int64_t>(n_threads, nrows));
+
+    std::vector<float> data_f32;
+
+    const float * src = (const float *) tensor.data.data();
+    if (tensor.ttype == GGML_TYPE_F16) {
+        data_f32.resize(tensor.nelements);
+        src = data_f32.data();
+    }
+
+    tensor.work.resize(tensor.nelements*sizeof(float));
+
+    std::vector<size_t> sizes(n_threads, 0);
+    std::vector<std::vector<int64_t>> hists(n_threads, std::vector<int64_t>(1 << 4, 0));
+
+    auto worker = [&](int ith) {
+        const int64_t start = n_per_row*((nrows*ith)/n_threads);
+        const int64_t end   = n_per_row*((nrows*(ith + 1))/n_threads);
+
+        if (tensor.ttype == GGML_TYPE_F16) {
+            const ggml_fp16_t * data_f16 = (const ggml_fp16_t *) tensor.data.data();
+            for (int64_t i = start; i < end; ++i) {
+                data_f32[i] = ggml_fp16_to_fp32(data_f16[i]);
+            }
+        }
+
+        sizes[ith] = ggml_quantize_chunk(qtype, src, tensor.work.data(), start, end - start, hists[ith].data());
+    };
+
+    std::vector<std::thread> workers;
+    for (int ith = 1; ith < n_threads; ++ith) {
+        workers.emplace_back(worker, ith);
+    }
+
+    worker(0);
+
+    for (auto & w : workers) {
+        w.join();
+    }
+
+    tensor.cur_size = 0;
+    tensor.hist.assign(1 << 4, 0);
+
+    for (int ith = 0; ith < n_threads; ++ith) {
+        tensor.cur_size += sizes[ith];
+        for (int i = 0; i < (int) tensor.hist.size(); ++i) {
+            tensor.hist[i] += hists[ith][i];
+        }
+    }
+
+    tensor.ttype = qtype;
+}
+
+// quantize the tensors with the type of the first matching rule - the other tensors are copied unchanged
+static bool ggml_common_quantize_impl(
+        std::ifstream & finp,
+        std::ofstream & fout,
+        const std::vector<ggml_quant_rule> & rules,
+        const std::vector<std::string> & to_skip,
+        int n_threads,
+        const std::string & desc) {
+    n_threads = std::max(1, n_threads);
+
+    size_t total_size_org = 0;
+    size_t total_size_new = 0;
+
+    std::vector<int64_t> hist_all(1 << 4, 0);
+
+    // the tensors are read, quantized and written by three stages running concurrently
+    // each queue holds at most 2 tensors, so the memory usage stays bounded by a few tensors
+    ggml_common_queue queue_quant(2);
+    ggml_common_queue queue_write(2);
+
+    int64_t t_read_us  = 0;
+    int64_t t_quant_us = 0;
+    int64_t t_write_us = 0;
+
+    const int64_t t_start_us = ggml_time_us();
+
+    std::thread thread_quant([&]() {
+        while (auto tensor = queue_quant.pop()) {
+            if (tensor->quantize) {
+                const int64_t t_start_us = ggml_time_us();
+
+                ggml_common_quantize_tensor(*tensor, tensor->qtype, n_threads);
+
+                t_quant_us += ggml_time_us() - t_start_us;
+            }
+
+            queue_write.push(std::move(tensor));
+        }
+
+        queue_write.close();
+    });
+
+    std::thread thread_write([&]() {
+        while (auto tensor = queue_write.pop()) {
+            const int64_t t_start_us = ggml_time_us();
+
+            printf("%64s - [%5d, %5d, %5d], type = %6s ", tensor->name.data(), tensor->ne[0], tensor->ne[1], tensor->ne[2], ggml_type_name((ggml_type) tensor->ttype_org));
+
+            fout.write(reinterpret_cast<char *>(&tensor->n_dims), sizeof(tensor->n_dims));
+            fout.write(reinterpret_cast<char *>(&tensor->length), sizeof(tensor->length));
+            fout.write(reinterpret_cast<char *>(&tensor->ttype),  sizeof(tensor->ttype));
+            for (int i = 0; i < tensor->n_dims; ++i) {
+                fout.write(reinterpret_cast<char *>(&tensor->ne[i]), sizeof(tensor->ne[i]));
+            }
+            fout.write(&tensor->name[0], tensor->length);
+
+            if (tensor->quantize) {
+                fout.write(reinterpret_cast<char *>(tensor->work.data()), tensor->cur_size);
+                total_size_new += tensor->cur_size;
+
+                printf("size = %8.2f MB -> %8.2f MB", tensor->nelements * sizeof(float)/1024.0/1024.0, tensor->cur_size/1024.0/1024.0);
+                if (ggml_is_quantized(tensor->qtype)) {
+                    printf(" | hist: ");
+                    for (int i = 0; i < (int) tensor->hist.size(); ++i) {
+                        hist_all[i] += tensor->hist[i];
+                    }
+
+                    for (int i = 0; i < (int) tensor->hist.size(); ++i) {
+                        printf("%5.3f ", tensor->hist[i] / (float)tensor->nelements);
+                    }
+                }
+                printf("\n");
+            } else {
+                printf("size = %8.3f MB\n", tensor->data.size()/1024.0/1024.0);
+                fout.write(reinterpret_cast<char *>(tensor->data.data()), tensor->data.size());
+                total_size_new += tensor->data.size();
+            }
+
+            total_size_org += tensor->nelements * sizeof(float);
+
+            t_write_us += ggml_time_us() - t_start_us;
+        }
+    });
+
+    bool ok = true;
+
+    while (true) {
+        const int64_t t_start_us = ggml_time_us();
+
+        std::unique_ptr<ggml_common_tensor> tensor(new ggml_common_tensor);
+
+        finp.read(reinterpret_cast<char *>(&tensor->n_dims), sizeof(tensor->n_dims));
+        finp.read(reinterpret_cast<char *>(&tensor->length), sizeof(tensor->length));
+        finp.read(reinterpret_cast<char *>(&tensor->ttype),  sizeof(tensor->ttype));
+
+        if (finp.eof()) {
+            break;
+        }
+
+        tensor->ttype_org = tensor->ttype;
+
+        tensor->nelements = 1;
+        for (int i = 0; i < 4; ++i) {
+            tensor->ne[i] = 1;
+        }
+        for (int i = 0; i < tensor->n_dims; ++i) {
+            finp.read (reinterpret_cast<char *>(&tensor->ne[i]), sizeof(tensor->ne[i]));
+            tensor->nelements *= tensor->ne[i];
+        }
+
+        tensor->name.resize(tensor->length);
+        finp.read (&tensor->name[0], tensor->length);
+
+        const std::string & name = tensor->name;
+
+        bool quantize = false;
+
+        ggml_type qtype = GGML_TYPE_COUNT;
+
+        // check if we should quantize this tensor
+        for (const auto & rule : rules) {
+            if (std::regex_match(name, std::regex(rule.pattern))) {
+                quantize = true;
+                qtype = rule.type;
+                break;
+            }
+        }
+
+        // check if we should skip this tensor
+        for (const auto & s : to_skip) {
+            if (std::regex_match(name, std::regex(s))) {
+                quantize = false;
+                break;
+            }
+        }
+
+        // quantize only 2D tensors
+        quantize &= (tensor->n_dims == 2);
+
+        if (quantize && tensor->ttype != GGML_TYPE_F32 && tensor->ttype != GGML_TYPE_F16) {
+            fprintf(stderr, "%s: unsupported ttype %d (%s) for integer quantization\n", __func__, tensor->ttype, ggml_type_name((ggml_type) tensor->ttype));
+            ok = false;
+            break;
+        }
+
+        if (quantize && tensor->ne[0] % ggml_blck_size(qtype) != 0) {
+            fprintf(stderr, "%s: tensor '%s' with %d columns cannot be quantized to %s (block size %d)\n", __func__, name.c_str(), tensor->ne[0], ggml_type_name(qtype), ggml_blck_size(qtype));
+            ok = false;
+            break;
+        }
+
+        // already in the requested type
+        quantize &= (tensor->ttype != qtype);
+
+        const int bpe = (tensor->ttype == 0) ? sizeof(float) : sizeof(uint16_t);
+
+        tensor->data.resize(tensor->nelements*bpe);
+        finp.read(reinterpret_cast<char *>(tensor->data.data()), tensor->nelements * bpe);
+
+        tensor->quantize = quantize;
+        tensor->qtype    = qtype;
+
+        t_read_us += ggml_time_us() - t_start_us;
+
+        queue_quant.push(std::move(tensor));
+    }
+
+    queue_quant.close();
+
+    thread_quant.join();
+    thread_write.join();
+
+    if (!ok) {
+        return false;
+    }
+
+    const int64_t t_total_us = ggml_time_us() - t_start_us;
+
+    printf("%s: model size  = %8.2f MB\n", __func__, total_size_org/1024.0/1024.0);
+    printf("%s: quant size  = %8.2f MB | %s\n", __func__, total_size_new/1024.0/1024.0, desc.c_str());
+
+    {
+        int64_t sum_all = 0;
+        for (int i = 0; i < (int) hist_all.size(); ++i) {
+            sum_all += hist_all[i];
+        }
+
+        if (sum_all > 0) {
+            printf("%s: hist: ", __func__);
+            for (int i = 0; i < (int) hist_all.size(); ++i) {
+                printf("%5.3f ", hist_all[i] / (float)sum_all);
+            }
+            printf("\n");
+        }
+    }
+
+    // the stages overlap, so the total time is close to the time of the slowest one
+    printf("%s: %d threads, %8.2f MB/s | read = %8.2f ms, quantize = %8.2f ms, write = %8.2f ms, total = %8.2f ms\n", __func__,
+            n_threads, total_size_org/1024.0/1024.0/std::max(1e-6, t_total_us/1e6),
+            t_read_us/1000.0, t_quant_us/1000.0, t_write_us/1000.0, t_total_us/1000.0);
+
+    return true;
+}
+
 bool ggml_common_quantize_0(
         std::ifstream & finp,
         std::ofstream & fout,
         const ggml_ftype ftype,
         const std::vector<std::string> & to_quant,
-        const std::vector<std::string> & to_skip) {
+        const std::vector<std::string> & to_skip,
+        int n_threads) {
 
     ggml_type qtype = GGML_TYPE_F32;
 
@@ -68,179 +544,157 @@ bool ggml_common_quantize_0(
         return false;
     }
 
-    size_t total_size_org = 0;
-    size_t total_size_new = 0;
+    std::vector<ggml_quant_rule> rules;
+    for (const auto & s : to_quant) {
+        rules.push_back({ s, qtype });
+    }
 
-    std::vector<float> work;
+    return ggml_common_quantize_impl(finp, fout, rules, to_skip, n_threads, "ftype = " + std::to_string(ftype) + " (" + ggml_type_name(qtype) + ")");
+}
 
-    std::vector<uint8_t>     data_u8;
-    std::vector<ggml_fp16_t> data_f16;
-    std::vector<float>       data_f32;
+bool ggml_common_quantize_profile(
+        std::ifstream & finp,
+        std::ofstream & fout,
+        const std::vector<ggml_quant_rule> & rules,
+        const std::vector<std::string> & to_skip,
+        int n_threads) {
+    return ggml_common_quantize_impl(finp, fout, rules, to_skip, n_threads, "profile with " + std::to_string(rules.size()) + " rules");
+}
 
-    std::vector<int64_t> hist_all(1 << 4, 0);
+bool ggml_common_pack(
+        std::ifstream & finp,
+        std::ofstream & fout,
+        uint32_t version,
+        uint32_t alignment) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        fprintf(stderr, "%s: invalid alignment %u\n", __func__, alignment);
+        return false;
+    }
 
-    while (true) {
+    struct pack_entry {
         int32_t n_dims;
         int32_t length;
         int32_t ttype;
+        int32_t ne[4];
+
+        std::string name;
+
+        std::streamoff pos; // of the data in the input file
+
+        uint64_t offset; // from the start of the data in the output file
+        uint64_t size;
+    };
+
+    auto align = [alignment](uint64_t x) { return (x + alignment - 1) & ~((uint64_t) alignment - 1); };
+
+    std::vector<pack_entry> table;
+
+    // scan the tensor headers - the data is copied in a second pass, once the layout is known
+    while (true) {
+        pack_entry entry;
 
-        finp.read(reinterpret_cast<char *>(&n_dims), sizeof(n_dims));
-        finp.read(reinterpret_cast<char *>(&length), sizeof(length));
-        finp.read(reinterpret_cast<char *>(&ttype),  sizeof(ttype));
+        finp.read(reinterpret_cast<char *>(&entry.n_dims), sizeof(entry.n_dims));
+        finp.read(reinterpret_cast<char *>(&entry.length), sizeof(entry.length));
+        finp.read(reinterpret_cast<char *>(&entry.ttype),  sizeof(entry.ttype));
 
         if (finp.eof()) {
             break;
         }
 
-        int32_t nelements = 1;
-        int32_t ne[4] = { 1, 1, 1, 1 };
-        for (int i = 0; i < n_dims; ++i) {
-            finp.read (reinterpret_cast<char *>(&ne[i]), sizeof(ne[i]));
-            nelements *= ne[i];
+        if (entry.n_dims < 1 || entry.n_dims > 4 || entry.ttype < 0 || entry.ttype >= GGML_TYPE_COUNT || ggml_blck_size((ggml_type) entry.ttype) == 0) {
+            fprintf(stderr, "%s: invalid tensor header (n_dims = %d, ttype = %d)\n", __func__, entry.n_dims, entry.ttype);
+            return false;
         }
 
-        std::string name(length, 0);
-        finp.read (&name[0], length);
+        uint64_t nelements = 1;
+        for (int i = 0; i < 4; ++i) {
+            entry.ne[i] = 1;
+        }
+        for (int i = 0; i < entry.n_dims; ++i) {
+            finp.read(reinterpret_cast<char *>(&entry.ne[i]), sizeof(entry.ne[i]));
+            nelements *= entry.ne[i];
+        }
 
-        printf("%64s - [%5d, %5d, %5d], type = %6s ", name.data(), ne[0], ne[1], ne[2], ggml_type_name((ggml_type) ttype));
+        entry.name.resize(entry.length);
+        finp.read(&entry.name[0], entry.length);
 
-        bool quantize = false;
+        entry.size = (nelements*ggml_type_size((ggml_type) entry.ttype))/ggml_blck_size((ggml_type) entry.ttype);
+        entry.pos  = finp.tellg();
 
-        // check if we should quantize this tensor
-        for (const auto & s : to_quant) {
-            if (std::regex_match(name, std::regex(s))) {
-                quantize = true;
-                break;
-            }
-        }
-
-        // check if we should skip this tensor
-        for (const auto & s : to_skip) {
-            if (std::regex_match(name, std::regex(s))) {
-                quantize = false;
-                break;
-            }
+        finp.seekg(entry.size, std::ios::cur);
+        if (!finp) {
+            fprintf(stderr, "%s: unexpected end of file in tensor '%s'\n", __func__, entry.name.c_str());
+            return false;
         }
 
-        // quantize only 2D tensors
-        quantize &= (n_dims == 2);
+        table.push_back(std::move(entry));
+    }
 
-        if (quantize) {
-            if (ttype != GGML_TYPE_F32 && ttype != GGML_TYPE_F16) {
-                fprintf(stderr, "%s: unsupported ttype %d (%s) for integer quantization\n", __func__, ttype, ggml_type_name((ggml_type) ttype));
-                return false;
-            }
+    uint64_t size_data = 0;
+    for (auto & entry : table) {
+        entry.offset = size_data;
+        size_data = align(entry.offset + entry.size);
+    }
 
-            if (ttype == GGML_TYPE_F16) {
-                data_f16.resize(nelements);
-                finp.read(reinterpret_cast<char *>(data_f16.data()), nelements * sizeof(ggml_fp16_t));
-                data_f32.resize(nelements);
-                for (int i = 0; i < nelements; ++i) {
-                    data_f32[i] = ggml_fp16_to_fp32(data_f16[i]);
-                }
-            } else {
-                data_f32.resize(nelements);
-                finp.read(reinterpret_cast<char *>(data_f32.data()), nelements * sizeof(float));
-            }
+    // version, alignment, layout, number of tensors, data offset, table, padding size
+    uint64_t size_header = (uint64_t) fout.tellp() + 4*sizeof(uint32_t) + sizeof(uint64_t) + sizeof(uint32_t);
+    for (const auto & entry : table) {
+        size_header += 3*sizeof(int32_t) + entry.n_dims*sizeof(int32_t) + entry.length + 2*sizeof(uint64_t);
+    }
 
-            ttype = qtype;
-        } else {
-            const int bpe = (ttype == 0) ? sizeof(float) : sizeof(uint16_t);
-
-            data_u8.resize(nelements*bpe);
-            finp.read(reinterpret_cast<char *>(data_u8.data()), nelements * bpe);
-        }
-
-        fout.write(reinterpret_cast<char *>(&n_dims), sizeof(n_dims));
-        fout.write(reinterpret_cast<char *>(&length), sizeof(length));
-        fout.write(reinterpret_cast<char *>(&ttype),  sizeof(ttype));
-        for (int i = 0; i < n_dims; ++i) {
-            fout.write(reinterpret_cast<char *>(&ne[i]), sizeof(ne[i]));
-        }
-        fout.write(&name[0], length);
-
-        if (quantize) {
-            work.resize(nelements); // for quantization
-
-            size_t cur_size = 0;
-            std::vector<int64_t> hist_cur(1 << 4, 0);
-
-            switch ((ggml_type) ttype) {
-                case GGML_TYPE_Q4_0:
-                    {
-                        cur_size = ggml_quantize_q4_0(data_f32.data(), work.data(), nelements, ne[0], hist_cur.data());
-                    } break;
-                case GGML_TYPE_Q4_1:
-                    {
-                        cur_size = ggml_quantize_q4_1(data_f32.data(), work.data(), nelements, ne[0], hist_cur.data());
-                    } break;
-                case GGML_TYPE_Q5_0:
-                    {
-                        cur_size = ggml_quantize_q5_0(data_f32.data(), work.data(), nelements, ne[0], hist_cur.data());
-                    } break;
-                case GGML_TYPE_Q5_1:
-                    {
-                        cur_size = ggml_quantize_q5_1(data_f32.data(), work.data(), nelements, ne[0], hist_cur.data());
-                    } break;
-                case GGML_TYPE_Q8_0:
-                    {
-                        cur_size = ggml_quantize_q8_0(data_f32.data(), work.data(), nelements, ne[0], hist_cur.data());
-                    } break;
-                case GGML_TYPE_F32:
-                case GGML_TYPE_F16:
-                case GGML_TYPE_I8:
-                case GGML_TYPE_I16:
-                case GGML_TYPE_I32:
-                case GGML_TYPE_Q8_1:
-                case GGML_TYPE_Q2_K:
-                case GGML_TYPE_Q3_K:
-                case GGML_TYPE_Q4_K:
-                case GGML_TYPE_Q5_K:
-                case GGML_TYPE_Q6_K:
-                case GGML_TYPE_Q8_K:
-                case GGML_TYPE_COUNT:
-                    {
-                        fprintf(stderr, "%s: unsupported quantization type %d (%s)\n", __func__, ttype, ggml_type_name((ggml_type) ttype));
-                        return false;
-                    }
-            }
+    const uint64_t data_offset = align(size_header);
 
-            fout.write(reinterpret_cast<char *>(work.data()), cur_size);
-            total_size_new += cur_size;
+    const uint32_t layout    = 0; // the ggml rows, as in the input file
+    const uint32_t n_tensors = table.size();
+    const uint32_t n_pad     = data_offset - size_header;
 
-            printf("size = %8.2f MB -> %8.2f MB | hist: ", nelements * sizeof(float)/1024.0/1024.0, cur_size/1024.0/1024.0);
-            for (int i = 0; i < (int) hist_cur.size(); ++i) {
-                hist_all[i] += hist_cur[i];
-            }
+    fout.write(reinterpret_cast<const char *>(&version),     sizeof(version));
+    fout.write(reinterpret_cast<const char *>(&alignment),   sizeof(alignment));
+    fout.write(reinterpret_cast<const char *>(&layout),      sizeof(layout));
+    fout.write(reinterpret_cast<const char *>(&n_tensors),   sizeof(n_tensors));
+    fout.write(reinterpret_cast<const char *>(&data_offset), sizeof(data_offset));
 
-            for (int i = 0; i < (int) hist_cur.size(); ++i) {
-                printf("%5.3f ", hist_cur[i] / (float)nelements);
-            }
-            printf("\n");
-        } else {
-            printf("size = %8.3f MB\n", data_u8.size()/1024.0/1024.0);
-            fout.write(reinterpret_cast<char *>(data_u8.data()), data_u8.size());
-            total_size_new += data_u8.size();
+    for (const auto & entry : table) {
+        fout.write(reinterpret_cast<const char *>(&entry.n_dims), sizeof(entry.n_dims));
+        fout.write(reinterpret_cast<const char *>(&entry.length), sizeof(entry.length));
+        fout.write(reinterpret_cast<const char *>(&entry.ttype),  sizeof(entry.ttype));
+        for (int i = 0; i < entry.n_dims; ++i) {
+            fout.write(reinterpret_cast<const char *>(&entry.ne[i]), sizeof(entry.ne[i]));
         }
-
-        total_size_org += nelements * sizeof(float);
+        fout.write(entry.name.data(), entry.length);
+        fout.write(reinterpret_cast<const char *>(&entry.offset), sizeof(entry.offset));
+        fout.write(reinterpret_cast<const char *>(&entry.size),   sizeof(entry.size));
     }
 
-    printf("%s: model size  = %8.2f MB\n", __func__, total_size_org/1024.0/1024.0);
-    printf("%s: quant size  = %8.2f MB | ftype = %d (%s)\n", __func__, total_size_new/1024.0/1024.0, ftype, ggml_type_name(qtype));
+    const std::vector<char> zeros(alignment, 0);
 
-    {
-        int64_t sum_all = 0;
-        for (int i = 0; i < (int) hist_all.size(); ++i) {
-            sum_all += hist_all[i];
-        }
+    fout.write(reinterpret_cast<const char *>(&n_pad), sizeof(n_pad));
+    fout.write(zeros.data(), n_pad);
 
-        printf("%s: hist: ", __func__);
-        for (int i = 0; i < (int) hist_all.size(); ++i) {
-            printf("%5.3f ", hist_all[i] / (float)sum_all);
-        }
-        printf("\n");
+    finp.clear();
+
+    std::vector<char> data;
+
+    for (const auto & entry : table) {
+        printf("%64s - [%5d, %5d, %5d], type = %6s, offset = %10zu, size = %8.3f MB\n",
+                entry.name.c_str(), entry.ne[0], entry.ne[1], entry.ne[2], ggml_type_name((ggml_type) entry.ttype),
+                (size_t) (data_offset + entry.offset), entry.size/1024.0/1024.0);
+
+        data.resize(entry.size);
+
+        finp.seekg(entry.pos);
+        finp.read(data.data(), data.size());
+        fout.write(data.data(), data.size());
+        fout.write(zeros.data(), align(entry.size) - entry.size);
     }
 
+    if (!finp || !fout) {
+        fprintf(stderr, "%s: failed to copy the tensor data\n", __func__);
+        return false;
+    }
+
+    printf("%s: %u tensors, alignment = %u, data offset = %zu, data size = %8.2f MB\n",
+            __func__, n_tensors, alignment, (size_t) data_offset, size_data/1024.0/1024.0);
+
     return true;
 }
@@ -10,9 +10,41 @@ enum ggml_ftype ggml_parse_ftype(const char * str);
 
 void ggml_print_ftypes(FILE * fp = stderr);
 
+// a quantization profile assigns a type to the tensors whose name matches a pattern
+struct ggml_quant_rule {
+    std::string pattern; // regex, matched against the whole tensor name
+    ggml_type   type;
+};
+
+// one rule per line: "<pattern> <type>", '#' starts a comment - the first matching rule applies
+// the types are f16, q4_0, q4_1, q5_0, q5_1, q8_0 and, if ggml is built with GGML_USE_K_QUANTS, q2_k to q6_k
+bool ggml_parse_quant_profile(const std::string & fname, std::vector<ggml_quant_rule> & rules);
+
+// the ftype of a model quantized with the profile: the widest of the weight types, which the loader allocates
+// the tensors that no rule matches keep their type, so it includes the type of the input, unless there is a ".*" rule
+enum ggml_ftype ggml_quant_profile_ftype(const std::vector<ggml_quant_rule> & rules, enum ggml_ftype ftype_src);
+
+// the tensors are quantized in row chunks by n_threads threads, while the next tensor is read and the previous one written
 bool ggml_common_quantize_0(
         std::ifstream & finp,
         std::ofstream & fout,
         const ggml_ftype ftype,
         const std::vector<std::string> & to_quant,
-        const std::vector<std::string> & to_skip);
+        const std::vector<std::string> & to_skip,
+        int n_threads = 1);
+
+// same as ggml_common_quantize_0(), with the type of each tensor given by the first matching rule of a profile
+bool ggml_common_quantize_profile(
+        std::ifstream & finp,
+        std::ofstream & fout,
+        const std::vector<ggml_quant_rule> & rules,
+        const std::vector<std::string> & to_skip,
+        int n_threads = 1);
+
+// copy the tensors of a ggml file to the packed layout that whisper_model_load() memory-maps:
+// a table of the tensors, followed by the tensor data, each tensor starting at a multiple of the alignment
+bool ggml_common_pack(
+        std::ifstream & finp,
+        std::ofstream & fout,
+        uint32_t version,
+        uint32_t alignment);
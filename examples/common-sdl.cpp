@@ -1,12 +1,85 @@
 #include "common-sdl.h"
 
+#include "common.h"
+
+#include <chrono>
+#include <cstring>
+
+void audio_ring::init(size_t n_keep) {
+    // the consumer can read the last n_keep samples while the producer writes n_keep more
+    m_keep     = n_keep;
+    m_capacity = 2*n_keep;
+
+    m_buf.assign(2*m_capacity, 0.0f);
+
+    m_head    = 0;
+    m_tail    = 0;
+    m_reserve = 0;
+}
+
+void audio_ring::write(const float * data, size_t n) {
+    uint64_t head = m_head.load(std::memory_order_relaxed);
+
+    if (n > m_capacity) {
+        head += n - m_capacity;
+        data += n - m_capacity;
+        n     = m_capacity;
+    }
+
+    // announce the samples that are about to be overwritten, before touching them (see is_valid())
+    m_reserve.store(head + n, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    const size_t pos = head % m_capacity;
+    const size_t n0  = std::min(n, m_capacity - pos);
+
+    memcpy(&m_buf[pos],              data, n0*sizeof(float));
+    memcpy(&m_buf[pos + m_capacity], data, n0*sizeof(float));
+
+    if (n0 < n) {
+        memcpy(&m_buf[0],          data + n0, (n - n0)*sizeof(float));
+        memcpy(&m_buf[m_capacity], data + n0, (n - n0)*sizeof(float));
+    }
+
+    m_head.store(head + n, std::memory_order_release);
+}
+
+size_t audio_ring::view(size_t n, const float ** data, uint64_t * pos) const {
+    const uint64_t head = m_head.load(std::memory_order_acquire);
+    const uint64_t tail = m_tail.load(std::memory_order_relaxed);
+
+    n = std::min(n, (size_t) std::min<uint64_t>(head - tail, m_keep));
+
+    // the mirrored copy makes the samples contiguous, even across the end of the buffer
+    *pos  = head - n;
+    *data = &m_buf[*pos % m_capacity];
+
+    return n;
+}
+
+bool audio_ring::is_valid(uint64_t pos) const {
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    return m_reserve.load(std::memory_order_relaxed) <= pos + m_capacity;
+}
+
+void audio_ring::clear() {
+    m_tail.store(m_head.load(std::memory_order_acquire), std::memory_order_relaxed);
+}
+
 audio_async::audio_async(int len_ms) {
     m_len_ms = len_ms;
 
     m_running = false;
+    m_stop    = false;
 }
 
 audio_async::~audio_async() {
+    if (m_file_thread.joinable()) {
+        m_stop = true;
+        m_file_thread.join();
+    }
+
     if (m_dev_id_in) {
         SDL_CloseAudioDevice(m_dev_id_in);
     }
@@ -71,13 +144,85 @@ bool audio_async::init(int capture_id, int sample_rate) {
 
     m_sample_rate = capture_spec_obtained.freq;
 
-    m_audio.resize((m_sample_rate*m_len_ms)/1000);
+    m_ring.init((m_sample_rate*m_len_ms)/1000);
 
     return true;
 }
 
+bool audio_async::init_file(const std::string & fname, int sample_rate) {
+    if (sample_rate != COMMON_SAMPLE_RATE) {
+        fprintf(stderr, "%s: file capture only supports a sample rate of %d Hz\n", __func__, COMMON_SAMPLE_RATE);
+        return false;
+    }
+
+    // the events are still needed for sdl_poll_events()
+    if (SDL_Init(SDL_INIT_EVENTS) < 0) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Couldn't initialize SDL: %s\n", SDL_GetError());
+        return false;
+    }
+
+    wav_reader * reader = wav_reader_init(fname, false);
+    if (reader == nullptr) {
+        fprintf(stderr, "%s: failed to open '%s' for capture\n", __func__, fname.c_str());
+        return false;
+    }
+
+    fprintf(stderr, "%s: capturing from '%s' at real-time speed\n", __func__, fname.c_str());
+
+    m_sample_rate = sample_rate;
+
+    m_ring.init((m_sample_rate*m_len_ms)/1000);
+
+    m_file_thread = std::thread(&audio_async::file_thread, this, reader);
+
+    return true;
+}
+
+// emulates the SDL callback: the audio is delivered in chunks of the same size, when it would have been recorded
+void audio_async::file_thread(wav_reader * reader) {
+    const size_t n_chunk = 1024;
+
+    std::vector<float> pcmf32;
+    std::vector<std::vector<float>> pcmf32s;
+
+    auto t_next = std::chrono::steady_clock::now();
+
+    while (!m_stop) {
+        if (!m_running) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            t_next = std::chrono::steady_clock::now();
+            continue;
+        }
+
+        pcmf32.clear();
+        if (wav_reader_read(reader, pcmf32, pcmf32s, n_chunk) == 0) {
+            break;
+        }
+
+        t_next += std::chrono::microseconds((1000000*pcmf32.size())/m_sample_rate);
+        std::this_thread::sleep_until(t_next);
+
+        m_ring.write(pcmf32.data(), pcmf32.size());
+    }
+
+    wav_reader_free(reader);
+
+    if (!m_stop) {
+        fprintf(stderr, "\n%s: end of the captured audio\n", __func__);
+
+        SDL_Event event;
+        SDL_zero(event);
+        event.type = SDL_QUIT;
+        SDL_PushEvent(&event);
+    }
+}
+
+bool audio_async::is_open() const {
+    return m_dev_id_in || m_file_thread.joinable();
+}
+
 bool audio_async::resume() {
-    if (!m_dev_id_in) {
+    if (!is_open()) {
         fprintf(stderr, "%s: no audio device to resume!\n", __func__);
         return false;
     }
@@ -87,7 +232,9 @@ bool audio_async::resume() {
         return false;
     }
 
-    SDL_PauseAudioDevice(m_dev_id_in, 0);
+    if (m_dev_id_in) {
+        SDL_PauseAudioDevice(m_dev_id_in, 0);
+    }
 
     m_running = true;
 
@@ -95,7 +242,7 @@ bool audio_async::resume() {
 }
 
 bool audio_async::pause() {
-    if (!m_dev_id_in) {
+    if (!is_open()) {
         fprintf(stderr, "%s: no audio device to pause!\n", __func__);
         return false;
     }
@@ -105,7 +252,9 @@ bool audio_async::pause() {
         return false;
     }
 
-    SDL_PauseAudioDevice(m_dev_id_in, 1);
+    if (m_dev_id_in) {
+        SDL_PauseAudioDevice(m_dev_id_in, 1);
+    }
 
     m_running = false;
 
@@ -113,7 +262,7 @@ bool audio_async::pause() {
 }
 
 bool audio_async::clear() {
-    if (!m_dev_id_in) {
+    if (!is_open()) {
         fprintf(stderr, "%s: no audio device to clear!\n", __func__);
         return false;
     }
@@ -123,12 +272,7 @@ bool audio_async::clear() {
         return false;
     }
 
-    {
-        std::lock_guard<std::mutex> lock(m_mutex);
-
-        m_audio_pos = 0;
-        m_audio_len = 0;
-    }
+    m_ring.clear();
 
     return true;
 }
@@ -139,35 +283,12 @@ void audio_async::callback(uint8_t * stream, int len) {
         return;
     }
 
-    const size_t n_samples = len / sizeof(float);
-
-    m_audio_new.resize(n_samples);
-    memcpy(m_audio_new.data(), stream, n_samples * sizeof(float));
-
-    //fprintf(stderr, "%s: %zu samples, pos %zu, len %zu\n", __func__, n_samples, m_audio_pos, m_audio_len);
-
-    {
-        std::lock_guard<std::mutex> lock(m_mutex);
-
-        if (m_audio_pos + n_samples > m_audio.size()) {
-            const size_t n0 = m_audio.size() - m_audio_pos;
-
-            memcpy(&m_audio[m_audio_pos], stream, n0 * sizeof(float));
-            memcpy(&m_audio[0], &stream[n0], (n_samples - n0) * sizeof(float));
-
-            m_audio_pos = (m_audio_pos + n_samples) % m_audio.size();
-            m_audio_len = m_audio.size();
-        } else {
-            memcpy(&m_audio[m_audio_pos], stream, n_samples * sizeof(float));
-
-            m_audio_pos = (m_audio_pos + n_samples) % m_audio.size();
-            m_audio_len = std::min(m_audio_len + n_samples, m_audio.size());
-        }
-    }
+    // no locks and no allocations on the audio thread
+    m_ring.write((const float *) stream, len / sizeof(float));
 }
 
 void audio_async::get(int ms, std::vector<float> & result) {
-    if (!m_dev_id_in) {
+    if (!is_open()) {
         fprintf(stderr, "%s: no audio device to get audio from!\n", __func__);
         return;
     }
@@ -179,36 +300,50 @@ void audio_async::get(int ms, std::vector<float> & result) {
 
     result.clear();
 
-    {
-        std::lock_guard<std::mutex> lock(m_mutex);
+    if (ms <= 0) {
+        ms = m_len_ms;
+    }
 
-        if (ms <= 0) {
-            ms = m_len_ms;
-        }
+    const size_t n_samples = (m_sample_rate * ms) / 1000;
 
-        size_t n_samples = (m_sample_rate * ms) / 1000;
-        if (n_samples > m_audio_len) {
-            n_samples = m_audio_len;
-        }
+    const float * data = nullptr;
 
-        result.resize(n_samples);
+    // in the unlikely case that the producer overwrote the samples during the copy, read the newer ones
+    while (true) {
+        uint64_t pos = 0;
 
-        int s0 = m_audio_pos - n_samples;
-        if (s0 < 0) {
-            s0 += m_audio.size();
-        }
+        const size_t n = m_ring.view(n_samples, &data, &pos);
 
-        if (s0 + n_samples > m_audio.size()) {
-            const size_t n0 = m_audio.size() - s0;
+        result.assign(data, data + n);
 
-            memcpy(result.data(), &m_audio[s0], n0 * sizeof(float));
-            memcpy(&result[n0], &m_audio[0], (n_samples - n0) * sizeof(float));
-        } else {
-            memcpy(result.data(), &m_audio[s0], n_samples * sizeof(float));
+        if (m_ring.is_valid(pos)) {
+            break;
         }
     }
 }
 
+size_t audio_async::get_view(int ms, const float ** data) {
+    *data = nullptr;
+
+    if (!is_open()) {
+        fprintf(stderr, "%s: no audio device to get audio from!\n", __func__);
+        return 0;
+    }
+
+    if (!m_running) {
+        fprintf(stderr, "%s: not running!\n", __func__);
+        return 0;
+    }
+
+    if (ms <= 0) {
+        ms = m_len_ms;
+    }
+
+    uint64_t pos = 0;
+
+    return m_ring.view((m_sample_rate * ms) / 1000, data, &pos);
+}
+
 bool sdl_poll_events() {
     SDL_Event event;
     while (SDL_PollEvent(&event)) {
@@ -5,13 +5,53 @@
 
 #include <atomic>
 #include <cstdint>
+#include <string>
+#include <thread>
 #include <vector>
-#include <mutex>
+
+//
+// Lock-free single-producer / single-consumer ring buffer of audio samples
+//
+// The producer (the audio callback) never blocks - when the buffer is full, the oldest samples are overwritten
+// Each sample is stored twice, at pos and pos + capacity, so the latest n_keep samples are always contiguous in
+// memory and can be read without copying
+//
+
+class audio_ring {
+public:
+    // keep at least the last n_keep samples
+    void init(size_t n_keep);
+
+    // producer
+    void write(const float * data, size_t n);
+
+    // consumer: view the last (at most n) samples written since the last clear()
+    // the view stays valid until n_keep more samples are written - use is_valid() to check after a long read
+    size_t view(size_t n, const float ** data, uint64_t * pos) const;
+
+    bool is_valid(uint64_t pos) const;
+
+    // consumer: discard the samples written so far
+    void clear();
+
+private:
+    std::vector<float> m_buf; // 2*m_capacity samples
+
+    size_t m_capacity = 0;
+    size_t m_keep     = 0;
+
+    std::atomic<uint64_t> m_head{0}; // number of samples written, updated by the producer
+    std::atomic<uint64_t> m_tail{0}; // first sample after the last clear(), updated by the consumer
+
+    std::atomic<uint64_t> m_reserve{0}; // end of the write in progress, updated by the producer before the data
+};
 
 //
 // SDL Audio capture
 //
 
+struct wav_reader;
+
 class audio_async {
 public:
     audio_async(int len_ms);
@@ -19,6 +59,10 @@ public:
 
     bool init(int capture_id, int sample_rate);
 
+    // capture from a WAV file or from stdin ("-") instead of a device, paced at real-time speed
+    // useful for measuring the capture latency without a microphone - SDL_QUIT is sent at the end of the audio
+    bool init_file(const std::string & fname, int sample_rate);
+
     // start capturing audio via the provided SDL callback
     // keep last len_ms seconds of audio in a circular buffer
     bool resume();
@@ -31,19 +75,26 @@ public:
     // get audio data from the circular buffer
     void get(int ms, std::vector<float> & audio);
 
+    // get a view of the last ms of audio without copying it
+    // the data is valid until len_ms more audio is captured
+    size_t get_view(int ms, const float ** data);
+
 private:
+    bool is_open() const;
+
+    void file_thread(wav_reader * reader);
+
     SDL_AudioDeviceID m_dev_id_in = 0;
 
     int m_len_ms = 0;
     int m_sample_rate = 0;
 
     std::atomic_bool m_running;
-    std::mutex       m_mutex;
+    std::atomic_bool m_stop;
+
+    std::thread m_file_thread;
 
-    std::vector<float> m_audio;
-    std::vector<float> m_audio_new;
-    size_t             m_audio_pos = 0;
-    size_t             m_audio_len = 0;
+    audio_ring m_ring;
 };
 
 // Return false if need to quit
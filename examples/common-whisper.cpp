@@ -0,0 +1,136 @@
+#include "common-whisper.h"
+
+#include <algorithm>
+
+// the text tokens of the current result, with absolute timestamps
+static std::vector<stream_token> stream_la_hypothesis(struct whisper_context * ctx, struct whisper_state * state, int64_t t_offset) {
+    std::vector<stream_token> hyp;
+
+    const int n_segments = whisper_full_n_segments_from_state(state);
+    for (int i = 0; i < n_segments; ++i) {
+        const int n_tokens = whisper_full_n_tokens_from_state(state, i);
+
+        const size_t n_hyp = hyp.size();
+
+        for (int j = 0; j < n_tokens; ++j) {
+            const auto data = whisper_full_get_token_data_from_state(state, i, j);
+            if (data.id >= whisper_token_eot(ctx)) {
+                continue;
+            }
+
+            hyp.push_back({ data.id, t_offset + data.t0, t_offset + data.t1, -1, whisper_full_get_token_text_from_state(ctx, state, i, j) });
+        }
+
+        // the last segment may still grow, so only the earlier segments are known to be complete
+        if (i < n_segments - 1 && hyp.size() > n_hyp) {
+            hyp.back().t_seg_end = t_offset + whisper_full_get_segment_t1_from_state(state, i);
+        }
+    }
+
+    return hyp;
+}
+
+bool stream_la_process(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+                    stream_la & la,
+          whisper_full_params   wparams,
+                          int   n_samples_len,
+                         bool   flush,
+     const std::vector<float> & pcmf32_new,
+    std::vector<stream_token> & result) {
+    const int n_samples_30s = 30*WHISPER_SAMPLE_RATE;
+
+    const size_t n_prompt_max = 128;
+
+    result.clear();
+
+    la.pcmf32.insert(la.pcmf32.end(), pcmf32_new.begin(), pcmf32_new.end());
+
+    if (la.pcmf32.empty()) {
+        return true;
+    }
+
+    // a full buffer is committed, because it cannot grow beyond a window, and so is a buffer on which the hypotheses
+    // did not agree for more than n_samples_len
+    const int n_samples_cur = std::min((int) la.pcmf32.size(), n_samples_30s);
+
+    flush = flush || n_samples_cur == n_samples_30s || (int) la.pcmf32.size() > n_samples_len;
+
+    std::vector<whisper_token> prompt_tokens;
+    for (size_t i = la.committed.size() > n_prompt_max ? la.committed.size() - n_prompt_max : 0; i < la.committed.size(); ++i) {
+        prompt_tokens.push_back(la.committed[i].id);
+    }
+
+    wparams.prompt_tokens    = prompt_tokens.data();
+    wparams.prompt_n_tokens  = prompt_tokens.size();
+    wparams.token_timestamps = true;
+    wparams.single_segment   = false;
+
+    if (whisper_full_with_state(ctx, state, wparams, la.pcmf32.data(), n_samples_cur) != 0) {
+        return false;
+    }
+
+    auto hyp = stream_la_hypothesis(ctx, state, la.t_offset);
+
+    // the tokens that end before the last committed token were already committed
+    if (!la.committed.empty()) {
+        const int64_t t_committed = la.committed.back().t1;
+
+        hyp.erase(std::remove_if(hyp.begin(), hyp.end(), [&](const stream_token & token) { return token.t1 <= t_committed; }), hyp.end());
+    }
+
+    // the audio before the trim point may have left a few committed tokens at the start of the hypothesis
+    if (!la.committed.empty() && !hyp.empty() && hyp[0].t0 < la.committed.back().t1 + 100) {
+        const int n_max = std::min(std::min(5, (int) la.committed.size()), (int) hyp.size());
+
+        for (int n = n_max; n > 0; --n) {
+            bool match = true;
+            for (int k = 0; k < n && match; ++k) {
+                match = la.committed[la.committed.size() - n + k].id == hyp[k].id;
+            }
+
+            if (match) {
+                hyp.erase(hyp.begin(), hyp.begin() + n);
+                break;
+            }
+        }
+    }
+
+    // local agreement: commit the common prefix of the last two hypotheses
+    size_t n_commit = 0;
+    while (n_commit < hyp.size() && n_commit < la.hyp_prev.size() && hyp[n_commit].id == la.hyp_prev[n_commit].id) {
+        n_commit++;
+    }
+
+    if (flush) {
+        n_commit = hyp.size();
+    }
+
+    result.assign(hyp.begin(), hyp.begin() + n_commit);
+    la.hyp_prev.assign(hyp.begin() + n_commit, hyp.end());
+
+    la.committed.insert(la.committed.end(), result.begin(), result.end());
+    if (la.committed.size() > 2*n_prompt_max) {
+        la.committed.erase(la.committed.begin(), la.committed.end() - n_prompt_max);
+    }
+
+    // trim the audio at the last committed token (or the end of its segment), so that the committed text is not decoded again
+    int64_t t_trim = -1;
+    for (const auto & token : result) {
+        t_trim = std::max(t_trim, std::max(token.t1, token.t_seg_end));
+    }
+
+    if (flush) {
+        t_trim = la.t_offset + (100*(int64_t) n_samples_cur)/WHISPER_SAMPLE_RATE;
+    }
+
+    if (t_trim > la.t_offset) {
+        const int n_trim = std::min((int) la.pcmf32.size(), (int) ((t_trim - la.t_offset)*WHISPER_SAMPLE_RATE/100));
+
+        la.pcmf32.erase(la.pcmf32.begin(), la.pcmf32.begin() + n_trim);
+        la.t_offset += (100*(int64_t) n_trim)/WHISPER_SAMPLE_RATE;
+    }
+
+    return true;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "whisper.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+//
+// Committed-prefix streaming transcription
+//
+// Each step transcribes the audio that follows the last trim point, with the committed text as the prompt
+// The tokens on which two consecutive hypotheses agree (local agreement) are committed and never decoded again
+// The audio buffer is trimmed at the last committed token, so only the unstable tail is decoded again
+//
+
+struct stream_token {
+    whisper_token id;
+
+    int64_t t0; // absolute, in centiseconds since the start of the stream
+    int64_t t1;
+
+    int64_t t_seg_end; // end of the segment, if this is its last token and the segment is complete, -1 otherwise
+
+    std::string text;
+};
+
+struct stream_la {
+    std::vector<float> pcmf32; // the audio since the last trim point
+
+    int64_t t_offset = 0; // time of pcmf32[0], in centiseconds
+
+    std::vector<stream_token> committed; // the recent committed tokens (prompt)
+    std::vector<stream_token> hyp_prev;  // the uncommitted part of the previous hypothesis
+};
+
+// Append the new audio and transcribe the uncommitted audio with the given state
+// wparams are the inference parameters of the caller - the prompt and the token timestamps are set here
+// If the uncommitted audio grows beyond n_samples_len, the whole hypothesis is committed, as with flush
+// With flush set, the whole hypothesis is committed (e.g. at the end of the stream) - at most 30 s of audio are processed
+// per call, so the caller repeats the call until la.pcmf32 is empty
+// Returns the newly committed tokens in result - the tentative ones are left in la.hyp_prev
+bool stream_la_process(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+                    stream_la & la,
+          whisper_full_params   wparams,
+                          int   n_samples_len,
+                         bool   flush,
+     const std::vector<float> & pcmf32_new,
+    std::vector<stream_token> & result);
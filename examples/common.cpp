@@ -598,85 +598,341 @@ gpt_vocab::id gpt_sample_top_k_top_p_repeat(
 
 }
 
-bool read_wav(const std::string & fname, std::vector<float>& pcmf32, std::vector<std::vector<float>>& pcmf32s, bool stereo) {
-    drwav wav;
-    std::vector<uint8_t> wav_data; // used for pipe input from stdin
-
-    if (fname == "-") {
-        {
-            uint8_t buf[1024];
-            while (true)
-            {
-                const size_t n = fread(buf, 1, sizeof(buf), stdin);
-                if (n == 0) {
-                    break;
+// polyphase resampler by the rational factor L/M with a Blackman-windowed sinc low-pass filter
+// the output sample k is the filtered input at time k*M/L, delayed by half of the filter length
+struct wav_resampler {
+    int L = 1;
+    int M = 1;
+
+    int n_taps = 0; // taps per phase
+    int delay  = 0; // in samples at the upsampled rate
+
+    std::vector<float> filter; // [L][n_taps] - the taps of each phase in reverse order
+
+    std::vector<float> buf;      // the input samples starting at index buf_off (negative indices are zero)
+    int64_t            buf_off = 0;
+
+    int64_t n_in  = 0;
+    int64_t n_out = 0;
+
+    void init(int sample_rate_in, int sample_rate_out) {
+        int a = sample_rate_in;
+        int b = sample_rate_out;
+        while (b != 0) {
+            const int t = a % b;
+            a = b;
+            b = t;
+        }
+
+        L = sample_rate_out/a;
+        M = sample_rate_in/a;
+
+        // a wider low-pass filter is needed when decimating, to keep the transition band narrow
+        n_taps = 64*std::max(1, (M + L - 1)/L);
+
+        const int    n  = L*n_taps;
+        const double fc = 0.45/std::max(L, M); // cut-off frequency, in cycles per upsampled sample
+
+        // the filter has n - 1 non-zero taps, so that its center - and the delay - is a whole number of samples
+        delay = (n - 2)/2;
+
+        std::vector<double> h(n, 0.0);
+        for (int i = 0; i < n - 1; ++i) {
+            const double x = i - delay;
+            const double w = 0.42 - 0.5*cos(2.0*M_PI*i/(n - 2)) + 0.08*cos(4.0*M_PI*i/(n - 2));
+
+            h[i] = w*(x == 0.0 ? 2.0*fc : sin(2.0*M_PI*fc*x)/(M_PI*x));
+        }
+
+        // normalize each phase to unit gain, so that there is no ripple at DC
+        filter.resize(n);
+        for (int p = 0; p < L; ++p) {
+            double sum = 0.0;
+            for (int t = 0; t < n_taps; ++t) {
+                sum += h[p + t*L];
+            }
+            for (int t = 0; t < n_taps; ++t) {
+                filter[p*n_taps + (n_taps - 1 - t)] = h[p + t*L]/sum;
+            }
+        }
+
+        buf.assign(n_taps - 1, 0.0f);
+        buf_off = -(n_taps - 1);
+
+        n_in  = 0;
+        n_out = 0;
+    }
+
+    // the output samples that can be computed from the input so far
+    void process(const float * data, size_t n, std::vector<float> & out) {
+        buf.insert(buf.end(), data, data + n);
+        n_in += n;
+
+        run(out, -1);
+    }
+
+    // the remaining output samples, with the input padded with zeros
+    void flush(std::vector<float> & out) {
+        const int64_t n_out_total = (n_in*L + M - 1)/M;
+
+        if (n_out_total > n_out) {
+            const int64_t i_last = ((n_out_total - 1)*M + delay)/L;
+
+            buf.resize(std::max<int64_t>(buf.size(), i_last + 1 - buf_off), 0.0f);
+
+            run(out, n_out_total);
+        }
+    }
+
+    // compute the output samples up to n_out_max (-1 - no limit) for which the input is in the buffer
+    void run(std::vector<float> & out, int64_t n_out_max) {
+        const int64_t n_buf_end = buf_off + (int64_t) buf.size();
+
+        while (n_out_max < 0 || n_out < n_out_max) {
+            const int64_t pos = n_out*M + delay;
+            const int64_t i   = pos/L;
+
+            if (i >= n_buf_end) {
+                break;
+            }
+
+            const float * x = buf.data() + (i - (n_taps - 1) - buf_off);
+            const float * f = filter.data() + (pos % L)*n_taps;
+
+            // independent partial sums, so that the compiler can vectorize the dot product
+            float sum[8] = { 0.0f };
+            int t = 0;
+            for (; t + 8 <= n_taps; t += 8) {
+                for (int j = 0; j < 8; ++j) {
+                    sum[j] += f[t + j]*x[t + j];
                 }
-                wav_data.insert(wav_data.end(), buf, buf + n);
             }
+            for (; t < n_taps; ++t) {
+                sum[0] += f[t]*x[t];
+            }
+
+            out.push_back(((sum[0] + sum[1]) + (sum[2] + sum[3])) + ((sum[4] + sum[5]) + (sum[6] + sum[7])));
+
+            n_out++;
         }
 
-        if (drwav_init_memory(&wav, wav_data.data(), wav_data.size(), nullptr) == false) {
-            fprintf(stderr, "error: failed to open WAV file from stdin\n");
-            return false;
+        // drop the input samples that are not needed anymore
+        const int64_t n_drop = (n_out*M + delay)/L - (n_taps - 1) - buf_off;
+        if (n_drop > 4096) {
+            buf.erase(buf.begin(), buf.begin() + n_drop);
+            buf_off += n_drop;
         }
+    }
+};
+
+struct wav_reader {
+    drwav wav;
 
-        fprintf(stderr, "%s: read %zu bytes from stdin\n", __func__, wav_data.size());
+    bool stereo   = false;
+    bool is_stdin = false;
+    bool eof      = false;
+
+    size_t n_bytes_stdin = 0;
+
+    // the current block of decoded frames (interleaved) and of converted samples
+    std::vector<float> frames;
+    std::vector<float> block[3]; // mono, left, right
+
+    // the converted samples that were not returned yet
+    std::vector<float> pending[3];
+
+    bool          resample = false;
+    wav_resampler resampler[3];
+};
+
+static size_t wav_reader_on_read_stdin(void * user_data, void * buf, size_t n) {
+    auto * reader = (wav_reader *) user_data;
+
+    const size_t n_read = fread(buf, 1, n, stdin);
+    reader->n_bytes_stdin += n_read;
+
+    return n_read;
+}
+
+// stdin cannot seek - skip forward by reading
+static drwav_bool32 wav_reader_on_seek_stdin(void * user_data, int offset, drwav_seek_origin origin) {
+    if (origin != drwav_seek_origin_current || offset < 0) {
+        return DRWAV_FALSE;
+    }
+
+    char buf[4096];
+    while (offset > 0) {
+        const size_t n = std::min<size_t>(offset, sizeof(buf));
+        if (wav_reader_on_read_stdin(user_data, buf, n) != n) {
+            return DRWAV_FALSE;
+        }
+        offset -= n;
     }
-    else if (drwav_init_file(&wav, fname.c_str(), nullptr) == false) {
+
+    return DRWAV_TRUE;
+}
+
+wav_reader * wav_reader_init(const std::string & fname, bool stereo) {
+    wav_reader * reader = new wav_reader;
+
+    reader->stereo   = stereo;
+    reader->is_stdin = fname == "-";
+
+    if (reader->is_stdin) {
+        if (drwav_init_ex(&reader->wav, wav_reader_on_read_stdin, wav_reader_on_seek_stdin, nullptr, reader, nullptr, DRWAV_SEQUENTIAL, nullptr) == false) {
+            fprintf(stderr, "error: failed to open WAV file from stdin\n");
+            delete reader;
+            return nullptr;
+        }
+    } else if (drwav_init_file(&reader->wav, fname.c_str(), nullptr) == false) {
         fprintf(stderr, "error: failed to open '%s' as WAV file\n", fname.c_str());
-        return false;
+        delete reader;
+        return nullptr;
     }
 
-    if (wav.channels != 1 && wav.channels != 2) {
-        fprintf(stderr, "%s: WAV file '%s' must be mono or stereo\n", __func__, fname.c_str());
-        return false;
+    const auto & wav = reader->wav;
+
+    if (wav.channels < 1) {
+        fprintf(stderr, "%s: WAV file '%s' has no channels\n", __func__, fname.c_str());
+        wav_reader_free(reader);
+        return nullptr;
     }
 
     if (stereo && wav.channels != 2) {
         fprintf(stderr, "%s: WAV file '%s' must be stereo for diarization\n", __func__, fname.c_str());
-        return false;
+        wav_reader_free(reader);
+        return nullptr;
     }
 
     if (wav.sampleRate != COMMON_SAMPLE_RATE) {
-        fprintf(stderr, "%s: WAV file '%s' must be %i kHz\n", __func__, fname.c_str(), COMMON_SAMPLE_RATE/1000);
-        return false;
+        reader->resample = true;
+        for (auto & resampler : reader->resampler) {
+            resampler.init(wav.sampleRate, COMMON_SAMPLE_RATE);
+        }
     }
 
-    if (wav.bitsPerSample != 16) {
-        fprintf(stderr, "%s: WAV file '%s' must be 16-bit\n", __func__, fname.c_str());
-        return false;
+    return reader;
+}
+
+void wav_reader_free(wav_reader * reader) {
+    if (reader) {
+        drwav_uninit(&reader->wav);
+        delete reader;
     }
+}
+
+int64_t wav_reader_n_samples(const wav_reader * reader) {
+    return (int64_t) ((reader->wav.totalPCMFrameCount*COMMON_SAMPLE_RATE + reader->wav.sampleRate - 1)/reader->wav.sampleRate);
+}
+
+// decode the next block of frames and append the converted samples to reader.pending
+static void wav_reader_decode_block(wav_reader & reader) {
+    const int n_channels = reader.wav.channels;
+    const int n_block    = 4096;
+
+    reader.frames.resize(n_block*n_channels);
+
+    const size_t n = drwav_read_pcm_frames_f32(&reader.wav, n_block, reader.frames.data());
 
-    const uint64_t n = wav_data.empty() ? wav.totalPCMFrameCount : wav_data.size()/(wav.channels*wav.bitsPerSample/8);
+    const float * frames = reader.frames.data();
 
-    std::vector<int16_t> pcm16;
-    pcm16.resize(n*wav.channels);
-    drwav_read_pcm_frames_s16(&wav, n, pcm16.data());
-    drwav_uninit(&wav);
+    // mono, left and right channels, before resampling
+    auto & mono = reader.block[0];
+    auto & chl  = reader.block[1];
+    auto & chr  = reader.block[2];
 
-    // convert to mono, float
-    pcmf32.resize(n);
-    if (wav.channels == 1) {
-        for (uint64_t i = 0; i < n; i++) {
-            pcmf32[i] = float(pcm16[i])/32768.0f;
+    mono.resize(n);
+
+    if (n_channels == 1) {
+        memcpy(mono.data(), frames, n*sizeof(float));
+    } else if (n_channels == 2) {
+        for (size_t i = 0; i < n; i++) {
+            mono[i] = (frames[2*i] + frames[2*i + 1])*0.5f;
         }
     } else {
-        for (uint64_t i = 0; i < n; i++) {
-            pcmf32[i] = float(pcm16[2*i] + pcm16[2*i + 1])/65536.0f;
+        const float scale = 1.0f/n_channels;
+        for (size_t i = 0; i < n; i++) {
+            float sum = 0.0f;
+            for (int c = 0; c < n_channels; ++c) {
+                sum += frames[i*n_channels + c];
+            }
+            mono[i] = sum*scale;
         }
     }
 
-    if (stereo) {
-        // convert to stereo, float
-        pcmf32s.resize(2);
+    if (reader.stereo) {
+        chl.resize(n);
+        chr.resize(n);
+        for (size_t i = 0; i < n; i++) {
+            chl[i] = frames[2*i];
+            chr[i] = frames[2*i + 1];
+        }
+    }
+
+    const int n_out = reader.stereo ? 3 : 1;
 
-        pcmf32s[0].resize(n);
-        pcmf32s[1].resize(n);
-        for (uint64_t i = 0; i < n; i++) {
-            pcmf32s[0][i] = float(pcm16[2*i])/32768.0f;
-            pcmf32s[1][i] = float(pcm16[2*i + 1])/32768.0f;
+    if (n == 0) {
+        reader.eof = true;
+    }
+
+    for (int c = 0; c < n_out; ++c) {
+        if (!reader.resample) {
+            reader.pending[c].insert(reader.pending[c].end(), reader.block[c].begin(), reader.block[c].end());
+        } else if (n > 0) {
+            reader.resampler[c].process(reader.block[c].data(), n, reader.pending[c]);
+        } else {
+            reader.resampler[c].flush(reader.pending[c]);
         }
     }
+}
+
+size_t wav_reader_read(
+        wav_reader * reader,
+        std::vector<float> & pcmf32,
+        std::vector<std::vector<float>> & pcmf32s,
+        size_t n_max) {
+    while (!reader->eof && reader->pending[0].size() < n_max) {
+        wav_reader_decode_block(*reader);
+    }
+
+    const size_t n = std::min(n_max, reader->pending[0].size());
+
+    if (reader->stereo) {
+        pcmf32s.resize(2);
+    }
+
+    for (int c = 0; c < (reader->stereo ? 3 : 1); ++c) {
+        auto & src = reader->pending[c];
+        auto & dst = c == 0 ? pcmf32 : pcmf32s[c - 1];
+
+        dst.insert(dst.end(), src.begin(), src.begin() + n);
+        src.erase(src.begin(), src.begin() + n);
+    }
+
+    return n;
+}
+
+bool read_wav(const std::string & fname, std::vector<float>& pcmf32, std::vector<std::vector<float>>& pcmf32s, bool stereo) {
+    wav_reader * reader = wav_reader_init(fname, stereo);
+    if (reader == nullptr) {
+        return false;
+    }
+
+    pcmf32.clear();
+    pcmf32s.clear();
+
+    if (!reader->is_stdin) {
+        pcmf32.reserve(wav_reader_n_samples(reader));
+    }
+
+    while (wav_reader_read(reader, pcmf32, pcmf32s, 256*1024) > 0) {
+    }
+
+    if (reader->is_stdin) {
+        fprintf(stderr, "%s: read %zu bytes from stdin\n", __func__, reader->n_bytes_stdin);
+    }
+
+    wav_reader_free(reader);
 
     return true;
 }
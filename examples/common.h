@@ -128,8 +128,31 @@ gpt_vocab::id gpt_sample_top_k_top_p_repeat(
 // Audio utils
 //
 
+// Streaming WAV reader
+// Decodes the audio of a WAV file, or of stdin if fname is "-", in blocks
+// Any channel count, sample format (8/16/24/32-bit integer, float, A-law, mu-law) and sample rate supported by dr_wav is
+// accepted - the audio is mixed down to mono and resampled to COMMON_SAMPLE_RATE with a polyphase filter
+// If stereo flag is set, the audio must have 2 channels, which are also returned separately
+struct wav_reader;
+
+// Returns nullptr on failure
+wav_reader * wav_reader_init(const std::string & fname, bool stereo);
+
+void wav_reader_free(wav_reader * reader);
+
+// Appends up to n_max samples at COMMON_SAMPLE_RATE to pcmf32 (and to pcmf32s[0] and pcmf32s[1] if stereo)
+// Returns the number of appended samples, 0 at the end of the audio
+size_t wav_reader_read(
+        wav_reader * reader,
+        std::vector<float> & pcmf32,
+        std::vector<std::vector<float>> & pcmf32s,
+        size_t n_max);
+
+// The number of samples at COMMON_SAMPLE_RATE according to the WAV header (may be wrong for stdin)
+int64_t wav_reader_n_samples(const wav_reader * reader);
+
 // Read WAV audio file and store the PCM data into pcmf32
-// The sample rate of the audio must be equal to COMMON_SAMPLE_RATE
+// The audio is converted to mono and resampled to COMMON_SAMPLE_RATE (see wav_reader_init())
 // If stereo flag is set and the audio has 2 channels, the pcmf32s will contain 2 channel PCM
 bool read_wav(
         const std::string & fname,
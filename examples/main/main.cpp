@@ -1,10 +1,14 @@
 #include "common.h"
 
 #include "whisper.h"
+#include "ggml.h"
 
+#include <atomic>
+#include <chrono>
 #include <cmath>
 #include <fstream>
 #include <cstdio>
+#include <mutex>
 #include <string>
 #include <thread>
 #include <vector>
@@ -56,6 +60,10 @@ void replace_all(std::string & s, const std::string & search, const std::string
 struct whisper_params {
     int32_t n_threads    = std::min(4, (int32_t) std::thread::hardware_concurrency());
     int32_t n_processors =  1;
+    int32_t n_threads_enc =  0;
+    int32_t n_threads_dec =  0;
+    int32_t n_threads_mel =  0;
+    int32_t cpu_offset   = -1;
     int32_t offset_t_ms  =  0;
     int32_t offset_n     =  0;
     int32_t duration_ms  =  0;
@@ -63,18 +71,28 @@ struct whisper_params {
     int32_t max_len      =  0;
     int32_t best_of      =  2;
     int32_t beam_size    = -1;
+    int32_t n_temp_parallel = 0; // temperatures decoded concurrently
+    int32_t n_draft      =  4; // tokens proposed by the draft model
+    int32_t n_workers    =  0; // files transcribed concurrently (batch mode)
 
     float word_thold    =  0.01f;
     float entropy_thold =  2.40f;
     float logprob_thold = -1.00f;
 
     bool speed_up        = false;
+    bool audio_ctx_auto  = false;
     bool translate       = false;
+    bool translate_also  = false; // transcribe and translate in one pass
     bool detect_language = false;
     bool diarize         = false;
     bool tinydiarize     = false;
     bool split_on_word   = false;
+    bool single_segment  = false;
     bool no_fallback     = false;
+    bool encode_ahead    = false;
+    bool long_form       = false;
+    bool clips           = false; // transcribe the input files as clips of one audio
+    bool encoder_batch   = false;
     bool output_txt      = false;
     bool output_vtt      = false;
     bool output_srt      = false;
@@ -91,6 +109,7 @@ struct whisper_params {
     std::string prompt;
     std::string font_path = "/System/Library/Fonts/Supplemental/Courier New Bold.ttf";
     std::string model     = "models/ggml-base.en.bin";
+    std::string model_draft;
 
     // [TDRZ] speaker turn string
     std::string tdrz_speaker_turn = " [SPEAKER_TURN]"; // TODO: set from command line
@@ -123,6 +142,10 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params) {
         }
         else if (arg == "-t"    || arg == "--threads")         { params.n_threads       = std::stoi(argv[++i]); }
         else if (arg == "-p"    || arg == "--processors")      { params.n_processors    = std::stoi(argv[++i]); }
+        else if (arg == "-te"   || arg == "--threads-encoder") { params.n_threads_enc   = std::stoi(argv[++i]); }
+        else if (arg == "-td"   || arg == "--threads-decoder") { params.n_threads_dec   = std::stoi(argv[++i]); }
+        else if (arg == "-tm"   || arg == "--threads-mel")     { params.n_threads_mel   = std::stoi(argv[++i]); }
+        else if (arg == "-co"   || arg == "--cpu-offset")      { params.cpu_offset      = std::stoi(argv[++i]); }
         else if (arg == "-ot"   || arg == "--offset-t")        { params.offset_t_ms     = std::stoi(argv[++i]); }
         else if (arg == "-on"   || arg == "--offset-n")        { params.offset_n        = std::stoi(argv[++i]); }
         else if (arg == "-d"    || arg == "--duration")        { params.duration_ms     = std::stoi(argv[++i]); }
@@ -134,10 +157,19 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params) {
         else if (arg == "-et"   || arg == "--entropy-thold")   { params.entropy_thold   = std::stof(argv[++i]); }
         else if (arg == "-lpt"  || arg == "--logprob-thold")   { params.logprob_thold   = std::stof(argv[++i]); }
         else if (arg == "-su"   || arg == "--speed-up")        { params.speed_up        = true; }
+        else if (arg == "-aca"  || arg == "--audio-ctx-auto")  { params.audio_ctx_auto  = true; }
         else if (arg == "-tr"   || arg == "--translate")       { params.translate       = true; }
+        else if (arg == "-tra"  || arg == "--translate-also")  { params.translate_also  = true; }
         else if (arg == "-di"   || arg == "--diarize")         { params.diarize         = true; }
         else if (arg == "-tdrz" || arg == "--tinydiarize")     { params.tinydiarize     = true; }
         else if (arg == "-sow"  || arg == "--split-on-word")   { params.split_on_word   = true; }
+        else if (arg == "-ss"   || arg == "--single-segment")  { params.single_segment  = true; }
+        else if (arg == "-tp"   || arg == "--temp-parallel")   { params.n_temp_parallel = std::stoi(argv[++i]); }
+        else if (arg == "-ea"   || arg == "--encode-ahead")    { params.encode_ahead    = true; }
+        else if (arg == "-lf"   || arg == "--long-form")       { params.long_form       = true; }
+        else if (arg == "-cl"   || arg == "--clips")           { params.clips           = true; }
+        else if (arg == "-bw"   || arg == "--batch-workers")   { params.n_workers       = std::stoi(argv[++i]); }
+        else if (arg == "-eb"   || arg == "--encoder-batch")   { params.encoder_batch   = true; }
         else if (arg == "-nf"   || arg == "--no-fallback")     { params.no_fallback     = true; }
         else if (arg == "-otxt" || arg == "--output-txt")      { params.output_txt      = true; }
         else if (arg == "-ovtt" || arg == "--output-vtt")      { params.output_vtt      = true; }
@@ -156,6 +188,8 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params) {
         else if (arg == "-dl"   || arg == "--detect-language") { params.detect_language = true; }
         else if (                  arg == "--prompt")          { params.prompt          = argv[++i]; }
         else if (arg == "-m"    || arg == "--model")           { params.model           = argv[++i]; }
+        else if (arg == "-md"   || arg == "--model-draft")     { params.model_draft     = argv[++i]; }
+        else if (arg == "-nd"   || arg == "--draft-tokens")    { params.n_draft         = std::stoi(argv[++i]); }
         else if (arg == "-f"    || arg == "--file")            { params.fname_inp.emplace_back(argv[++i]); }
         else if (arg == "-oved" || arg == "--ov-e-device")     { params.openvino_encode_device = argv[++i]; }
         else {
@@ -176,22 +210,35 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "  -h,        --help              [default] show this help message and exit\n");
     fprintf(stderr, "  -t N,      --threads N         [%-7d] number of threads to use during computation\n",    params.n_threads);
     fprintf(stderr, "  -p N,      --processors N      [%-7d] number of processors to use during computation\n", params.n_processors);
+    fprintf(stderr, "  -te N,     --threads-encoder N [%-7d] number of encoder threads (0 - same as --threads)\n", params.n_threads_enc);
+    fprintf(stderr, "  -td N,     --threads-decoder N [%-7d] number of decoder threads (0 - same as --threads, -1 - auto)\n", params.n_threads_dec);
+    fprintf(stderr, "  -tm N,     --threads-mel N     [%-7d] number of spectrogram threads (0 - same as --threads)\n", params.n_threads_mel);
+    fprintf(stderr, "  -co N,     --cpu-offset N      [%-7d] run on the CPUs starting at N (-1 - no pinning)\n", params.cpu_offset);
     fprintf(stderr, "  -ot N,     --offset-t N        [%-7d] time offset in milliseconds\n",                    params.offset_t_ms);
     fprintf(stderr, "  -on N,     --offset-n N        [%-7d] segment index offset\n",                           params.offset_n);
     fprintf(stderr, "  -d  N,     --duration N        [%-7d] duration of audio to process in milliseconds\n",   params.duration_ms);
     fprintf(stderr, "  -mc N,     --max-context N     [%-7d] maximum number of text context tokens to store\n", params.max_context);
     fprintf(stderr, "  -ml N,     --max-len N         [%-7d] maximum segment length in characters\n",           params.max_len);
     fprintf(stderr, "  -sow,      --split-on-word     [%-7s] split on word rather than on token\n",             params.split_on_word ? "true" : "false");
+    fprintf(stderr, "  -ss,       --single-segment    [%-7s] one segment per 30 s window\n",                   params.single_segment ? "true" : "false");
     fprintf(stderr, "  -bo N,     --best-of N         [%-7d] number of best candidates to keep\n",              params.best_of);
     fprintf(stderr, "  -bs N,     --beam-size N       [%-7d] beam size for beam search\n",                      params.beam_size);
     fprintf(stderr, "  -wt N,     --word-thold N      [%-7.2f] word timestamp probability threshold\n",         params.word_thold);
     fprintf(stderr, "  -et N,     --entropy-thold N   [%-7.2f] entropy threshold for decoder fail\n",           params.entropy_thold);
     fprintf(stderr, "  -lpt N,    --logprob-thold N   [%-7.2f] log probability threshold for decoder fail\n",   params.logprob_thold);
     fprintf(stderr, "  -su,       --speed-up          [%-7s] speed up audio by x2 (reduced accuracy)\n",        params.speed_up ? "true" : "false");
+    fprintf(stderr, "  -aca,      --audio-ctx-auto    [%-7s] smaller audio context for the audio shorter than 30 s\n", params.audio_ctx_auto ? "true" : "false");
     fprintf(stderr, "  -tr,       --translate         [%-7s] translate from source language to english\n",      params.translate ? "true" : "false");
+    fprintf(stderr, "  -tra,      --translate-also    [%-7s] also translate, encoding the audio once for both\n", params.translate_also ? "true" : "false");
     fprintf(stderr, "  -di,       --diarize           [%-7s] stereo audio diarization\n",                       params.diarize ? "true" : "false");
     fprintf(stderr, "  -tdrz,     --tinydiarize       [%-7s] enable tinydiarize (requires a tdrz model)\n",     params.tinydiarize ? "true" : "false");
     fprintf(stderr, "  -nf,       --no-fallback       [%-7s] do not use temperature fallback while decoding\n", params.no_fallback ? "true" : "false");
+    fprintf(stderr, "  -tp N,     --temp-parallel N   [%-7d] number of fallback temperatures to decode concurrently\n", params.n_temp_parallel);
+    fprintf(stderr, "  -ea,       --encode-ahead      [%-7s] encode the next window while decoding the current one (with -ss)\n", params.encode_ahead ? "true" : "false");
+    fprintf(stderr, "  -lf,       --long-form         [%-7s] read and transcribe the audio in chunks, with bounded memory\n", params.long_form ? "true" : "false");
+    fprintf(stderr, "  -cl,       --clips             [%-7s] transcribe the input files (short clips) in one pass\n", params.clips ? "true" : "false");
+    fprintf(stderr, "  -bw N,     --batch-workers N   [%-7d] number of files transcribed concurrently (0 - one at a time)\n", params.n_workers);
+    fprintf(stderr, "  -eb,       --encoder-batch     [%-7s] batch the encoder passes of the batch workers\n", params.encoder_batch ? "true" : "false");
     fprintf(stderr, "  -otxt,     --output-txt        [%-7s] output result in a text file\n",                   params.output_txt ? "true" : "false");
     fprintf(stderr, "  -ovtt,     --output-vtt        [%-7s] output result in a vtt file\n",                    params.output_vtt ? "true" : "false");
     fprintf(stderr, "  -osrt,     --output-srt        [%-7s] output result in a srt file\n",                    params.output_srt ? "true" : "false");
@@ -209,18 +256,28 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "  -dl,       --detect-language   [%-7s] exit after automatically detecting language\n",    params.detect_language ? "true" : "false");
     fprintf(stderr, "             --prompt PROMPT     [%-7s] initial prompt\n",                                 params.prompt.c_str());
     fprintf(stderr, "  -m FNAME,  --model FNAME       [%-7s] model path\n",                                     params.model.c_str());
+    fprintf(stderr, "  -md FNAME, --model-draft FNAME [%-7s] draft model path for speculative greedy decoding\n", params.model_draft.c_str());
+    fprintf(stderr, "  -nd N,     --draft-tokens N    [%-7d] number of tokens proposed by the draft model\n",  params.n_draft);
     fprintf(stderr, "  -f FNAME,  --file FNAME        [%-7s] input WAV file path\n",                            "");
     fprintf(stderr, "  -oved D,   --ov-e-device DNAME [%-7s] the OpenVINO device used for encode inference\n",  params.openvino_encode_device.c_str());
     fprintf(stderr, "\n");
 }
 
+struct output_sink;
+
+void output_sink_write(output_sink & sink, struct whisper_state * state, int n_new);
+
 struct whisper_print_user_data {
     const whisper_params * params;
 
     const std::vector<std::vector<float>> * pcmf32s;
+
+    int n_printed; // segments printed so far (spans all chunks in long-form mode)
+
+    output_sink * sink; // the new segments are also written to the output files (optional)
 };
 
-std::string estimate_diarization_speaker(std::vector<std::vector<float>> pcmf32s, int64_t t0, int64_t t1, bool id_only = false) {
+std::string estimate_diarization_speaker(const std::vector<std::vector<float>> & pcmf32s, int64_t t0, int64_t t1, bool id_only = false) {
     std::string speaker = "";
     const int64_t n_samples = pcmf32s[0].size();
 
@@ -253,11 +310,12 @@ std::string estimate_diarization_speaker(std::vector<std::vector<float>> pcmf32s
     return speaker;
 }
 
-void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper_state * /*state*/, int n_new, void * user_data) {
+void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper_state * state, int n_new, void * user_data) {
+    auto & n_printed     =  ((whisper_print_user_data *) user_data)->n_printed;
     const auto & params  = *((whisper_print_user_data *) user_data)->params;
     const auto & pcmf32s = *((whisper_print_user_data *) user_data)->pcmf32s;
 
-    const int n_segments = whisper_full_n_segments(ctx);
+    const int n_segments = whisper_full_n_segments_from_state(state);
 
     std::string speaker = "";
 
@@ -267,14 +325,16 @@ void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper
     // print the last n_new segments
     const int s0 = n_segments - n_new;
 
-    if (s0 == 0) {
+    if (n_printed == 0) {
         printf("\n");
     }
 
+    n_printed += n_new;
+
     for (int i = s0; i < n_segments; i++) {
         if (!params.no_timestamps || params.diarize) {
-            t0 = whisper_full_get_segment_t0(ctx, i);
-            t1 = whisper_full_get_segment_t1(ctx, i);
+            t0 = whisper_full_get_segment_t0_from_state(state, i);
+            t1 = whisper_full_get_segment_t1_from_state(state, i);
         }
 
         if (!params.no_timestamps) {
@@ -286,29 +346,29 @@ void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper
         }
 
         if (params.print_colors) {
-            for (int j = 0; j < whisper_full_n_tokens(ctx, i); ++j) {
+            for (int j = 0; j < whisper_full_n_tokens_from_state(state, i); ++j) {
                 if (params.print_special == false) {
-                    const whisper_token id = whisper_full_get_token_id(ctx, i, j);
+                    const whisper_token id = whisper_full_get_token_id_from_state(state, i, j);
                     if (id >= whisper_token_eot(ctx)) {
                         continue;
                     }
                 }
 
-                const char * text = whisper_full_get_token_text(ctx, i, j);
-                const float  p    = whisper_full_get_token_p   (ctx, i, j);
+                const char * text = whisper_full_get_token_text_from_state(ctx, state, i, j);
+                const float  p    = whisper_full_get_token_p_from_state   (state, i, j);
 
                 const int col = std::max(0, std::min((int) k_colors.size() - 1, (int) (std::pow(p, 3)*float(k_colors.size()))));
 
                 printf("%s%s%s%s", speaker.c_str(), k_colors[col].c_str(), text, "\033[0m");
             }
         } else {
-            const char * text = whisper_full_get_segment_text(ctx, i);
+            const char * text = whisper_full_get_segment_text_from_state(state, i);
 
             printf("%s%s", speaker.c_str(), text);
         }
 
         if (params.tinydiarize) {
-            if (whisper_full_get_segment_speaker_turn_next(ctx, i)) {
+            if (whisper_full_get_segment_speaker_turn_next_from_state(state, i)) {
                 printf("%s", params.tdrz_speaker_turn.c_str());
             }
         }
@@ -320,94 +380,10 @@ void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper
 
         fflush(stdout);
     }
-}
 
-bool output_txt(struct whisper_context * ctx, const char * fname, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
-    std::ofstream fout(fname);
-    if (!fout.is_open()) {
-        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname);
-        return false;
+    if (((whisper_print_user_data *) user_data)->sink) {
+        output_sink_write(*((whisper_print_user_data *) user_data)->sink, state, n_new);
     }
-
-    fprintf(stderr, "%s: saving output to '%s'\n", __func__, fname);
-
-    const int n_segments = whisper_full_n_segments(ctx);
-    for (int i = 0; i < n_segments; ++i) {
-        const char * text = whisper_full_get_segment_text(ctx, i);
-        std::string speaker = "";
-
-        if (params.diarize && pcmf32s.size() == 2)
-        {
-            const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-            const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
-            speaker = estimate_diarization_speaker(pcmf32s, t0, t1);
-        }
-
-        fout << speaker << text << "\n";
-    }
-
-    return true;
-}
-
-bool output_vtt(struct whisper_context * ctx, const char * fname, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
-    std::ofstream fout(fname);
-    if (!fout.is_open()) {
-        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname);
-        return false;
-    }
-
-    fprintf(stderr, "%s: saving output to '%s'\n", __func__, fname);
-
-    fout << "WEBVTT\n\n";
-
-    const int n_segments = whisper_full_n_segments(ctx);
-    for (int i = 0; i < n_segments; ++i) {
-        const char * text = whisper_full_get_segment_text(ctx, i);
-        const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-        const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
-        std::string speaker = "";
-
-        if (params.diarize && pcmf32s.size() == 2)
-        {
-            speaker = estimate_diarization_speaker(pcmf32s, t0, t1, true);
-            speaker.insert(0, "<v Speaker");
-            speaker.append(">");
-        }
-
-        fout << to_timestamp(t0) << " --> " << to_timestamp(t1) << "\n";
-        fout << speaker << text << "\n\n";
-    }
-
-    return true;
-}
-
-bool output_srt(struct whisper_context * ctx, const char * fname, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
-    std::ofstream fout(fname);
-    if (!fout.is_open()) {
-        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname);
-        return false;
-    }
-
-    fprintf(stderr, "%s: saving output to '%s'\n", __func__, fname);
-
-    const int n_segments = whisper_full_n_segments(ctx);
-    for (int i = 0; i < n_segments; ++i) {
-        const char * text = whisper_full_get_segment_text(ctx, i);
-        const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-        const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
-        std::string speaker = "";
-
-        if (params.diarize && pcmf32s.size() == 2)
-        {
-            speaker = estimate_diarization_speaker(pcmf32s, t0, t1);
-        }
-
-        fout << i + 1 + params.offset_n << "\n";
-        fout << to_timestamp(t0, true) << " --> " << to_timestamp(t1, true) << "\n";
-        fout << speaker << text << "\n\n";
-    }
-
-    return true;
 }
 
 char *escape_double_quotes_and_backslashes(const char *str) {
@@ -441,62 +417,158 @@ char *escape_double_quotes_and_backslashes(const char *str) {
     return escaped;
 }
 
-bool output_csv(struct whisper_context * ctx, const char * fname, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
-    std::ofstream fout(fname);
-    if (!fout.is_open()) {
-        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname);
-        return false;
+//
+// output files
+//
+// the files are written segment by segment, from the new_segment_callback, so they are complete as soon as the
+// transcription is done and the segments do not have to be kept until the end
+//
+
+struct output_file;
+
+// the writers of a file format
+struct output_format {
+    const char * ext;
+
+    // called before the first segment (optional)
+    void (*begin)(output_sink & sink, output_file & out, struct whisper_state * state);
+
+    void (*segment)(output_sink & sink, output_file & out, struct whisper_state * state, int i_segment);
+
+    // called after the last segment (optional)
+    void (*end)(output_sink & sink, output_file & out, struct whisper_state * state);
+};
+
+// an output file and its progress
+struct output_file {
+    const output_format * format;
+
+    std::string   fname;
+    std::ofstream fout;
+
+    bool started    = false;
+    int  n_segments = 0; // segments written so far
+    int  indent     = 0; // JSON nesting level
+};
+
+// the output files of one input file
+struct output_sink {
+    struct whisper_context * ctx;
+
+    const whisper_params * params;
+
+    // the audio is only referenced, for the diarization
+    const std::vector<std::vector<float>> * pcmf32s;
+
+    std::string fname_inp;
+    float       t_sec;
+
+    std::vector<output_file> files;
+};
+
+bool output_diarize(const output_sink & sink) {
+    return sink.params->diarize && sink.pcmf32s->size() == 2;
+}
+
+void output_txt_segment(output_sink & sink, output_file & out, struct whisper_state * state, int i) {
+    const char * text = whisper_full_get_segment_text_from_state(state, i);
+    std::string speaker = "";
+
+    if (output_diarize(sink))
+    {
+        const int64_t t0 = whisper_full_get_segment_t0_from_state(state, i);
+        const int64_t t1 = whisper_full_get_segment_t1_from_state(state, i);
+        speaker = estimate_diarization_speaker(*sink.pcmf32s, t0, t1);
     }
 
-    fprintf(stderr, "%s: saving output to '%s'\n", __func__, fname);
+    out.fout << speaker << text << "\n";
+}
 
-    const int n_segments = whisper_full_n_segments(ctx);
-    fout << "start,end,";
-    if (params.diarize && pcmf32s.size() == 2)
+void output_vtt_begin(output_sink & /*sink*/, output_file & out, struct whisper_state * /*state*/) {
+    out.fout << "WEBVTT\n\n";
+}
+
+void output_vtt_segment(output_sink & sink, output_file & out, struct whisper_state * state, int i) {
+    const char * text = whisper_full_get_segment_text_from_state(state, i);
+    const int64_t t0 = whisper_full_get_segment_t0_from_state(state, i);
+    const int64_t t1 = whisper_full_get_segment_t1_from_state(state, i);
+    std::string speaker = "";
+
+    if (output_diarize(sink))
     {
-        fout << "speaker,";
+        speaker = estimate_diarization_speaker(*sink.pcmf32s, t0, t1, true);
+        speaker.insert(0, "<v Speaker");
+        speaker.append(">");
     }
-    fout << "text\n";
 
-    for (int i = 0; i < n_segments; ++i) {
-        const char * text = whisper_full_get_segment_text(ctx, i);
-        const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-        const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
-        char * text_escaped = escape_double_quotes_and_backslashes(text);
+    out.fout << to_timestamp(t0) << " --> " << to_timestamp(t1) << "\n";
+    out.fout << speaker << text << "\n\n";
+}
 
-        //need to multiply times returned from whisper_full_get_segment_t{0,1}() by 10 to get milliseconds.
-        fout << 10 * t0 << "," << 10 * t1 << ",";
-        if (params.diarize && pcmf32s.size() == 2)
-        {
-            fout << estimate_diarization_speaker(pcmf32s, t0, t1, true) << ",";
-        }
-        fout << "\"" << text_escaped << "\"\n";
+void output_srt_segment(output_sink & sink, output_file & out, struct whisper_state * state, int i) {
+    const char * text = whisper_full_get_segment_text_from_state(state, i);
+    const int64_t t0 = whisper_full_get_segment_t0_from_state(state, i);
+    const int64_t t1 = whisper_full_get_segment_t1_from_state(state, i);
+    std::string speaker = "";
+
+    if (output_diarize(sink))
+    {
+        speaker = estimate_diarization_speaker(*sink.pcmf32s, t0, t1);
     }
 
-    return true;
+    // in long-form mode, the segment indices restart with each chunk
+    out.fout << out.n_segments + 1 + sink.params->offset_n << "\n";
+    out.fout << to_timestamp(t0, true) << " --> " << to_timestamp(t1, true) << "\n";
+    out.fout << speaker << text << "\n\n";
+}
+
+void output_csv_begin(output_sink & sink, output_file & out, struct whisper_state * /*state*/) {
+    out.fout << "start,end,";
+    if (output_diarize(sink))
+    {
+        out.fout << "speaker,";
+    }
+    out.fout << "text\n";
+}
+
+void output_csv_segment(output_sink & sink, output_file & out, struct whisper_state * state, int i) {
+    const char * text = whisper_full_get_segment_text_from_state(state, i);
+    const int64_t t0 = whisper_full_get_segment_t0_from_state(state, i);
+    const int64_t t1 = whisper_full_get_segment_t1_from_state(state, i);
+    char * text_escaped = escape_double_quotes_and_backslashes(text);
+
+    //need to multiply times returned from whisper_full_get_segment_t{0,1}() by 10 to get milliseconds.
+    out.fout << 10 * t0 << "," << 10 * t1 << ",";
+    if (output_diarize(sink))
+    {
+        out.fout << estimate_diarization_speaker(*sink.pcmf32s, t0, t1, true) << ",";
+    }
+    out.fout << "\"" << text_escaped << "\"\n";
+
+    free(text_escaped);
 }
 
-bool output_json(struct whisper_context * ctx, const char * fname, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
-    std::ofstream fout(fname);
-    int indent = 0;
+struct json_writer {
+    std::ofstream & fout;
+    int & indent;
 
-    auto doindent = [&]() {
+    void doindent() {
         for (int i = 0; i < indent; i++) fout << "\t";
-    };
+    }
 
-    auto start_arr = [&](const char *name) {
+    void start_arr(const char *name) {
         doindent();
         fout << "\"" << name << "\": [\n";
         indent++;
-    };
+    }
 
-    auto end_arr = [&](bool end) {
+    void end_arr(bool end) {
         indent--;
         doindent();
         fout << (end ? "]\n" : "},\n");
-    };
+    }
 
-    auto start_obj = [&](const char *name) {
+    void start_obj(const char *name) {
         doindent();
         if (name) {
             fout << "\"" << name << "\": {\n";
@@ -504,278 +576,679 @@ bool output_json(struct whisper_context * ctx, const char * fname, const whisper
             fout << "{\n";
         }
         indent++;
-    };
+    }
 
-    auto end_obj = [&](bool end) {
+    void end_obj(bool end) {
         indent--;
         doindent();
         fout << (end ? "}\n" : "},\n");
-    };
+    }
 
-    auto start_value = [&](const char *name) {
+    void start_value(const char *name) {
         doindent();
         fout << "\"" << name << "\": ";
-    };
+    }
 
-    auto value_s = [&](const char *name, const char *val, bool end) {
+    void value_s(const char *name, const char *val, bool end) {
         start_value(name);
         char * val_escaped = escape_double_quotes_and_backslashes(val);
         fout << "\"" << val_escaped << (end ? "\"\n" : "\",\n");
         free(val_escaped);
-    };
+    }
 
-    auto end_value = [&](bool end) {
+    void end_value(bool end) {
         fout << (end ? "\n" : ",\n");
-    };
+    }
 
-    auto value_i = [&](const char *name, const int64_t val, bool end) {
+    void value_i(const char *name, const int64_t val, bool end) {
         start_value(name);
         fout << val;
         end_value(end);
-    };
+    }
 
-    auto value_b = [&](const char *name, const bool val, bool end) {
+    void value_b(const char *name, const bool val, bool end) {
         start_value(name);
         fout << (val ? "true" : "false");
         end_value(end);
-    };
+    }
+};
 
-    if (!fout.is_open()) {
-        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname);
-        return false;
-    }
-
-    fprintf(stderr, "%s: saving output to '%s'\n", __func__, fname);
-    start_obj(nullptr);
-        value_s("systeminfo", whisper_print_system_info(), false);
-        start_obj("model");
-            value_s("type", whisper_model_type_readable(ctx), false);
-            value_b("multilingual", whisper_is_multilingual(ctx), false);
-            value_i("vocab", whisper_model_n_vocab(ctx), false);
-            start_obj("audio");
-                value_i("ctx", whisper_model_n_audio_ctx(ctx), false);
-                value_i("state", whisper_model_n_audio_state(ctx), false);
-                value_i("head", whisper_model_n_audio_head(ctx), false);
-                value_i("layer", whisper_model_n_audio_layer(ctx), true);
-            end_obj(false);
-            start_obj("text");
-                value_i("ctx", whisper_model_n_text_ctx(ctx), false);
-                value_i("state", whisper_model_n_text_state(ctx), false);
-                value_i("head", whisper_model_n_text_head(ctx), false);
-                value_i("layer", whisper_model_n_text_layer(ctx), true);
-            end_obj(false);
-            value_i("mels", whisper_model_n_mels(ctx), false);
-            value_i("ftype", whisper_model_ftype(ctx), true);
-        end_obj(false);
-        start_obj("params");
-            value_s("model", params.model.c_str(), false);
-            value_s("language", params.language.c_str(), false);
-            value_b("translate", params.translate, true);
-        end_obj(false);
-        start_obj("result");
-            value_s("language", whisper_lang_str(whisper_full_lang_id(ctx)), true);
-        end_obj(false);
-        start_arr("transcription");
-
-            const int n_segments = whisper_full_n_segments(ctx);
-            for (int i = 0; i < n_segments; ++i) {
-                const char * text = whisper_full_get_segment_text(ctx, i);
-
-                const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-                const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
-
-                start_obj(nullptr);
-                    start_obj("timestamps");
-                        value_s("from", to_timestamp(t0, true).c_str(), false);
-                        value_s("to", to_timestamp(t1, true).c_str(), true);
-                    end_obj(false);
-                    start_obj("offsets");
-                        value_i("from", t0 * 10, false);
-                        value_i("to", t1 * 10, true);
-                    end_obj(false);
-                    value_s("text", text, !params.diarize && !params.tinydiarize);
-
-                    if (params.diarize && pcmf32s.size() == 2) {
-                        value_s("speaker", estimate_diarization_speaker(pcmf32s, t0, t1, true).c_str(), true);
-                    }
+void output_json_begin(output_sink & sink, output_file & out, struct whisper_state * state) {
+    struct whisper_context * ctx = sink.ctx;
+
+    const auto & params = *sink.params;
+
+    json_writer w = { out.fout, out.indent };
+
+    w.start_obj(nullptr);
+        w.value_s("systeminfo", whisper_print_system_info(), false);
+        w.start_obj("model");
+            w.value_s("type", whisper_model_type_readable(ctx), false);
+            w.value_b("multilingual", whisper_is_multilingual(ctx), false);
+            w.value_i("vocab", whisper_model_n_vocab(ctx), false);
+            w.start_obj("audio");
+                w.value_i("ctx", whisper_model_n_audio_ctx(ctx), false);
+                w.value_i("state", whisper_model_n_audio_state(ctx), false);
+                w.value_i("head", whisper_model_n_audio_head(ctx), false);
+                w.value_i("layer", whisper_model_n_audio_layer(ctx), true);
+            w.end_obj(false);
+            w.start_obj("text");
+                w.value_i("ctx", whisper_model_n_text_ctx(ctx), false);
+                w.value_i("state", whisper_model_n_text_state(ctx), false);
+                w.value_i("head", whisper_model_n_text_head(ctx), false);
+                w.value_i("layer", whisper_model_n_text_layer(ctx), true);
+            w.end_obj(false);
+            w.value_i("mels", whisper_model_n_mels(ctx), false);
+            w.value_i("ftype", whisper_model_ftype(ctx), true);
+        w.end_obj(false);
+        w.start_obj("params");
+            w.value_s("model", params.model.c_str(), false);
+            w.value_s("language", params.language.c_str(), false);
+            w.value_b("translate", params.translate, true);
+        w.end_obj(false);
+        w.start_obj("result");
+            w.value_s("language", whisper_lang_str(whisper_full_lang_id_from_state(state)), true);
+        w.end_obj(false);
+        w.start_arr("transcription");
+}
 
-                    if (params.tinydiarize) {
-                        value_b("speaker_turn_next", whisper_full_get_segment_speaker_turn_next(ctx, i), true);
-                    }
-                end_obj(i == (n_segments - 1));
-            }
+void output_json_segment(output_sink & sink, output_file & out, struct whisper_state * state, int i) {
+    const auto & params = *sink.params;
 
-        end_arr(true);
-    end_obj(true);
-    return true;
+    json_writer w = { out.fout, out.indent };
+
+    // the object of a segment is closed when the next one arrives, because the last one is not followed by a comma
+    if (out.n_segments > 0) {
+        w.end_obj(false);
+    }
+
+    const char * text = whisper_full_get_segment_text_from_state(state, i);
+
+    const int64_t t0 = whisper_full_get_segment_t0_from_state(state, i);
+    const int64_t t1 = whisper_full_get_segment_t1_from_state(state, i);
+
+    w.start_obj(nullptr);
+        w.start_obj("timestamps");
+            w.value_s("from", to_timestamp(t0, true).c_str(), false);
+            w.value_s("to", to_timestamp(t1, true).c_str(), true);
+        w.end_obj(false);
+        w.start_obj("offsets");
+            w.value_i("from", t0 * 10, false);
+            w.value_i("to", t1 * 10, true);
+        w.end_obj(false);
+        w.value_s("text", text, !params.diarize && !params.tinydiarize);
+
+        if (output_diarize(sink)) {
+            w.value_s("speaker", estimate_diarization_speaker(*sink.pcmf32s, t0, t1, true).c_str(), true);
+        }
+
+        if (params.tinydiarize) {
+            w.value_b("speaker_turn_next", whisper_full_get_segment_speaker_turn_next_from_state(state, i), true);
+        }
+}
+
+void output_json_end(output_sink & /*sink*/, output_file & out, struct whisper_state * /*state*/) {
+    json_writer w = { out.fout, out.indent };
+
+    if (out.n_segments > 0) {
+        w.end_obj(true);
+    }
+
+    w.end_arr(true);
+    w.end_obj(true);
 }
 
 // karaoke video generation
 // outputs a bash script that uses ffmpeg to generate a video with the subtitles
 // TODO: font parameter adjustments
-bool output_wts(struct whisper_context * ctx, const char * fname, const char * fname_inp, const whisper_params & params, float t_sec, std::vector<std::vector<float>> pcmf32s) {
-    std::ofstream fout(fname);
+void output_wts_begin(output_sink & sink, output_file & out, struct whisper_state * /*state*/) {
+    out.fout << "#!/bin/bash" << "\n";
+    out.fout << "\n";
+
+    out.fout << "ffmpeg -i " << sink.fname_inp << " -f lavfi -i color=size=1200x120:duration=" << sink.t_sec << ":rate=25:color=black -vf \"";
+}
+
+void output_wts_segment(output_sink & sink, output_file & out, struct whisper_state * state, int i) {
+    struct whisper_context * ctx = sink.ctx;
+
+    auto & fout = out.fout;
+
+    const char * font = sink.params->font_path.c_str();
 
-    fprintf(stderr, "%s: saving output to '%s'\n", __func__, fname);
+    const int64_t t0 = whisper_full_get_segment_t0_from_state(state, i);
+    const int64_t t1 = whisper_full_get_segment_t1_from_state(state, i);
 
-    static const char * font = params.font_path.c_str();
+    const int n = whisper_full_n_tokens_from_state(state, i);
 
-    std::ifstream fin(font);
-    if (!fin.is_open()) {
-        fprintf(stderr, "%s: font not found at '%s', please specify a monospace font with -fp\n", __func__, font);
-        return false;
+    std::vector<whisper_token_data> tokens(n);
+    for (int j = 0; j < n; ++j) {
+        tokens[j] = whisper_full_get_token_data_from_state(state, i, j);
     }
 
-    fout << "#!/bin/bash" << "\n";
-    fout << "\n";
+    if (out.n_segments > 0) {
+        fout << ",";
+    }
+
+    // background text
+    fout << "drawtext=fontfile='" << font << "':fontsize=24:fontcolor=gray:x=(w-text_w)/2:y=h/2:text='':enable='between(t," << t0/100.0 << "," << t0/100.0 << ")'";
 
-    fout << "ffmpeg -i " << fname_inp << " -f lavfi -i color=size=1200x120:duration=" << t_sec << ":rate=25:color=black -vf \"";
+    bool is_first = true;
+    std::string speaker = "";
 
-    for (int i = 0; i < whisper_full_n_segments(ctx); i++) {
-        const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-        const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+    if (output_diarize(sink)) {
+        speaker = estimate_diarization_speaker(*sink.pcmf32s, t0, t1);
+    }
 
-        const int n = whisper_full_n_tokens(ctx, i);
+    for (int j = 0; j < n; ++j) {
+        const auto & token = tokens[j];
 
-        std::vector<whisper_token_data> tokens(n);
-        for (int j = 0; j < n; ++j) {
-            tokens[j] = whisper_full_get_token_data(ctx, i, j);
+        if (tokens[j].id >= whisper_token_eot(ctx)) {
+            continue;
         }
 
-        if (i > 0) {
-            fout << ",";
+        std::string txt_bg = "";
+        std::string txt_fg = ""; // highlight token
+        std::string txt_ul = ""; // underline
+
+        if (output_diarize(sink)) {
+            txt_bg = speaker;
+            txt_fg = speaker;
+            txt_ul = "\\ \\ \\ \\ \\ \\ \\ \\ \\ \\ \\ ";
         }
 
-        // background text
-        fout << "drawtext=fontfile='" << font << "':fontsize=24:fontcolor=gray:x=(w-text_w)/2:y=h/2:text='':enable='between(t," << t0/100.0 << "," << t0/100.0 << ")'";
+        txt_bg.append("> ");
+        txt_fg.append("> ");
+        txt_ul.append("\\ \\ ");
 
-        bool is_first = true;
-        std::string speaker = "";
+        {
+            for (int k = 0; k < n; ++k) {
+                const auto & token2 = tokens[k];
 
-        if (params.diarize && pcmf32s.size() == 2) {
-            speaker = estimate_diarization_speaker(pcmf32s, t0, t1);
+                if (tokens[k].id >= whisper_token_eot(ctx)) {
+                    continue;
+                }
+
+                const std::string txt = whisper_token_to_str(ctx, token2.id);
+
+                txt_bg += txt;
+
+                if (k == j) {
+                    for (int l = 0; l < (int) txt.size(); ++l) {
+                        txt_fg += txt[l];
+                        txt_ul += "_";
+                    }
+                    txt_fg += "|";
+                } else {
+                    for (int l = 0; l < (int) txt.size(); ++l) {
+                        txt_fg += "\\ ";
+                        txt_ul += "\\ ";
+                    }
+                }
+            }
+
+            ::replace_all(txt_bg, "'", "\u2019");
+            ::replace_all(txt_bg, "\"", "\\\"");
+            ::replace_all(txt_fg, "'", "\u2019");
+            ::replace_all(txt_fg, "\"", "\\\"");
         }
 
-        for (int j = 0; j < n; ++j) {
-            const auto & token = tokens[j];
+        if (is_first) {
+            // background text
+            fout << ",drawtext=fontfile='" << font << "':fontsize=24:fontcolor=gray:x=(w-text_w)/2:y=h/2:text='" << txt_bg << "':enable='between(t," << t0/100.0 << "," << t1/100.0 << ")'";
+            is_first = false;
+        }
+
+        // foreground text
+        fout << ",drawtext=fontfile='" << font << "':fontsize=24:fontcolor=lightgreen:x=(w-text_w)/2+8:y=h/2:text='" << txt_fg << "':enable='between(t," << token.t0/100.0 << "," << token.t1/100.0 << ")'";
+
+        // underline
+        fout << ",drawtext=fontfile='" << font << "':fontsize=24:fontcolor=lightgreen:x=(w-text_w)/2+8:y=h/2+16:text='" << txt_ul << "':enable='between(t," << token.t0/100.0 << "," << token.t1/100.0 << ")'";
+    }
+}
+
+void output_wts_end(output_sink & sink, output_file & out, struct whisper_state * /*state*/) {
+    const auto & fname_inp = sink.fname_inp;
+
+    out.fout << "\" -c:v libx264 -pix_fmt yuv420p -y " << fname_inp << ".mp4" << "\n";
+
+    out.fout << "\n\n";
+    out.fout << "echo \"Your video has been saved to " << fname_inp << ".mp4\"" << "\n";
+    out.fout << "\n";
+    out.fout << "echo \"  ffplay " << fname_inp << ".mp4\"\n";
+    out.fout << "\n";
+}
+
+void output_lrc_begin(output_sink & /*sink*/, output_file & out, struct whisper_state * /*state*/) {
+    out.fout << "[by:whisper.cpp]\n";
+}
+
+void output_lrc_segment(output_sink & sink, output_file & out, struct whisper_state * state, int i) {
+    const char * text = whisper_full_get_segment_text_from_state(state, i);
+    const int64_t t = whisper_full_get_segment_t0_from_state(state, i);
 
-            if (tokens[j].id >= whisper_token_eot(ctx)) {
+    int64_t msec = t * 10;
+    int64_t min = msec / (1000 * 60);
+    msec = msec - min * (1000 * 60);
+    int64_t sec = msec / 1000;
+    msec = msec - sec * 1000;
+
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%02d:%02d.%02d", (int) min, (int) sec, (int) ( msec / 10));
+    std::string timestamp_lrc = std::string(buf);
+    std::string speaker = "";
+
+    if (output_diarize(sink))
+    {
+        const int64_t t0 = whisper_full_get_segment_t0_from_state(state, i);
+        const int64_t t1 = whisper_full_get_segment_t1_from_state(state, i);
+        speaker = estimate_diarization_speaker(*sink.pcmf32s, t0, t1);
+    }
+
+    out.fout <<  '[' << timestamp_lrc << ']' << speaker << text << "\n";
+}
+
+const output_format k_output_txt  = { ".txt",  nullptr,           output_txt_segment,  nullptr,         };
+const output_format k_output_vtt  = { ".vtt",  output_vtt_begin,  output_vtt_segment,  nullptr,         };
+const output_format k_output_srt  = { ".srt",  nullptr,           output_srt_segment,  nullptr,         };
+const output_format k_output_wts  = { ".wts",  output_wts_begin,  output_wts_segment,  output_wts_end,  };
+const output_format k_output_csv  = { ".csv",  output_csv_begin,  output_csv_segment,  nullptr,         };
+const output_format k_output_json = { ".json", output_json_begin, output_json_segment, output_json_end, };
+const output_format k_output_lrc  = { ".lrc",  output_lrc_begin,  output_lrc_segment,  nullptr,         };
+
+// open the output files requested in the params
+// the sink references params and pcmf32s, which must outlive it
+void output_sink_init(output_sink & sink, struct whisper_context * ctx, const whisper_params & params, const std::string & fname_inp, const std::string & fname_out, int n_samples, const std::vector<std::vector<float>> & pcmf32s) {
+    sink.ctx       = ctx;
+    sink.params    = &params;
+    sink.pcmf32s   = &pcmf32s;
+    sink.fname_inp = fname_inp;
+    sink.t_sec     = float(n_samples + 1000)/WHISPER_SAMPLE_RATE;
+
+    sink.files.clear();
+
+    std::vector<const output_format *> formats;
+
+    if (params.output_txt) formats.push_back(&k_output_txt);
+    if (params.output_vtt) formats.push_back(&k_output_vtt);
+    if (params.output_srt) formats.push_back(&k_output_srt);
+    if (params.output_wts) formats.push_back(&k_output_wts);
+    if (params.output_csv) formats.push_back(&k_output_csv);
+    if (params.output_jsn) formats.push_back(&k_output_json);
+    if (params.output_lrc) formats.push_back(&k_output_lrc);
+
+    for (const auto * format : formats) {
+        const auto fname = fname_out + format->ext;
+
+        if (format == &k_output_wts) {
+            std::ifstream fin(params.font_path);
+            if (!fin.is_open()) {
+                fprintf(stderr, "%s: font not found at '%s', please specify a monospace font with -fp\n", __func__, params.font_path.c_str());
                 continue;
             }
+        }
+
+        sink.files.emplace_back();
+
+        auto & out = sink.files.back();
+
+        out.format = format;
+        out.fname  = fname;
+        out.fout.open(fname);
+        if (!out.fout.is_open()) {
+            fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname.c_str());
+            sink.files.pop_back();
+            continue;
+        }
+
+        fprintf(stderr, "%s: saving output to '%s'\n", __func__, fname.c_str());
+    }
+}
+
+// write the last n_new segments of the state to all output files
+void output_sink_write(output_sink & sink, struct whisper_state * state, int n_new) {
+    const int n_segments = whisper_full_n_segments_from_state(state);
+
+    for (auto & out : sink.files) {
+        if (!out.started) {
+            if (out.format->begin) {
+                out.format->begin(sink, out, state);
+            }
+            out.started = true;
+        }
+
+        for (int i = n_segments - n_new; i < n_segments; ++i) {
+            out.format->segment(sink, out, state, i);
+            out.n_segments++;
+        }
+    }
+}
+
+// finish and close the output files
+void output_sink_end(output_sink & sink, struct whisper_state * state) {
+    output_sink_write(sink, state, 0);
+
+    for (auto & out : sink.files) {
+        if (out.format->end) {
+            out.format->end(sink, out, state);
+        }
+
+        out.fout.close();
+
+        if (out.format == &k_output_wts) {
+            fprintf(stderr, "%s: run 'source %s' to generate karaoke video\n", __func__, out.fname.c_str());
+        }
+    }
+
+    sink.files.clear();
+}
+
+// the inference parameters for the command-line parameters
+whisper_full_params main_full_params(const whisper_params & params, struct whisper_context * ctx_draft) {
+    whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+
+    wparams.strategy = params.beam_size > 1 ? WHISPER_SAMPLING_BEAM_SEARCH : WHISPER_SAMPLING_GREEDY;
+
+    wparams.print_realtime   = false;
+    wparams.print_progress   = params.print_progress;
+    wparams.print_timestamps = !params.no_timestamps;
+    wparams.print_special    = params.print_special;
+    wparams.translate        = params.translate;
+    wparams.language         = params.language.c_str();
+    wparams.detect_language  = params.detect_language;
+    wparams.n_threads        = params.n_threads;
+    wparams.n_threads_encoder = params.n_threads_enc;
+    wparams.n_threads_decoder = params.n_threads_dec;
+    wparams.n_threads_mel     = params.n_threads_mel;
+    wparams.cpu_offset        = params.cpu_offset;
+    wparams.n_max_text_ctx   = params.max_context >= 0 ? params.max_context : wparams.n_max_text_ctx;
+    wparams.offset_ms        = params.offset_t_ms;
+    wparams.duration_ms      = params.duration_ms;
+
+    wparams.token_timestamps = params.output_wts || params.max_len > 0;
+    wparams.thold_pt         = params.word_thold;
+    wparams.max_len          = params.output_wts && params.max_len == 0 ? 60 : params.max_len;
+    wparams.split_on_word    = params.split_on_word;
+    wparams.single_segment   = params.single_segment;
+
+    wparams.speed_up         = params.speed_up;
+    wparams.audio_ctx_auto   = params.audio_ctx_auto;
+
+    wparams.tdrz_enable      = params.tinydiarize; // [TDRZ]
+
+    wparams.initial_prompt   = params.prompt.c_str();
+
+    wparams.greedy.best_of        = params.best_of;
+    wparams.beam_search.beam_size = params.beam_size;
+
+    wparams.temperature_inc  = params.no_fallback ? 0.0f : wparams.temperature_inc;
+    wparams.entropy_thold    = params.entropy_thold;
+    wparams.logprob_thold    = params.logprob_thold;
+
+    wparams.temperature_n_parallel = params.n_temp_parallel;
+    wparams.encode_ahead           = params.encode_ahead;
+
+    wparams.draft_ctx      = ctx_draft;
+    wparams.draft_n_tokens = params.n_draft;
+
+    return wparams;
+}
+
+// ggml contexts that a worker state can hold at the same time: its KV caches, the graphs being built, and the states
+// for the concurrent fallback temperatures, the encode-ahead and the draft model
+int main_batch_n_contexts(const whisper_params & params) {
+    const int n_decoders = std::max(1, std::max(params.best_of, params.beam_size));
+
+    int n = 1 + 2*n_decoders; // kv_cross, and the kv_self and the graph of each decoder
+
+    if (params.n_temp_parallel > 1) {
+        n += (params.n_temp_parallel - 1)*2*std::max(1, params.best_of);
+    }
+    if (params.encode_ahead && params.single_segment) {
+        n += 3;
+    }
+    if (!params.model_draft.empty()) {
+        n += 3;
+    }
+
+    return n;
+}
+
+// batch mode: n_workers threads, each with its own state on the shared context, take the files from a common queue
+// each worker reads, transcribes and writes the outputs of one file at a time, so these stages overlap across the workers
+int main_batch(struct whisper_context * ctx, struct whisper_context * ctx_draft, whisper_params params) {
+    const int n_files   = params.fname_inp.size();
+    int n_workers = std::min(params.n_workers, n_files);
+
+    // the states of all the workers must fit in the ggml contexts left by the models and the encoder batch
+    {
+        const int n_workers_max = std::max(1, (GGML_MAX_CONTEXTS - 4)/main_batch_n_contexts(params));
+
+        if (n_workers > n_workers_max) {
+            fprintf(stderr, "%s: WARNING: using %d workers instead of %d, the limit for these decoding options\n", __func__, n_workers_max, n_workers);
+            n_workers = n_workers_max;
+        }
+    }
+
+    if (!whisper_is_multilingual(ctx)) {
+        if (params.language != "en" || params.translate) {
+            params.language = "en";
+            params.translate = false;
+            fprintf(stderr, "%s: WARNING: model is not multilingual, ignoring language and translation options\n", __func__);
+        }
+    }
+    if (params.detect_language) {
+        params.language = "auto";
+    }
+
+    if (params.n_processors > 1) {
+        fprintf(stderr, "%s: WARNING: --processors is ignored in batch mode\n", __func__);
+    }
+
+    struct whisper_encoder_batch * encoder_batch = nullptr;
 
-            std::string txt_bg = "";
-            std::string txt_fg = ""; // highlight token
-            std::string txt_ul = ""; // underline
+    if (params.encoder_batch && n_workers > 1) {
+        const int n_threads = std::min(n_workers*params.n_threads, (int) std::thread::hardware_concurrency());
 
-            if (params.diarize && pcmf32s.size() == 2) {
-                txt_bg = speaker;
-                txt_fg = speaker;
-                txt_ul = "\\ \\ \\ \\ \\ \\ \\ \\ \\ \\ \\ ";
+        encoder_batch = whisper_encoder_batch_init(ctx, n_workers, 50, n_threads);
+        if (encoder_batch == nullptr) {
+            fprintf(stderr, "error: failed to initialize the encoder batch\n");
+            return 3;
+        }
+    }
+
+    fprintf(stderr, "\n");
+    fprintf(stderr, "system_info: n_threads = %d / %d | %s\n",
+            params.n_threads*n_workers, std::thread::hardware_concurrency(), whisper_print_system_info());
+
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%s: processing %d files, %d workers, %d threads, lang = %s, task = %s, %stimestamps = %d ...\n",
+            __func__, n_files, n_workers, params.n_threads,
+            params.language.c_str(),
+            params.translate ? "translate" : "transcribe",
+            params.tinydiarize ? "tdrz = 1, " : "",
+            params.no_timestamps ? 0 : 1);
+
+    std::atomic<int> f_next(0);
+
+    std::mutex mutex; // stdout and the counters below
+
+    int    n_done      = 0;
+    int    n_failed    = 0;
+    double t_audio_sec = 0.0;
+
+    const auto t_start = std::chrono::steady_clock::now();
+
+    auto worker = [&](int i_worker) {
+        struct whisper_state * state = whisper_init_state(ctx);
+        if (state == nullptr) {
+            // the files are left to the other workers
+            fprintf(stderr, "%s: worker %d: failed to initialize whisper state\n", __func__, i_worker);
+            return;
+        }
+
+        whisper_full_params wparams = main_full_params(params, ctx_draft);
+
+        wparams.encoder_batch = encoder_batch;
+
+        // each worker gets its own range of CPUs
+        if (params.cpu_offset >= 0) {
+            wparams.cpu_offset = params.cpu_offset + i_worker*params.n_threads;
+        }
+
+        std::vector<float> pcmf32;
+        std::vector<std::vector<float>> pcmf32s;
+
+        output_sink sink;
+
+        // the output files are written while the file is transcribed
+        wparams.new_segment_callback = [](struct whisper_context * /*ctx*/, struct whisper_state * state, int n_new, void * user_data) {
+            output_sink_write(*(output_sink *) user_data, state, n_new);
+        };
+        wparams.new_segment_callback_user_data = &sink;
+
+        while (true) {
+            const int f = f_next++;
+            if (f >= n_files) {
+                break;
+            }
+
+            const auto & fname_inp = params.fname_inp[f];
+            const auto & fname_out = f < (int) params.fname_out.size() && !params.fname_out[f].empty() ? params.fname_out[f] : params.fname_inp[f];
+
+            if (!::read_wav(fname_inp, pcmf32, pcmf32s, params.diarize)) {
+                fprintf(stderr, "error: failed to read WAV file '%s'\n", fname_inp.c_str());
+
+                std::lock_guard<std::mutex> lock(mutex);
+                n_failed++;
+                continue;
             }
 
-            txt_bg.append("> ");
-            txt_fg.append("> ");
-            txt_ul.append("\\ \\ ");
+            output_sink_init(sink, ctx, params, fname_inp, fname_out, pcmf32.size(), pcmf32s);
+
+            if (whisper_full_with_state(ctx, state, wparams, pcmf32.data(), pcmf32.size()) != 0) {
+                fprintf(stderr, "%s: failed to process audio '%s'\n", __func__, fname_inp.c_str());
+
+                sink.files.clear();
+
+                std::lock_guard<std::mutex> lock(mutex);
+                n_failed++;
+                continue;
+            }
 
+            // the segments of a file are printed together, after the file is done
             {
-                for (int k = 0; k < n; ++k) {
-                    const auto & token2 = tokens[k];
+                std::lock_guard<std::mutex> lock(mutex);
 
-                    if (tokens[k].id >= whisper_token_eot(ctx)) {
-                        continue;
-                    }
+                whisper_print_user_data user_data = { &params, &pcmf32s, 0, nullptr };
 
-                    const std::string txt = whisper_token_to_str(ctx, token2.id);
-
-                    txt_bg += txt;
-
-                    if (k == j) {
-                        for (int l = 0; l < (int) txt.size(); ++l) {
-                            txt_fg += txt[l];
-                            txt_ul += "_";
-                        }
-                        txt_fg += "|";
-                    } else {
-                        for (int l = 0; l < (int) txt.size(); ++l) {
-                            txt_fg += "\\ ";
-                            txt_ul += "\\ ";
-                        }
-                    }
+                printf("\n%s:", fname_inp.c_str());
+                whisper_print_segment_callback(ctx, state, whisper_full_n_segments_from_state(state), &user_data);
+                if (params.no_timestamps && !params.diarize) {
+                    printf("\n");
                 }
+                fflush(stdout);
 
-                ::replace_all(txt_bg, "'", "\u2019");
-                ::replace_all(txt_bg, "\"", "\\\"");
-                ::replace_all(txt_fg, "'", "\u2019");
-                ::replace_all(txt_fg, "\"", "\\\"");
+                n_done++;
+                t_audio_sec += float(pcmf32.size())/WHISPER_SAMPLE_RATE;
             }
 
-            if (is_first) {
-                // background text
-                fout << ",drawtext=fontfile='" << font << "':fontsize=24:fontcolor=gray:x=(w-text_w)/2:y=h/2:text='" << txt_bg << "':enable='between(t," << t0/100.0 << "," << t1/100.0 << ")'";
-                is_first = false;
-            }
+            output_sink_end(sink, state);
+        }
 
-            // foreground text
-            fout << ",drawtext=fontfile='" << font << "':fontsize=24:fontcolor=lightgreen:x=(w-text_w)/2+8:y=h/2:text='" << txt_fg << "':enable='between(t," << token.t0/100.0 << "," << token.t1/100.0 << ")'";
+        whisper_free_state(state);
+    };
 
-            // underline
-            fout << ",drawtext=fontfile='" << font << "':fontsize=24:fontcolor=lightgreen:x=(w-text_w)/2+8:y=h/2+16:text='" << txt_ul << "':enable='between(t," << token.t0/100.0 << "," << token.t1/100.0 << ")'";
-        }
+    std::vector<std::thread> workers;
+    for (int i = 0; i < n_workers; ++i) {
+        workers.emplace_back(worker, i);
+    }
+    for (auto & w : workers) {
+        w.join();
     }
 
-    fout << "\" -c:v libx264 -pix_fmt yuv420p -y " << fname_inp << ".mp4" << "\n";
+    // no worker could take these files
+    if (n_done + n_failed < n_files) {
+        fprintf(stderr, "%s: %d files were not processed\n", __func__, n_files - n_done - n_failed);
+        n_failed = n_files - n_done;
+    }
 
-    fout << "\n\n";
-    fout << "echo \"Your video has been saved to " << fname_inp << ".mp4\"" << "\n";
-    fout << "\n";
-    fout << "echo \"  ffplay " << fname_inp << ".mp4\"\n";
-    fout << "\n";
+    const double t_wall_sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
 
-    fout.close();
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%s: %d files done, %d failed, %.1f sec of audio in %.1f sec, %.2f audio hours per hour\n",
+            __func__, n_done, n_failed, t_audio_sec, t_wall_sec, t_audio_sec/std::max(t_wall_sec, 1e-3));
 
-    fprintf(stderr, "%s: run 'source %s' to generate karaoke video\n", __func__, fname);
+    if (encoder_batch) {
+        whisper_encoder_batch_free(encoder_batch);
+    }
 
-    return true;
+    return n_failed == 0 ? 0 : 10;
 }
 
-bool output_lrc(struct whisper_context * ctx, const char * fname, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
-    std::ofstream fout(fname);
-    if (!fout.is_open()) {
-        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname);
-        return false;
+// clips mode: the input files are short clips (e.g. voice commands), transcribed together with whisper_full_clips()
+int main_clips(struct whisper_context * ctx, struct whisper_context * ctx_draft, whisper_params params) {
+    const int n_files = params.fname_inp.size();
+
+    if (!whisper_is_multilingual(ctx)) {
+        if (params.language != "en" || params.translate) {
+            params.language = "en";
+            params.translate = false;
+            fprintf(stderr, "%s: WARNING: model is not multilingual, ignoring language and translation options\n", __func__);
+        }
+    }
+    if (params.detect_language) {
+        params.language = "auto";
     }
 
-    fprintf(stderr, "%s: saving output to '%s'\n", __func__, fname);
+    std::vector<std::vector<float>> pcmf32(n_files);
 
-    fout << "[by:whisper.cpp]\n";
+    std::vector<const float *> samples(n_files);
+    std::vector<int>           n_samples(n_files);
 
-    const int n_segments = whisper_full_n_segments(ctx);
-    for (int i = 0; i < n_segments; ++i) {
-        const char * text = whisper_full_get_segment_text(ctx, i);
-        const int64_t t = whisper_full_get_segment_t0(ctx, i);
-
-        int64_t msec = t * 10;
-        int64_t min = msec / (1000 * 60);
-        msec = msec - min * (1000 * 60);
-        int64_t sec = msec / 1000;
-        msec = msec - sec * 1000;
-
-        char buf[16];
-        snprintf(buf, sizeof(buf), "%02d:%02d.%02d", (int) min, (int) sec, (int) ( msec / 10));
-        std::string timestamp_lrc = std::string(buf);
-        std::string speaker = "";
-
-        if (params.diarize && pcmf32s.size() == 2)
-        {
-            const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-            const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
-            speaker = estimate_diarization_speaker(pcmf32s, t0, t1);
+    for (int f = 0; f < n_files; ++f) {
+        std::vector<std::vector<float>> pcmf32s;
+
+        if (!::read_wav(params.fname_inp[f], pcmf32[f], pcmf32s, false)) {
+            fprintf(stderr, "error: failed to read WAV file '%s'\n", params.fname_inp[f].c_str());
+            return 2;
         }
 
-        fout <<  '[' << timestamp_lrc << ']' << speaker << text << "\n";
+        samples[f]   = pcmf32[f].data();
+        n_samples[f] = pcmf32[f].size();
     }
 
-    return true;
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%s: processing %d clips, %d threads, lang = %s, task = %s, timestamps = %d ...\n",
+            __func__, n_files, params.n_threads,
+            params.language.c_str(),
+            params.translate ? "translate" : "transcribe",
+            params.no_timestamps ? 0 : 1);
+
+    whisper_full_params wparams = main_full_params(params, ctx_draft);
+
+    if (whisper_full_clips(ctx, whisper_get_state(ctx), wparams, samples.data(), n_samples.data(), n_files) != 0) {
+        fprintf(stderr, "%s: failed to process audio\n", __func__);
+        return 10;
+    }
+
+    const int n_segments = whisper_full_n_segments(ctx);
+
+    for (int f = 0; f < n_files; ++f) {
+        printf("\n%s:\n", params.fname_inp[f].c_str());
+
+        for (int i = 0; i < n_segments; ++i) {
+            if (whisper_full_get_segment_clip(ctx, i) != f) {
+                continue;
+            }
+
+            if (!params.no_timestamps) {
+                printf("[%s --> %s]  ", to_timestamp(whisper_full_get_segment_t0(ctx, i)).c_str(), to_timestamp(whisper_full_get_segment_t1(ctx, i)).c_str());
+            }
+            printf("%s\n", whisper_full_get_segment_text(ctx, i));
+        }
+    }
+
+    return 0;
 }
 
 int main(int argc, char ** argv) {
@@ -798,14 +1271,65 @@ int main(int argc, char ** argv) {
         exit(0);
     }
 
+    if (params.long_form && params.diarize) {
+        fprintf(stderr, "error: cannot use both --long-form and --diarize\n");
+        whisper_print_usage(argc, argv, params);
+        exit(0);
+    }
+
     if (params.diarize && params.tinydiarize) {
         fprintf(stderr, "error: cannot use both --diarize and --tinydiarize\n");
         whisper_print_usage(argc, argv, params);
         exit(0);
     }
 
+    if (params.clips && (params.n_workers > 0 || params.long_form)) {
+        fprintf(stderr, "error: cannot use --clips with --batch-workers or --long-form\n");
+        whisper_print_usage(argc, argv, params);
+        exit(0);
+    }
+
+    if (params.n_workers > 0 && params.long_form) {
+        fprintf(stderr, "error: cannot use both --batch-workers and --long-form\n");
+        whisper_print_usage(argc, argv, params);
+        exit(0);
+    }
+
     // whisper init
 
+    // the draft model decodes in a state of its own for each state of the main model
+    struct whisper_context * ctx_draft = nullptr;
+
+    if (!params.model_draft.empty()) {
+        ctx_draft = whisper_init_from_file_no_state(params.model_draft.c_str());
+
+        if (ctx_draft == nullptr) {
+            fprintf(stderr, "error: failed to initialize whisper context for the draft model\n");
+            return 3;
+        }
+    }
+
+    // in batch mode, each worker allocates its own state
+    if (params.n_workers > 0) {
+        struct whisper_context * ctx = whisper_init_from_file_no_state(params.model.c_str());
+
+        if (ctx == nullptr) {
+            fprintf(stderr, "error: failed to initialize whisper context\n");
+            return 3;
+        }
+
+        const int ret = main_batch(ctx, ctx_draft, params);
+
+        whisper_print_timings(ctx);
+        whisper_free(ctx);
+
+        if (ctx_draft) {
+            whisper_free(ctx_draft);
+        }
+
+        return ret;
+    }
+
     struct whisper_context * ctx = whisper_init_from_file(params.model.c_str());
 
     if (ctx == nullptr) {
@@ -813,6 +1337,19 @@ int main(int argc, char ** argv) {
         return 3;
     }
 
+    if (params.clips) {
+        const int ret = main_clips(ctx, ctx_draft, params);
+
+        whisper_print_timings(ctx);
+        whisper_free(ctx);
+
+        if (ctx_draft) {
+            whisper_free(ctx_draft);
+        }
+
+        return ret;
+    }
+
     // initialize openvino encoder. this has no effect on whisper.cpp builds that don't have OpenVINO configured
     whisper_ctx_init_openvino_encoder(ctx, nullptr, params.openvino_encode_device.c_str(), nullptr);
 
@@ -823,11 +1360,22 @@ int main(int argc, char ** argv) {
         std::vector<float> pcmf32;               // mono-channel F32 PCM
         std::vector<std::vector<float>> pcmf32s; // stereo-channel F32 PCM
 
-        if (!::read_wav(fname_inp, pcmf32, pcmf32s, params.diarize)) {
+        // in long-form mode, the audio is read in blocks during the transcription
+        wav_reader * reader = nullptr;
+
+        if (params.long_form) {
+            reader = wav_reader_init(fname_inp, false);
+            if (reader == nullptr) {
+                fprintf(stderr, "error: failed to read WAV file '%s'\n", fname_inp.c_str());
+                continue;
+            }
+        } else if (!::read_wav(fname_inp, pcmf32, pcmf32s, params.diarize)) {
             fprintf(stderr, "error: failed to read WAV file '%s'\n", fname_inp.c_str());
             continue;
         }
 
+        const int n_samples = reader ? wav_reader_n_samples(reader) : pcmf32.size();
+
         // print system information
         {
             fprintf(stderr, "\n");
@@ -839,63 +1387,47 @@ int main(int argc, char ** argv) {
         {
             fprintf(stderr, "\n");
             if (!whisper_is_multilingual(ctx)) {
-                if (params.language != "en" || params.translate) {
+                if (params.language != "en" || params.translate || params.translate_also) {
                     params.language = "en";
                     params.translate = false;
+                    params.translate_also = false;
                     fprintf(stderr, "%s: WARNING: model is not multilingual, ignoring language and translation options\n", __func__);
                 }
             }
             if (params.detect_language) {
                 params.language = "auto";
             }
+            if (params.translate_also && (reader || params.n_processors > 1)) {
+                fprintf(stderr, "%s: WARNING: --translate-also is ignored with --long-form and --processors\n", __func__);
+                params.translate_also = false;
+            }
+            if (params.translate_also) {
+                params.translate = false;
+            }
             fprintf(stderr, "%s: processing '%s' (%d samples, %.1f sec), %d threads, %d processors, lang = %s, task = %s, %stimestamps = %d ...\n",
-                    __func__, fname_inp.c_str(), int(pcmf32.size()), float(pcmf32.size())/WHISPER_SAMPLE_RATE,
+                    __func__, fname_inp.c_str(), n_samples, float(n_samples)/WHISPER_SAMPLE_RATE,
                     params.n_threads, params.n_processors,
                     params.language.c_str(),
-                    params.translate ? "translate" : "transcribe",
+                    params.translate_also ? "transcribe + translate" : params.translate ? "translate" : "transcribe",
                     params.tinydiarize ? "tdrz = 1, " : "",
                     params.no_timestamps ? 0 : 1);
 
             fprintf(stderr, "\n");
         }
 
-        // run the inference
-        {
-            whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
-
-            wparams.strategy = params.beam_size > 1 ? WHISPER_SAMPLING_BEAM_SEARCH : WHISPER_SAMPLING_GREEDY;
-
-            wparams.print_realtime   = false;
-            wparams.print_progress   = params.print_progress;
-            wparams.print_timestamps = !params.no_timestamps;
-            wparams.print_special    = params.print_special;
-            wparams.translate        = params.translate;
-            wparams.language         = params.language.c_str();
-            wparams.detect_language  = params.detect_language;
-            wparams.n_threads        = params.n_threads;
-            wparams.n_max_text_ctx   = params.max_context >= 0 ? params.max_context : wparams.n_max_text_ctx;
-            wparams.offset_ms        = params.offset_t_ms;
-            wparams.duration_ms      = params.duration_ms;
-
-            wparams.token_timestamps = params.output_wts || params.max_len > 0;
-            wparams.thold_pt         = params.word_thold;
-            wparams.max_len          = params.output_wts && params.max_len == 0 ? 60 : params.max_len;
-            wparams.split_on_word    = params.split_on_word;
+        // the output files are written segment by segment, during the inference
+        output_sink sink;
 
-            wparams.speed_up         = params.speed_up;
+        output_sink_init(sink, ctx, params, fname_inp, fname_out, n_samples, pcmf32s);
 
-            wparams.tdrz_enable      = params.tinydiarize; // [TDRZ]
+        // the state of the translation, with --translate-also
+        struct whisper_state * state_tr = nullptr;
 
-            wparams.initial_prompt   = params.prompt.c_str();
-
-            wparams.greedy.best_of        = params.best_of;
-            wparams.beam_search.beam_size = params.beam_size;
-
-            wparams.temperature_inc  = params.no_fallback ? 0.0f : wparams.temperature_inc;
-            wparams.entropy_thold    = params.entropy_thold;
-            wparams.logprob_thold    = params.logprob_thold;
+        // run the inference
+        {
+            whisper_full_params wparams = main_full_params(params, ctx_draft);
 
-            whisper_print_user_data user_data = { &params, &pcmf32s };
+            whisper_print_user_data user_data = { &params, &pcmf32s, 0, &sink };
 
             // this callback is called on each new segment
             if (!wparams.print_realtime) {
@@ -916,7 +1448,63 @@ int main(int argc, char ** argv) {
                 wparams.encoder_begin_callback_user_data = &is_aborted;
             }
 
-            if (whisper_full_parallel(ctx, wparams, pcmf32.data(), pcmf32.size(), params.n_processors) != 0) {
+            if (reader) {
+                struct pcm_source {
+                    wav_reader * reader;
+
+                    std::vector<float>              pcmf32;
+                    std::vector<std::vector<float>> pcmf32s;
+                };
+
+                pcm_source source = { reader, {}, {} };
+
+                const auto pcm_callback = [](float * samples, int n_samples_max, void * user_data) {
+                    auto & source = *(pcm_source *) user_data;
+
+                    source.pcmf32.clear();
+
+                    const int n = wav_reader_read(source.reader, source.pcmf32, source.pcmf32s, n_samples_max);
+                    memcpy(samples, source.pcmf32.data(), n*sizeof(float));
+
+                    return n;
+                };
+
+                if (params.n_processors > 1) {
+                    fprintf(stderr, "%s: WARNING: --long-form uses a single processor\n", __func__);
+                }
+
+                const int ret = whisper_full_long(ctx, wparams, pcm_callback, &source);
+
+                wav_reader_free(reader);
+
+                if (ret != 0) {
+                    fprintf(stderr, "%s: failed to process audio\n", argv[0]);
+                    return 10;
+                }
+            } else if (params.translate_also) {
+                // the transcription and the translation run concurrently and share the encoder of each window
+                // the transcription is output as usual, the translation is printed at the end
+                state_tr = whisper_init_state(ctx);
+                if (state_tr == nullptr) {
+                    fprintf(stderr, "%s: failed to init the state for the translation\n", argv[0]);
+                    return 10;
+                }
+
+                whisper_full_params wparams_tr = wparams;
+
+                wparams_tr.translate                      = true;
+                wparams_tr.print_realtime                 = false;
+                wparams_tr.new_segment_callback           = nullptr;
+                wparams_tr.new_segment_callback_user_data = nullptr;
+
+                whisper_state *     states[2]  = { whisper_get_state(ctx), state_tr };
+                whisper_full_params wparams2[2] = { wparams, wparams_tr };
+
+                if (whisper_full_multi(ctx, states, wparams2, 2, pcmf32.data(), pcmf32.size()) != 0) {
+                    fprintf(stderr, "%s: failed to process audio\n", argv[0]);
+                    return 10;
+                }
+            } else if (whisper_full_parallel(ctx, wparams, pcmf32.data(), pcmf32.size(), params.n_processors) != 0) {
                 fprintf(stderr, "%s: failed to process audio\n", argv[0]);
                 return 10;
             }
@@ -926,52 +1514,38 @@ int main(int argc, char ** argv) {
         {
             printf("\n");
 
-            // output to text file
-            if (params.output_txt) {
-                const auto fname_txt = fname_out + ".txt";
-                output_txt(ctx, fname_txt.c_str(), params, pcmf32s);
-            }
+            output_sink_end(sink, whisper_get_state(ctx));
+        }
 
-            // output to VTT file
-            if (params.output_vtt) {
-                const auto fname_vtt = fname_out + ".vtt";
-                output_vtt(ctx, fname_vtt.c_str(), params, pcmf32s);
-            }
+        if (state_tr) {
+            printf("translation:\n\n");
 
-            // output to SRT file
-            if (params.output_srt) {
-                const auto fname_srt = fname_out + ".srt";
-                output_srt(ctx, fname_srt.c_str(), params, pcmf32s);
-            }
+            const int n_segments = whisper_full_n_segments_from_state(state_tr);
+            for (int i = 0; i < n_segments; ++i) {
+                const char * text = whisper_full_get_segment_text_from_state(state_tr, i);
 
-            // output to WTS file
-            if (params.output_wts) {
-                const auto fname_wts = fname_out + ".wts";
-                output_wts(ctx, fname_wts.c_str(), fname_inp.c_str(), params, float(pcmf32.size() + 1000)/WHISPER_SAMPLE_RATE, pcmf32s);
-            }
+                if (params.no_timestamps) {
+                    printf("%s\n", text);
+                } else {
+                    const int64_t t0 = whisper_full_get_segment_t0_from_state(state_tr, i);
+                    const int64_t t1 = whisper_full_get_segment_t1_from_state(state_tr, i);
 
-            // output to CSV file
-            if (params.output_csv) {
-                const auto fname_csv = fname_out + ".csv";
-                output_csv(ctx, fname_csv.c_str(), params, pcmf32s);
+                    printf("[%s --> %s]  %s\n", to_timestamp(t0).c_str(), to_timestamp(t1).c_str(), text);
+                }
             }
 
-            // output to JSON file
-            if (params.output_jsn) {
-                const auto fname_jsn = fname_out + ".json";
-                output_json(ctx, fname_jsn.c_str(), params, pcmf32s);
-            }
+            printf("\n");
 
-            // output to LRC file
-            if (params.output_lrc) {
-                const auto fname_lrc = fname_out + ".lrc";
-                output_lrc(ctx, fname_lrc.c_str(), params, pcmf32s);
-            }
+            whisper_free_state(state_tr);
         }
     }
 
     whisper_print_timings(ctx);
     whisper_free(ctx);
 
+    if (ctx_draft) {
+        whisper_free(ctx_draft);
+    }
+
     return 0;
 }
@@ -1,4 +1,5 @@
 #include "ggml.h"
+#include "whisper.h"
 
 #include "common.h"
 #include "common-ggml.h"
@@ -12,6 +13,7 @@
 #include <string>
 #include <vector>
 #include <regex>
+#include <thread>
 
 // default hparams (Whisper tiny)
 struct whisper_hparams {
@@ -36,7 +38,9 @@ struct whisper_filters {
 };
 
 // quantize a model
-bool whisper_model_quantize(const std::string & fname_inp, const std::string & fname_out, ggml_ftype ftype) {
+// with a profile (rules not empty), the type of each tensor is given by the rules instead of ftype
+// with pack, the tensors are not quantized, but written in the packed format that the loader memory-maps
+bool whisper_model_quantize(const std::string & fname_inp, const std::string & fname_out, ggml_ftype ftype, const std::vector<ggml_quant_rule> & rules, int n_threads, bool pack) {
     gpt_vocab vocab;
 
     printf("%s: loading model from '%s'\n", __func__, fname_inp.c_str());
@@ -62,6 +66,10 @@ bool whisper_model_quantize(const std::string & fname_inp, const std::string & f
             return false;
         }
 
+        if (pack) {
+            magic = WHISPER_FILE_MAGIC_PACKED;
+        }
+
         fout.write((char *) &magic, sizeof(magic));
     }
 
@@ -82,7 +90,16 @@ bool whisper_model_quantize(const std::string & fname_inp, const std::string & f
         finp.read((char *) &hparams.ftype,         sizeof(hparams.ftype));
 
         const int32_t qntvr_src =    hparams.ftype / GGML_QNT_VERSION_FACTOR;
-        const int32_t ftype_dst = GGML_QNT_VERSION * GGML_QNT_VERSION_FACTOR + ftype;
+
+        if (!rules.empty()) {
+            ftype = ggml_quant_profile_ftype(rules, (ggml_ftype) (hparams.ftype % GGML_QNT_VERSION_FACTOR));
+            if (ftype == GGML_FTYPE_UNKNOWN) {
+                fprintf(stderr, "%s: cannot determine the model type for the profile\n", __func__);
+                return false;
+            }
+        }
+
+        const int32_t ftype_dst = pack ? hparams.ftype : GGML_QNT_VERSION * GGML_QNT_VERSION_FACTOR + ftype;
 
         fprintf(stderr, "%s: n_vocab       = %d\n", __func__, hparams.n_vocab);
         fprintf(stderr, "%s: n_audio_ctx   = %d\n", __func__, hparams.n_audio_ctx);
@@ -97,7 +114,7 @@ bool whisper_model_quantize(const std::string & fname_inp, const std::string & f
         fprintf(stderr, "%s: ftype (src)   = %d\n", __func__, hparams.ftype);
         fprintf(stderr, "%s: qntvr (src)   = %d\n", __func__, qntvr_src);
         fprintf(stderr, "%s: ftype (dst)   = %d\n", __func__, ftype_dst);
-        fprintf(stderr, "%s: qntvr (dst)   = %d\n", __func__, GGML_QNT_VERSION);
+        fprintf(stderr, "%s: qntvr (dst)   = %d\n", __func__, ftype_dst / GGML_QNT_VERSION_FACTOR);
 
         fout.write((const char *) &hparams.n_vocab,       sizeof(hparams.n_vocab));
         fout.write((const char *) &hparams.n_audio_ctx,   sizeof(hparams.n_audio_ctx));
@@ -164,7 +181,12 @@ bool whisper_model_quantize(const std::string & fname_inp, const std::string & f
         "decoder.positional_embedding",
     };
 
-    if (!ggml_common_quantize_0(finp, fout, ftype, { ".*" }, to_skip)) {
+    const bool ok = pack ? ggml_common_pack(finp, fout, WHISPER_FILE_VERSION_PACKED, WHISPER_PACKED_ALIGNMENT) :
+        rules.empty() ?
+        ggml_common_quantize_0      (finp, fout, ftype, { ".*" }, to_skip, n_threads) :
+        ggml_common_quantize_profile(finp, fout, rules,           to_skip, n_threads);
+
+    if (!ok) {
         fprintf(stderr, "%s: failed to quantize model '%s'\n", __func__, fname_inp.c_str());
         return false;
     }
@@ -176,9 +198,11 @@ bool whisper_model_quantize(const std::string & fname_inp, const std::string & f
 }
 
 int main(int argc, char ** argv) {
-    if (argc != 4) {
-        fprintf(stderr, "usage: %s model-f32.bin model-quant.bin type\n", argv[0]);
+    if (argc != 4 && argc != 5) {
+        fprintf(stderr, "usage: %s model-f32.bin model-quant.bin type|profile.txt [n_threads]\n", argv[0]);
         ggml_print_ftypes(stderr);
+        fprintf(stderr, "  profile = a file with one '<tensor name regex> <type>' rule per line, see examples/quantize/README.md\n");
+        fprintf(stderr, "  pack    = no quantization, convert the model to the aligned format that is memory-mapped when loaded\n");
         return 1;
     }
 
@@ -192,7 +216,24 @@ int main(int argc, char ** argv) {
     const std::string fname_inp = argv[1];
     const std::string fname_out = argv[2];
 
-    const ggml_ftype ftype = ggml_parse_ftype(argv[3]);
+    ggml_ftype ftype = GGML_FTYPE_UNKNOWN;
+
+    std::vector<ggml_quant_rule> rules;
+
+    const bool pack = strcmp(argv[3], "pack") == 0;
+
+    if (pack) {
+        ftype = GGML_FTYPE_UNKNOWN; // the tensors keep their type
+    } else if (std::ifstream(argv[3]).good()) {
+        if (!ggml_parse_quant_profile(argv[3], rules)) {
+            fprintf(stderr, "%s: invalid quantization profile '%s'\n", __func__, argv[3]);
+            return 1;
+        }
+    } else {
+        ftype = ggml_parse_ftype(argv[3]);
+    }
+
+    const int n_threads = argc > 4 ? std::stoi(argv[4]) : std::max(1, (int) std::thread::hardware_concurrency());
 
     const int64_t t_main_start_us = ggml_time_us();
 
@@ -202,7 +243,7 @@ int main(int argc, char ** argv) {
     {
         const int64_t t_start_us = ggml_time_us();
 
-        if (!whisper_model_quantize(fname_inp, fname_out, ggml_ftype(ftype))) {
+        if (!whisper_model_quantize(fname_inp, fname_out, ggml_ftype(ftype), rules, n_threads, pack)) {
             fprintf(stderr, "%s: failed to quantize model from '%s'\n", __func__, fname_inp.c_str());
             return 1;
         }
@@ -0,0 +1,567 @@
+// Real-time transcription of many concurrent audio streams with a single model
+//
+// Each client connects over TCP (or a Unix socket) and sends raw 16-bit mono PCM at 16 kHz.
+// The server sends back the committed text of the stream, with a new line at the end of each segment.
+// All streams share the loaded model - each one has its own whisper_state and is transcribed incrementally
+// (see stream_la_process()). A pool of workers processes the pending steps, earliest deadline first.
+//
+
+#include "common.h"
+#include "common-whisper.h"
+#include "whisper.h"
+#include "ggml.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// command-line parameters
+struct whisper_params {
+    int32_t n_threads   = std::min(4, (int32_t) std::thread::hardware_concurrency());
+    int32_t n_workers   = 0;
+    int32_t max_streams = 16;
+    int32_t step_ms     = 1000;
+    int32_t length_ms   = 10000;
+    int32_t stats_ms    = 5000;
+    int32_t audio_ctx   = 0;
+    int32_t port        = 8090;
+
+    bool speed_up      = false;
+    bool audio_ctx_auto = false;
+    bool translate     = false;
+    bool no_fallback   = false;
+
+    std::string language  = "en";
+    std::string model     = "models/ggml-base.en.bin";
+    std::string host      = "127.0.0.1";
+    std::string unix_path;
+};
+
+void whisper_print_usage(int argc, char ** argv, const whisper_params & params);
+
+bool whisper_params_parse(int argc, char ** argv, whisper_params & params) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg == "-h" || arg == "--help") {
+            whisper_print_usage(argc, argv, params);
+            exit(0);
+        }
+        else if (arg == "-t"   || arg == "--threads")       { params.n_threads     = std::stoi(argv[++i]); }
+        else if (arg == "-w"   || arg == "--workers")       { params.n_workers     = std::stoi(argv[++i]); }
+        else if (arg == "-ms"  || arg == "--max-streams")   { params.max_streams   = std::stoi(argv[++i]); }
+        else if (                 arg == "--step")          { params.step_ms       = std::stoi(argv[++i]); }
+        else if (                 arg == "--length")        { params.length_ms     = std::stoi(argv[++i]); }
+        else if (                 arg == "--stats")         { params.stats_ms      = std::stoi(argv[++i]); }
+        else if (arg == "-ac"  || arg == "--audio-ctx")     { params.audio_ctx     = std::stoi(argv[++i]); }
+        else if (arg == "-su"  || arg == "--speed-up")      { params.speed_up      = true; }
+        else if (arg == "-aca" || arg == "--audio-ctx-auto") { params.audio_ctx_auto = true; }
+        else if (arg == "-tr"  || arg == "--translate")     { params.translate     = true; }
+        else if (arg == "-nf"  || arg == "--no-fallback")   { params.no_fallback   = true; }
+        else if (arg == "-l"   || arg == "--language")      { params.language      = argv[++i]; }
+        else if (arg == "-m"   || arg == "--model")         { params.model         = argv[++i]; }
+        else if (                 arg == "--host")          { params.host          = argv[++i]; }
+        else if (                 arg == "--port")          { params.port          = std::stoi(argv[++i]); }
+        else if (                 arg == "--unix")          { params.unix_path     = argv[++i]; }
+        else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            whisper_print_usage(argc, argv, params);
+            exit(0);
+        }
+    }
+
+    return true;
+}
+
+void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & params) {
+    fprintf(stderr, "\n");
+    fprintf(stderr, "usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h,       --help          [default] show this help message and exit\n");
+    fprintf(stderr, "  -t N,     --threads N     [%-7d] number of threads per worker\n",                   params.n_threads);
+    fprintf(stderr, "  -w N,     --workers N     [%-7d] number of steps processed concurrently (0 - cores / threads)\n", params.n_workers);
+    fprintf(stderr, "  -ms N,    --max-streams N [%-7d] maximum number of connected streams\n",            params.max_streams);
+    fprintf(stderr, "            --step N        [%-7d] audio step size in milliseconds\n",                params.step_ms);
+    fprintf(stderr, "            --length N      [%-7d] uncommitted audio to keep without a segment end, in ms\n", params.length_ms);
+    fprintf(stderr, "            --stats N       [%-7d] interval of the stream statistics in ms (0 - off)\n", params.stats_ms);
+    fprintf(stderr, "  -ac N,    --audio-ctx N   [%-7d] audio context size (0 - all)\n",                   params.audio_ctx);
+    fprintf(stderr, "  -su,      --speed-up      [%-7s] speed up audio by x2 (reduced accuracy)\n",        params.speed_up ? "true" : "false");
+    fprintf(stderr, "  -aca,     --audio-ctx-auto [%-7s] smaller audio context for the audio shorter than 30 s\n", params.audio_ctx_auto ? "true" : "false");
+    fprintf(stderr, "  -tr,      --translate     [%-7s] translate from source language to english\n",      params.translate ? "true" : "false");
+    fprintf(stderr, "  -nf,      --no-fallback   [%-7s] do not use temperature fallback while decoding\n", params.no_fallback ? "true" : "false");
+    fprintf(stderr, "  -l LANG,  --language LANG [%-7s] spoken language\n",                                params.language.c_str());
+    fprintf(stderr, "  -m FNAME, --model FNAME   [%-7s] model path\n",                                     params.model.c_str());
+    fprintf(stderr, "            --host HOST     [%-7s] address to listen on\n",                           params.host.c_str());
+    fprintf(stderr, "            --port N        [%-7d] TCP port to listen on\n",                          params.port);
+    fprintf(stderr, "            --unix PATH     [%-7s] listen on a Unix socket instead of TCP\n",         params.unix_path.c_str());
+    fprintf(stderr, "\n");
+}
+
+using server_clock = std::chrono::steady_clock;
+
+struct server_stream {
+    int id;
+    int fd;
+
+    struct whisper_state * state;
+
+    stream_la la;
+
+    std::vector<float> pcmf32_pending; // the received audio that was not processed yet
+
+    size_t n_samples_la = 0; // the audio in la.pcmf32 (not committed yet), as of the last step - la is not locked
+
+    server_clock::time_point t_pending; // arrival of the oldest pending sample
+
+    bool eof    = false; // the client has finished sending
+    bool busy   = false; // a worker is processing a step of this stream
+    bool failed = false; // a step failed - the rest of the audio is dropped and the stream is closed
+
+    int64_t n_samples_done = 0;
+
+    double t_compute_sec = 0.0;
+    double t_late_max    = 0.0; // worst delay of a step beyond its deadline, in seconds
+};
+
+struct server {
+    struct whisper_context * ctx;
+
+    const whisper_params * params;
+
+    int n_samples_step;
+    int n_samples_len;
+
+    std::mutex              mutex;
+    std::condition_variable cv;
+
+    std::vector<server_stream *> streams;
+};
+
+// the stream with the earliest deadline among those with a full step (or with the end of the audio) pending
+// the deadline of a step is one step after the arrival of its first sample - if it is met, the latency stays bounded
+static server_stream * server_pick(server & srv, server_clock::time_point & deadline) {
+    server_stream * best = nullptr;
+
+    for (auto * s : srv.streams) {
+        if (s->busy || (s->failed && !s->eof)) {
+            continue;
+        }
+
+        if ((int) s->pcmf32_pending.size() < srv.n_samples_step && !s->eof) {
+            continue;
+        }
+
+        const auto t = s->pcmf32_pending.empty() ? server_clock::now() : s->t_pending + std::chrono::milliseconds(srv.params->step_ms);
+
+        if (best == nullptr || t < deadline) {
+            best     = s;
+            deadline = t;
+        }
+    }
+
+    return best;
+}
+
+static void server_send(int fd, const std::string & text) {
+    size_t n_sent = 0;
+    while (n_sent < text.size()) {
+        const ssize_t n = send(fd, text.data() + n_sent, text.size() - n_sent, 0);
+        if (n <= 0) {
+            break;
+        }
+        n_sent += n;
+    }
+}
+
+// receive the audio of a stream until the client stops sending
+static void server_reader(server & srv, server_stream * s) {
+    std::vector<int16_t> buf(4096);
+    std::vector<float>   pcmf32;
+
+    size_t n_partial = 0; // bytes of an incomplete sample at the start of buf
+
+    while (true) {
+        const ssize_t n = recv(s->fd, (char *) buf.data() + n_partial, buf.size()*sizeof(int16_t) - n_partial, 0);
+        if (n <= 0) {
+            break;
+        }
+
+        const size_t n_bytes   = n_partial + n;
+        const size_t n_samples = n_bytes/sizeof(int16_t);
+
+        pcmf32.resize(n_samples);
+        for (size_t i = 0; i < n_samples; ++i) {
+            pcmf32[i] = float(buf[i])/32768.0f;
+        }
+
+        n_partial = n_bytes - n_samples*sizeof(int16_t);
+        if (n_partial > 0) {
+            memmove(buf.data(), (char *) buf.data() + n_samples*sizeof(int16_t), n_partial);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(srv.mutex);
+
+            if (s->pcmf32_pending.empty()) {
+                s->t_pending = server_clock::now();
+            }
+            s->pcmf32_pending.insert(s->pcmf32_pending.end(), pcmf32.begin(), pcmf32.end());
+        }
+
+        srv.cv.notify_one();
+    }
+
+    // the stream is now owned by the workers, which flush it and close it
+    {
+        std::lock_guard<std::mutex> lock(srv.mutex);
+        s->eof = true;
+    }
+
+    srv.cv.notify_one();
+}
+
+static void server_worker(server & srv) {
+    const auto & params = *srv.params;
+
+    whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+
+    wparams.print_progress   = false;
+    wparams.print_special    = false;
+    wparams.print_realtime   = false;
+    wparams.print_timestamps = false;
+    wparams.translate        = params.translate;
+    wparams.language         = params.language.c_str();
+    wparams.n_threads        = params.n_threads;
+
+    wparams.audio_ctx        = params.audio_ctx;
+    wparams.speed_up         = params.speed_up;
+    wparams.audio_ctx_auto   = params.audio_ctx_auto;
+
+    wparams.temperature_inc  = params.no_fallback ? 0.0f : wparams.temperature_inc;
+
+    std::vector<float>        pcmf32;
+    std::vector<stream_token> result;
+
+    while (true) {
+        server_stream * s = nullptr;
+
+        bool flush = false;
+
+        {
+            std::unique_lock<std::mutex> lock(srv.mutex);
+
+            server_clock::time_point deadline;
+            srv.cv.wait(lock, [&] { return (s = server_pick(srv, deadline)) != nullptr; });
+
+            const double t_late = std::chrono::duration<double>(server_clock::now() - deadline).count();
+
+            s->t_late_max = std::max(s->t_late_max, t_late);
+            s->busy = true;
+
+            // all pending audio is processed at once, so a stream that falls behind catches up in larger steps
+            pcmf32.swap(s->pcmf32_pending);
+            s->pcmf32_pending.clear();
+
+            s->n_samples_la += pcmf32.size();
+
+            flush = s->eof;
+        }
+
+        const auto t_start = server_clock::now();
+
+        std::string text;
+
+        bool ok = true;
+
+        if (!s->failed) {
+            ok = stream_la_process(srv.ctx, s->state, s->la, wparams, srv.n_samples_len, flush, pcmf32, result);
+
+            // at the end of the stream, everything that is left is committed
+            while (true) {
+                for (const auto & token : result) {
+                    text += token.text;
+                    if (token.t_seg_end >= 0) {
+                        text += "\n";
+                    }
+                }
+
+                if (!ok || !flush || s->la.pcmf32.empty()) {
+                    break;
+                }
+
+                ok = stream_la_process(srv.ctx, s->state, s->la, wparams, srv.n_samples_len, flush, {}, result);
+            }
+        }
+
+        if (!ok) {
+            fprintf(stderr, "%s: stream %d: failed to process audio, closing the stream\n", __func__, s->id);
+
+            text += "\nerror: failed to process audio\n";
+
+            // the reader stops, then the stream is closed as at its end
+            shutdown(s->fd, SHUT_RD);
+        }
+
+        if (flush && !text.empty() && text.back() != '\n') {
+            text += "\n";
+        }
+
+        if (!text.empty()) {
+            server_send(s->fd, text);
+        }
+
+        const double t_compute = std::chrono::duration<double>(server_clock::now() - t_start).count();
+
+        {
+            std::lock_guard<std::mutex> lock(srv.mutex);
+
+            s->n_samples_done += pcmf32.size();
+            s->t_compute_sec  += t_compute;
+            s->busy   = false;
+            s->failed = s->failed || !ok;
+
+            s->n_samples_la = s->la.pcmf32.size();
+
+            if (flush) {
+                srv.streams.erase(std::find(srv.streams.begin(), srv.streams.end(), s));
+            }
+        }
+
+        if (flush) {
+            const double t_audio = double(s->n_samples_done)/WHISPER_SAMPLE_RATE;
+
+            fprintf(stderr, "%s: stream %d: closed, %.1f s of audio, rtf = %.2f, max late = %.2f s\n",
+                    __func__, s->id, t_audio, s->t_compute_sec/std::max(t_audio, 1e-3), s->t_late_max);
+
+            close(s->fd);
+            whisper_free_state(s->state);
+
+            delete s;
+        }
+
+        // the audio that arrived during the step may already make up the next one
+        srv.cv.notify_one();
+    }
+}
+
+// the real-time factor and the backlog of each stream
+static void server_stats(server & srv) {
+    const auto & params = *srv.params;
+
+    while (true) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(params.stats_ms));
+
+        std::lock_guard<std::mutex> lock(srv.mutex);
+
+        if (srv.streams.empty()) {
+            continue;
+        }
+
+        fprintf(stderr, "\n%s: %d streams\n", __func__, (int) srv.streams.size());
+
+        for (const auto * s : srv.streams) {
+            const double t_audio   = double(s->n_samples_done)/WHISPER_SAMPLE_RATE;
+            // a stream that falls behind keeps the audio beyond the first 30 s of a step in la.pcmf32
+            const double t_backlog = double(s->pcmf32_pending.size() + s->n_samples_la)/WHISPER_SAMPLE_RATE;
+
+            fprintf(stderr, "%s:   stream %3d: %8.1f s of audio, rtf = %5.2f, backlog = %5.1f s, max late = %5.2f s%s\n",
+                    __func__, s->id, t_audio, s->t_compute_sec/std::max(t_audio, 1e-3), t_backlog, s->t_late_max, s->busy ? ", busy" : "");
+        }
+    }
+}
+
+static int server_listen(const whisper_params & params) {
+    int fd = -1;
+
+    if (!params.unix_path.empty()) {
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            return -1;
+        }
+
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, params.unix_path.c_str(), sizeof(addr.sun_path) - 1);
+
+        unlink(params.unix_path.c_str());
+
+        if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+            close(fd);
+            return -1;
+        }
+    } else {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) {
+            return -1;
+        }
+
+        const int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port   = htons(params.port);
+
+        if (inet_pton(AF_INET, params.host.c_str(), &addr.sin_addr) != 1 ||
+            bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    if (listen(fd, 16) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int main(int argc, char ** argv) {
+    whisper_params params;
+
+    if (whisper_params_parse(argc, argv, params) == false) {
+        return 1;
+    }
+
+    if (params.language != "auto" && whisper_lang_id(params.language.c_str()) == -1) {
+        fprintf(stderr, "error: unknown language '%s'\n", params.language.c_str());
+        whisper_print_usage(argc, argv, params);
+        exit(0);
+    }
+
+    params.n_threads = std::max(1, params.n_threads);
+
+    if (params.n_workers <= 0) {
+        params.n_workers = std::max(1, (int) std::thread::hardware_concurrency()/params.n_threads);
+    }
+
+    // each stream holds the KV caches of its state (kv_cross and the kv_self of each decoder), and each worker builds
+    // the graphs of one step at a time - all of them must fit in GGML_MAX_CONTEXTS, together with the model
+    {
+        const int n_decoders = params.no_fallback ? 1 : std::max(1, whisper_full_default_params(WHISPER_SAMPLING_GREEDY).greedy.best_of);
+
+        params.n_workers = std::min(params.n_workers, (GGML_MAX_CONTEXTS - 1)/(1 + 2*n_decoders));
+
+        const int max_streams = (GGML_MAX_CONTEXTS - 1 - params.n_workers*n_decoders)/(1 + n_decoders);
+
+        if (params.max_streams > max_streams) {
+            fprintf(stderr, "%s: WARNING: at most %d streams fit in the ggml contexts, using -ms %d\n", __func__, max_streams, max_streams);
+            params.max_streams = max_streams;
+        }
+    }
+
+    // a client that disconnects early must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // whisper init - each stream allocates its own state
+
+    struct whisper_context * ctx = whisper_init_from_file_no_state(params.model.c_str());
+
+    if (ctx == nullptr) {
+        fprintf(stderr, "error: failed to initialize whisper context\n");
+        return 2;
+    }
+
+    if (!whisper_is_multilingual(ctx)) {
+        if (params.language != "en" || params.translate) {
+            params.language = "en";
+            params.translate = false;
+            fprintf(stderr, "%s: WARNING: model is not multilingual, ignoring language and translation options\n", __func__);
+        }
+    }
+
+    const int fd_listen = server_listen(params);
+    if (fd_listen < 0) {
+        fprintf(stderr, "error: failed to listen on '%s'\n", params.unix_path.empty() ? (params.host + ":" + std::to_string(params.port)).c_str() : params.unix_path.c_str());
+        return 3;
+    }
+
+    server srv;
+
+    srv.ctx    = ctx;
+    srv.params = &params;
+
+    srv.n_samples_step = (1e-3*params.step_ms  )*WHISPER_SAMPLE_RATE;
+    srv.n_samples_len  = (1e-3*params.length_ms)*WHISPER_SAMPLE_RATE;
+
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%s: listening on '%s', %d workers, %d threads, step = %.1f sec, lang = %s, task = %s\n",
+            __func__,
+            params.unix_path.empty() ? (params.host + ":" + std::to_string(params.port)).c_str() : params.unix_path.c_str(),
+            params.n_workers, params.n_threads,
+            1e-3*params.step_ms,
+            params.language.c_str(),
+            params.translate ? "translate" : "transcribe");
+    fprintf(stderr, "\n");
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < params.n_workers; ++i) {
+        workers.emplace_back(server_worker, std::ref(srv));
+    }
+
+    if (params.stats_ms > 0) {
+        std::thread(server_stats, std::ref(srv)).detach();
+    }
+
+    int n_streams = 0;
+
+    while (true) {
+        const int fd = accept(fd_listen, nullptr, nullptr);
+        if (fd < 0) {
+            continue;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(srv.mutex);
+
+            if ((int) srv.streams.size() >= params.max_streams) {
+                fprintf(stderr, "%s: WARNING: too many streams, rejecting the connection\n", __func__);
+                server_send(fd, "error: too many streams\n");
+                close(fd);
+                continue;
+            }
+        }
+
+        struct whisper_state * state = whisper_init_state(ctx);
+        if (state == nullptr) {
+            fprintf(stderr, "%s: WARNING: failed to initialize whisper state, rejecting the connection\n", __func__);
+            server_send(fd, "error: failed to initialize the stream\n");
+            close(fd);
+            continue;
+        }
+
+        server_stream * s = new server_stream;
+
+        s->id    = n_streams++;
+        s->fd    = fd;
+        s->state = state;
+
+        {
+            std::lock_guard<std::mutex> lock(srv.mutex);
+            srv.streams.push_back(s);
+        }
+
+        fprintf(stderr, "%s: stream %d: connected\n", __func__, s->id);
+
+        std::thread(server_reader, std::ref(srv), s).detach();
+    }
+
+    return 0;
+}
@@ -5,10 +5,12 @@
 
 #include "common.h"
 #include "common-sdl.h"
+#include "common-whisper.h"
 #include "whisper.h"
 
 #include <cassert>
 #include <cstdio>
+#include <cstring>
 #include <string>
 #include <thread>
 #include <vector>
@@ -42,15 +44,18 @@ struct whisper_params {
     float freq_thold   = 100.0f;
 
     bool speed_up      = false;
+    bool audio_ctx_auto = false;
     bool translate     = false;
     bool no_fallback   = false;
     bool print_special = false;
     bool no_context    = true;
     bool no_timestamps = false;
+    bool local_agreement = false;
 
     std::string language  = "en";
     std::string model     = "models/ggml-base.en.bin";
     std::string fname_out;
+    std::string fname_capture;
 };
 
 void whisper_print_usage(int argc, char ** argv, const whisper_params & params);
@@ -68,15 +73,18 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params) {
         else if (                 arg == "--length")        { params.length_ms     = std::stoi(argv[++i]); }
         else if (                 arg == "--keep")          { params.keep_ms       = std::stoi(argv[++i]); }
         else if (arg == "-c"   || arg == "--capture")       { params.capture_id    = std::stoi(argv[++i]); }
+        else if (arg == "-cf"  || arg == "--capture-file")  { params.fname_capture = argv[++i]; }
         else if (arg == "-mt"  || arg == "--max-tokens")    { params.max_tokens    = std::stoi(argv[++i]); }
         else if (arg == "-ac"  || arg == "--audio-ctx")     { params.audio_ctx     = std::stoi(argv[++i]); }
         else if (arg == "-vth" || arg == "--vad-thold")     { params.vad_thold     = std::stof(argv[++i]); }
         else if (arg == "-fth" || arg == "--freq-thold")    { params.freq_thold    = std::stof(argv[++i]); }
         else if (arg == "-su"  || arg == "--speed-up")      { params.speed_up      = true; }
+        else if (arg == "-aca" || arg == "--audio-ctx-auto") { params.audio_ctx_auto = true; }
         else if (arg == "-tr"  || arg == "--translate")     { params.translate     = true; }
         else if (arg == "-nf"  || arg == "--no-fallback")   { params.no_fallback   = true; }
         else if (arg == "-ps"  || arg == "--print-special") { params.print_special = true; }
         else if (arg == "-kc"  || arg == "--keep-context")  { params.no_context    = false; }
+        else if (arg == "-la"  || arg == "--local-agreement") { params.local_agreement = true; }
         else if (arg == "-l"   || arg == "--language")      { params.language      = argv[++i]; }
         else if (arg == "-m"   || arg == "--model")         { params.model         = argv[++i]; }
         else if (arg == "-f"   || arg == "--file")          { params.fname_out     = argv[++i]; }
@@ -101,15 +109,18 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "            --length N      [%-7d] audio length in milliseconds\n",                   params.length_ms);
     fprintf(stderr, "            --keep N        [%-7d] audio to keep from previous step in ms\n",         params.keep_ms);
     fprintf(stderr, "  -c ID,    --capture ID    [%-7d] capture device ID\n",                              params.capture_id);
+    fprintf(stderr, "  -cf FNAME, --capture-file FNAME [%-7s] capture from a WAV file at real-time speed instead of a device\n", params.fname_capture.c_str());
     fprintf(stderr, "  -mt N,    --max-tokens N  [%-7d] maximum number of tokens per audio chunk\n",       params.max_tokens);
     fprintf(stderr, "  -ac N,    --audio-ctx N   [%-7d] audio context size (0 - all)\n",                   params.audio_ctx);
     fprintf(stderr, "  -vth N,   --vad-thold N   [%-7.2f] voice activity detection threshold\n",           params.vad_thold);
     fprintf(stderr, "  -fth N,   --freq-thold N  [%-7.2f] high-pass frequency cutoff\n",                   params.freq_thold);
     fprintf(stderr, "  -su,      --speed-up      [%-7s] speed up audio by x2 (reduced accuracy)\n",        params.speed_up ? "true" : "false");
+    fprintf(stderr, "  -aca,     --audio-ctx-auto [%-7s] smaller audio context for the audio shorter than 30 s\n", params.audio_ctx_auto ? "true" : "false");
     fprintf(stderr, "  -tr,      --translate     [%-7s] translate from source language to english\n",      params.translate ? "true" : "false");
     fprintf(stderr, "  -nf,      --no-fallback   [%-7s] do not use temperature fallback while decoding\n", params.no_fallback ? "true" : "false");
     fprintf(stderr, "  -ps,      --print-special [%-7s] print special tokens\n",                           params.print_special ? "true" : "false");
     fprintf(stderr, "  -kc,      --keep-context  [%-7s] keep context between audio chunks\n",              params.no_context ? "false" : "true");
+    fprintf(stderr, "  -la,      --local-agreement [%-7s] commit the text on which consecutive steps agree, decode only the rest\n", params.local_agreement ? "true" : "false");
     fprintf(stderr, "  -l LANG,  --language LANG [%-7s] spoken language\n",                                params.language.c_str());
     fprintf(stderr, "  -m FNAME, --model FNAME   [%-7s] model path\n",                                     params.model.c_str());
     fprintf(stderr, "  -f FNAME, --file FNAME    [%-7s] text output file name\n",                          params.fname_out.c_str());
@@ -133,6 +144,12 @@ int main(int argc, char ** argv) {
 
     const bool use_vad = n_samples_step <= 0; // sliding window mode uses VAD
 
+    if (use_vad && params.local_agreement) {
+        fprintf(stderr, "error: --local-agreement requires --step > 0\n");
+        whisper_print_usage(argc, argv, params);
+        exit(0);
+    }
+
     const int n_new_line = !use_vad ? std::max(1, params.length_ms / params.step_ms - 1) : 1; // number of steps to print new line
 
     params.no_timestamps  = !use_vad;
@@ -142,7 +159,7 @@ int main(int argc, char ** argv) {
     // init audio
 
     audio_async audio(params.length_ms);
-    if (!audio.init(params.capture_id, WHISPER_SAMPLE_RATE)) {
+    if (!(params.fname_capture.empty() ? audio.init(params.capture_id, WHISPER_SAMPLE_RATE) : audio.init_file(params.fname_capture, WHISPER_SAMPLE_RATE))) {
         fprintf(stderr, "%s: audio.init() failed!\n", __func__);
         return 1;
     }
@@ -160,9 +177,11 @@ int main(int argc, char ** argv) {
     struct whisper_context * ctx = whisper_init_from_file(params.model.c_str());
 
     std::vector<float> pcmf32    (n_samples_30s, 0.0f);
-    std::vector<float> pcmf32_old;
     std::vector<float> pcmf32_new(n_samples_30s, 0.0f);
 
+    // the audio of the previous step is kept at the end of pcmf32
+    int n_samples_old = 0;
+
     std::vector<whisper_token> prompt_tokens;
 
     // print some info about the processing
@@ -186,7 +205,9 @@ int main(int argc, char ** argv) {
                 params.translate ? "translate" : "transcribe",
                 params.no_timestamps ? 0 : 1);
 
-        if (!use_vad) {
+        if (params.local_agreement) {
+            fprintf(stderr, "%s: using local agreement, the text is committed when two consecutive steps agree\n", __func__);
+        } else if (!use_vad) {
             fprintf(stderr, "%s: n_new_line = %d, no_context = %d\n", __func__, n_new_line, params.no_context);
         } else {
             fprintf(stderr, "%s: using VAD, will transcribe on speech activity\n", __func__);
@@ -211,6 +232,61 @@ int main(int argc, char ** argv) {
     printf("[Start speaking]");
     fflush(stdout);
 
+    stream_la la;
+
+    std::vector<stream_token> committed;
+
+    whisper_full_params wparams_la = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+
+    wparams_la.print_progress   = false;
+    wparams_la.print_special    = params.print_special;
+    wparams_la.print_realtime   = false;
+    wparams_la.print_timestamps = false;
+    wparams_la.translate        = params.translate;
+    wparams_la.language         = params.language.c_str();
+    wparams_la.n_threads        = params.n_threads;
+
+    wparams_la.audio_ctx        = params.audio_ctx;
+    wparams_la.speed_up         = params.speed_up;
+    wparams_la.audio_ctx_auto   = params.audio_ctx_auto;
+
+    wparams_la.temperature_inc  = params.no_fallback ? 0.0f : wparams_la.temperature_inc;
+
+    // print and write the newly committed text, followed by the tentative text in gray
+    const auto print_la = [&]() {
+        // go back to the end of the committed text and clear the tentative text
+        printf("\0338\33[J");
+
+        for (const auto & token : committed) {
+            printf("%s", token.text.c_str());
+
+            if (params.fname_out.length() > 0) {
+                fout << token.text;
+            }
+
+            if (token.t_seg_end >= 0) {
+                printf("\n");
+
+                if (params.fname_out.length() > 0) {
+                    fout << std::endl;
+                }
+            }
+        }
+
+        printf("\0337\033[90m");
+        for (const auto & token : la.hyp_prev) {
+            printf("%s", token.text.c_str());
+        }
+        printf("\033[0m");
+        fflush(stdout);
+    };
+
+    // the committed text is followed by the tentative text, which is cleared in the next step (see below)
+    if (params.local_agreement) {
+        printf("\n\0337");
+        fflush(stdout);
+    }
+
           auto t_last  = std::chrono::high_resolution_clock::now();
     const auto t_start = t_last;
 
@@ -226,16 +302,21 @@ int main(int argc, char ** argv) {
         // process new audio
 
         if (!use_vad) {
+            // the new audio is read in place from the capture buffer - it stays valid for params.length_ms of capture
+            const float * data_new = nullptr;
+
+            int n_samples_new = 0;
+
             while (true) {
-                audio.get(params.step_ms, pcmf32_new);
+                n_samples_new = audio.get_view(params.step_ms, &data_new);
 
-                if ((int) pcmf32_new.size() > 2*n_samples_step) {
+                if (n_samples_new > 2*n_samples_step) {
                     fprintf(stderr, "\n\n%s: WARNING: cannot process audio fast enough, dropping audio ...\n\n", __func__);
                     audio.clear();
                     continue;
                 }
 
-                if ((int) pcmf32_new.size() >= n_samples_step) {
+                if (n_samples_new >= n_samples_step) {
                     audio.clear();
                     break;
                 }
@@ -243,22 +324,34 @@ int main(int argc, char ** argv) {
                 std::this_thread::sleep_for(std::chrono::milliseconds(1));
             }
 
-            const int n_samples_new = pcmf32_new.size();
+            if (params.local_agreement) {
+                pcmf32_new.assign(data_new, data_new + n_samples_new);
 
-            // take up to params.length_ms audio from previous iteration
-            const int n_samples_take = std::min((int) pcmf32_old.size(), std::max(0, n_samples_keep + n_samples_len - n_samples_new));
+                if (!stream_la_process(ctx, whisper_get_state(ctx), la, wparams_la, n_samples_len, false, pcmf32_new, committed)) {
+                    fprintf(stderr, "%s: failed to process audio\n", argv[0]);
+                    return 6;
+                }
 
-            //printf("processing: take = %d, new = %d, old = %d\n", n_samples_take, n_samples_new, (int) pcmf32_old.size());
+                print_la();
 
-            pcmf32.resize(n_samples_new + n_samples_take);
+                ++n_iter;
 
-            for (int i = 0; i < n_samples_take; i++) {
-                pcmf32[i] = pcmf32_old[pcmf32_old.size() - n_samples_take + i];
+                continue;
             }
 
-            memcpy(pcmf32.data() + n_samples_take, pcmf32_new.data(), n_samples_new*sizeof(float));
+            // take up to params.length_ms audio from previous iteration
+            const int n_samples_take = std::min(n_samples_old, std::max(0, n_samples_keep + n_samples_len - n_samples_new));
 
-            pcmf32_old = pcmf32;
+            //printf("processing: take = %d, new = %d, old = %d\n", n_samples_take, n_samples_new, n_samples_old);
+
+            // move it to the front of the buffer, instead of copying the whole buffer every step
+            memmove(pcmf32.data(), pcmf32.data() + pcmf32.size() - n_samples_take, n_samples_take*sizeof(float));
+
+            pcmf32.resize(n_samples_new + n_samples_take);
+
+            memcpy(pcmf32.data() + n_samples_take, data_new, n_samples_new*sizeof(float));
+
+            n_samples_old = pcmf32.size();
         } else {
             const auto t_now  = std::chrono::high_resolution_clock::now();
             const auto t_diff = std::chrono::duration_cast<std::chrono::milliseconds>(t_now - t_last).count();
@@ -298,6 +391,7 @@ int main(int argc, char ** argv) {
 
             wparams.audio_ctx        = params.audio_ctx;
             wparams.speed_up         = params.speed_up;
+            wparams.audio_ctx_auto   = params.audio_ctx_auto;
 
             // disable temperature fallback
             //wparams.temperature_inc  = -1.0f;
@@ -368,7 +462,7 @@ int main(int argc, char ** argv) {
                 printf("\n");
 
                 // keep part of the audio for next iteration to try to mitigate word boundary issues
-                pcmf32_old = std::vector<float>(pcmf32.end() - n_samples_keep, pcmf32.end());
+                n_samples_old = n_samples_keep;
 
                 // Add tokens of the last full length segment as the prompt
                 if (!params.no_context) {
@@ -387,6 +481,33 @@ int main(int argc, char ** argv) {
         }
     }
 
+    // at the end of the stream, the tentative text and the audio that was not processed yet are committed
+    if (params.local_agreement) {
+        const float * data_new = nullptr;
+
+        const int n_samples_new = audio.get_view(params.step_ms, &data_new);
+
+        pcmf32_new.assign(data_new, data_new + n_samples_new);
+
+        while (true) {
+            if (!stream_la_process(ctx, whisper_get_state(ctx), la, wparams_la, n_samples_len, true, pcmf32_new, committed)) {
+                fprintf(stderr, "%s: failed to process audio\n", argv[0]);
+                return 6;
+            }
+
+            print_la();
+
+            pcmf32_new.clear();
+
+            if (la.pcmf32.empty()) {
+                break;
+            }
+        }
+
+        printf("\n");
+        fflush(stdout);
+    }
+
     audio.pause();
 
     whisper_print_timings(ctx);
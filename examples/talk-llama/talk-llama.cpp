@@ -50,6 +50,7 @@ struct whisper_params {
     std::string speak       = "./examples/talk-llama/speak";
     std::string prompt      = "";
     std::string fname_out;
+    std::string fname_capture;
     std::string path_session = "";       // path to file for saving/loading model eval state
 };
 
@@ -66,6 +67,7 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params) {
         else if (arg == "-t"   || arg == "--threads")       { params.n_threads     = std::stoi(argv[++i]); }
         else if (arg == "-vms" || arg == "--voice-ms")      { params.voice_ms      = std::stoi(argv[++i]); }
         else if (arg == "-c"   || arg == "--capture")       { params.capture_id    = std::stoi(argv[++i]); }
+        else if (arg == "-cf"  || arg == "--capture-file")  { params.fname_capture = argv[++i]; }
         else if (arg == "-mt"  || arg == "--max-tokens")    { params.max_tokens    = std::stoi(argv[++i]); }
         else if (arg == "-ac"  || arg == "--audio-ctx")     { params.audio_ctx     = std::stoi(argv[++i]); }
         else if (arg == "-vth" || arg == "--vad-thold")     { params.vad_thold     = std::stof(argv[++i]); }
@@ -108,6 +110,7 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "  -t N,     --threads N     [%-7d] number of threads to use during computation\n", params.n_threads);
     fprintf(stderr, "  -vms N,   --voice-ms N    [%-7d] voice duration in milliseconds\n",              params.voice_ms);
     fprintf(stderr, "  -c ID,    --capture ID    [%-7d] capture device ID\n",                           params.capture_id);
+    fprintf(stderr, "  -cf FNAME, --capture-file FNAME [%-7s] capture from a WAV file at real-time speed instead of a device\n", params.fname_capture.c_str());
     fprintf(stderr, "  -mt N,    --max-tokens N  [%-7d] maximum number of tokens per audio chunk\n",    params.max_tokens);
     fprintf(stderr, "  -ac N,    --audio-ctx N   [%-7d] audio context size (0 - all)\n",                params.audio_ctx);
     fprintf(stderr, "  -vth N,   --vad-thold N   [%-7.2f] voice activity detection threshold\n",        params.vad_thold);
@@ -271,7 +274,7 @@ int main(int argc, char ** argv) {
     // init audio
 
     audio_async audio(30*1000);
-    if (!audio.init(params.capture_id, WHISPER_SAMPLE_RATE)) {
+    if (!(params.fname_capture.empty() ? audio.init(params.capture_id, WHISPER_SAMPLE_RATE) : audio.init_file(params.fname_capture, WHISPER_SAMPLE_RATE))) {
         fprintf(stderr, "%s: audio.init() failed!\n", __func__);
         return 1;
     }
@@ -0,0 +1,196 @@
+#!/bin/bash
+
+# This script compares the speed and the accuracy of quantized variants of a model.
+# The model is quantized with each of the given types or quantization profiles (see examples/quantize/README.md).
+# The audio files of run-tests.sh are transcribed with the original model and with each variant, and the script
+# reports the model size, the transcription time and the word error rate (WER) against the reference transcriptions.
+# It can be used to find the fastest variant with an acceptable accuracy.
+#
+# Usage:
+#
+#   ./tests/run-quant-eval.sh <model_name> <threads> <type|profile> [<type|profile> ...]
+#
+# Example:
+#
+#   ./tests/run-quant-eval.sh base.en 8 q8_0 q5_0 q4_0 examples/quantize/profiles/mixed-q4.txt
+#
+
+if [ $# -lt 3 ]; then
+    printf "Usage: $0 <model_name> <threads> <type|profile> [<type|profile> ...]\n\n"
+    exit 1
+fi
+
+model=$1
+threads=$2
+shift 2
+
+# profiles are given relative to the current directory
+variants=()
+for variant in "$@"; do
+    if [ -f $variant ]; then
+        variant=$(realpath $variant)
+    fi
+    variants+=("$variant")
+done
+
+cd `dirname $0`
+
+main="../main"
+quantize="../quantize"
+
+if [ ! -f ../models/ggml-$model.bin ]; then
+    printf "Model $model not found. Aborting\n"
+    exit 1
+fi
+
+for exe in $main $quantize; do
+    if [ ! -f $exe ]; then
+        printf "Executable $exe not found. Aborting\n"
+        exit 1
+    fi
+done
+
+# the same audio files as in run-tests.sh
+urls_en=(
+    "https://upload.wikimedia.org/wikipedia/commons/1/1f/George_W_Bush_Columbia_FINAL.ogg"
+    "https://upload.wikimedia.org/wikipedia/en/d/d4/En.henryfphillips.ogg"
+    "https://cdn.openai.com/whisper/draft-20220913a/micro-machines.wav"
+)
+
+urls_es=(
+    "https://upload.wikimedia.org/wikipedia/commons/c/c1/La_contaminacion_del_agua.ogg"
+)
+
+# the files to transcribe, as "lang index"
+inputs=()
+
+function fetch_lang() {
+    lang=$1
+    shift
+    urls=("$@")
+
+    i=0
+    for url in "${urls[@]}"; do
+        ext="${url##*.}"
+        fname_src="$lang-${i}.${ext}"
+        fname_dst="$lang-${i}-16khz.wav"
+
+        if [ ! -f $fname_src ]; then
+            wget --quiet --show-progress -O $fname_src $url
+        fi
+
+        if [ ! -f $fname_dst ]; then
+            ffmpeg -loglevel -0 -y -i $fname_src -ar 16000 -ac 1 -c:a pcm_s16le $fname_dst
+            if [ $? -ne 0 ]; then
+                echo "Error: ffmpeg failed to convert $fname_src to $fname_dst"
+                exit 1
+            fi
+        fi
+
+        inputs+=("$lang $i")
+
+        i=$(($i+1))
+    done
+}
+
+fetch_lang "en" "${urls_en[@]}"
+
+if [[ $model != *.en ]]; then
+    fetch_lang "es" "${urls_es[@]}"
+fi
+
+# word error rate of a transcription: word-level edit distance to the reference, over the number of reference words
+# the case and the punctuation are ignored
+function wer() {
+    awk '
+        function words(fname, w,   line, n, i, k, t) {
+            n = 0
+            while ((getline line < fname) > 0) {
+                line = tolower(line)
+                gsub(/[^a-z0-9'"'"'áéíóúñü ]/, " ", line)
+                k = split(line, t, " ")
+                for (i = 1; i <= k; i++) {
+                    w[++n] = t[i]
+                }
+            }
+            close(fname)
+            return n
+        }
+        BEGIN {
+            n = words(ARGV[1], r)
+            m = words(ARGV[2], h)
+
+            for (j = 0; j <= m; j++) {
+                d[j] = j
+            }
+
+            for (i = 1; i <= n; i++) {
+                prev = d[0]
+                d[0] = i
+                for (j = 1; j <= m; j++) {
+                    cur = d[j]
+                    best = prev + (r[i] != h[j])
+                    if (d[j] + 1 < best)   best = d[j] + 1
+                    if (d[j-1] + 1 < best) best = d[j-1] + 1
+                    d[j] = best
+                    prev = cur
+                }
+            }
+
+            printf("%d %d\n", d[m], n)
+        }' "$1" "$2"
+}
+
+# transcribe all inputs with a model and print the results
+function eval_model() {
+    name=$1
+    fname_model=$2
+
+    size=$(du -mL $fname_model | cut -f1)
+
+    t_total=0
+    n_errors=0
+    n_words=0
+
+    for input in "${inputs[@]}"; do
+        read lang i <<< "$input"
+
+        fname_out="quant-eval-$lang-$i"
+
+        $main -m $fname_model -t $threads -f $lang-$i-16khz.wav -l $lang -otxt -of $fname_out 2> $fname_out.log > /dev/null
+
+        t=$(grep "total time" $fname_out.log | sed -e 's/.*= *\([0-9.]*\) ms/\1/')
+        t_total=$(awk "BEGIN { print $t_total + $t }")
+
+        read e n <<< $(wer $lang-$i-ref.txt $fname_out.txt)
+        n_errors=$(($n_errors + $e))
+        n_words=$(($n_words + $n))
+
+        rm -f $fname_out.txt $fname_out.log
+    done
+
+    wer_pct=$(awk "BEGIN { printf(\"%.2f\", 100*$n_errors/$n_words) }")
+
+    printf "%-48s %10s %12.0f %8s\n" "$name" "$size" "$t_total" "$wer_pct"
+}
+
+printf "\n"
+printf "%-48s %10s %12s %8s\n" "model" "size (MB)" "time (ms)" "WER (%)"
+
+eval_model "$model" ../models/ggml-$model.bin
+
+for variant in "${variants[@]}"; do
+    fname_model="quant-eval-$model.bin"
+
+    $quantize ../models/ggml-$model.bin $fname_model $variant $threads > /dev/null 2>&1
+    if [ $? -ne 0 ]; then
+        printf "%-48s failed to quantize\n" "$(basename $variant)"
+        continue
+    fi
+
+    eval_model "$(basename $variant)" $fname_model
+
+    rm -f $fname_model
+done
+
+printf "\n"
@@ -16,13 +16,34 @@
 #include <cstdio>
 #include <cstring>
 #include <fstream>
+#include <functional>
+#include <future>
+#include <atomic>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 #include <string>
 #include <thread>
 #include <vector>
 #include <regex>
 #include <random>
 
+#if defined(__linux__) && !defined(__BIONIC__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// packed models are memory-mapped - the tensors cannot be byte-swapped in place, so not on big-endian systems
+#if !defined(_WIN32) && !defined(GGML_BIG_ENDIAN)
+#define WHISPER_USE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #if defined(_MSC_VER)
 #pragma warning(disable: 4244 4267) // possible loss of data
 #endif
@@ -377,6 +398,14 @@ struct whisper_filters {
     std::vector<float> data;
 };
 
+// ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
+static const std::vector<std::string> non_speech_tokens = {
+    "\"", "#", "(", ")", "*", "+", "/", ":", ";", "<", "=", ">", "@", "[", "\\", "]", "^",
+    "_", "`", "{", "|", "}", "~", "「", "」", "『", "』", "<<", ">>", "<<<", ">>>", "--",
+    "---", "-(", "-[", "('", "(\"", "((", "))", "(((", ")))", "[[", "]]", "{{", "}}", "♪♪",
+    "♪♪♪","♩", "♪", "♫", "♬", "♭", "♮", "♯"
+};
+
 struct whisper_vocab {
     using id    = int32_t;
     using token = std::string;
@@ -399,6 +428,10 @@ struct whisper_vocab {
     id token_not        = 50362; // no timestamps
     id token_beg        = 50363; // begin timestamps
 
+    // token sets used by the logit filters, precomputed when the vocab is loaded
+    id token_blank = -1;                   // " " (-1 if not in the vocab)
+    std::vector<id> token_non_speech;      // see non_speech_tokens, sorted
+
     bool is_multilingual() const {
         return n_vocab == 51865;
     }
@@ -413,6 +446,8 @@ struct whisper_segment {
     std::vector<whisper_token_data> tokens;
 
     bool speaker_turn_next;
+
+    int clip; // [EXPERIMENTAL] see whisper_full_clips()
 };
 
 // medium
@@ -531,6 +566,11 @@ struct whisper_layer_decoder {
     struct ggml_tensor * mlp_1_b;
 };
 
+// the caches are stored in the layout consumed by the attention matmuls, so that no per-token permute/copy is needed:
+//
+//   k: [n_layer][n_head][n_ctx][n_state/n_head]
+//   v: [n_layer][n_head][n_state/n_head][n_ctx] (transposed)
+//
 struct whisper_kv_cache {
     struct ggml_tensor * k;
     struct ggml_tensor * v;
@@ -582,6 +622,10 @@ struct whisper_model {
     // the model memory buffer is read-only and can be shared between processors
     std::vector<uint8_t> * buf;
 
+    // the memory-mapped model file, for a packed model loaded from a file - the tensor data points into it
+    void * mapping      = nullptr;
+    size_t mapping_size = 0;
+
     // tensors
     int n_loaded;
     std::map<std::string, struct ggml_tensor *> tensors;
@@ -600,11 +644,64 @@ struct whisper_sequence {
     double score;            // likelihood rank score
 };
 
+// the decoder graph for a single-token step
+// it is built once and then replayed - only the input token and the tensors that depend on n_past are updated
+// see whisper_build_graph_decoder() and whisper_graph_decoder_set_n_past()
+struct whisper_graph_decoder {
+    int n_audio_ctx  = 0; // the graph is valid only for this audio context, up to this number of threads
+    int n_threads    = 0;
+    int n_logits_ids = 0; // and number of active tokens (0 - the whole vocabulary)
+
+    const struct ggml_tensor * kv_cross_k = nullptr; // and cross-attention KV cache
+
+    struct ggml_context * ctx = nullptr; // only while the graph is built - a cached graph does not hold a context
+
+    std::vector<uint8_t> buf;
+
+    // the intermediate results of the graph - owned by the cached graphs, so that the decoders of a state
+    // can be evaluated concurrently, and borrowed from the state by the one-off graphs
+    std::vector<uint8_t> buf_scratch[WHISPER_MAX_SCRATCH_BUFFERS];
+
+    struct ggml_cgraph gf = {};
+
+    struct ggml_tensor * embd       = nullptr;
+    struct ggml_tensor * position   = nullptr;
+    struct ggml_tensor * logits_ids = nullptr; // the active tokens, if any
+    struct ggml_tensor * d_te       = nullptr; // the rows of model.d_te used for the output projection
+    struct ggml_tensor * logits     = nullptr;
+
+    // per-layer self-attention tensors that depend on n_past
+    std::vector<struct ggml_tensor *> k_cpy; // stores Kcur into kv_self.k
+    std::vector<struct ggml_tensor *> v_cpy; // stores Vcur into kv_self.v
+    std::vector<struct ggml_tensor *> K;
+    std::vector<struct ggml_tensor *> V;
+    std::vector<struct ggml_tensor *> KQ;
+    std::vector<struct ggml_tensor *> KQ_masked;
+    std::vector<struct ggml_tensor *> KQ_soft_max;
+
+    void use_buf(struct ggml_context * ctx, int i) {
+#if defined(WHISPER_USE_SCRATCH)
+        if (i == -1) {
+            ggml_set_scratch(ctx, { 0, 0, nullptr, });
+        } else {
+            auto & buf = buf_scratch[i];
+            ggml_set_scratch(ctx, { 0, buf.size(), buf.data(), });
+        }
+#else
+        (void) i;
+        (void) ctx;
+#endif
+    }
+};
+
 // TAGS: WHISPER_DECODER_INIT
 struct whisper_decoder {
     // each decoders keeps its own KV-cache
     whisper_kv_cache kv_self;
 
+    // cached graph for the single-token decoding steps
+    whisper_graph_decoder graph;
+
     // the currently generated sequence of tokens
     whisper_sequence sequence;
 
@@ -620,6 +717,84 @@ struct whisper_decoder {
     std::vector<float> logprobs;
 
     std::vector<whisper_token> tokens_tmp; // used for whisper_decode calls
+    std::vector<float>         logits_tmp; // the output of the whisper_decode calls done concurrently with other decoders
+
+    mutable std::mt19937 rng; // used for sampling at t > 0.0 - each decoder has its own stream
+};
+
+// [EXPERIMENTAL] threads that evaluate the active decoders concurrently (see whisper_full_decode())
+// they are started once and wait for the work of each decoding step, instead of being started on every step
+struct whisper_decoder_pool {
+    std::vector<std::thread> workers;
+
+    std::mutex              mutex;
+    std::condition_variable cv_work;
+    std::condition_variable cv_done;
+
+    std::function<void(int)> work; // work(iw) for the current step, iw = 0 is run by the caller
+
+    uint64_t step   = 0;
+    int      n_work = 0; // workers used in the current step (including the caller)
+    int      n_busy = 0; // workers still running the current step
+    bool     stop   = false;
+
+    whisper_decoder_pool(int n_threads) {
+        for (int iw = 1; iw <= n_threads; ++iw) {
+            workers.emplace_back([this, iw]() {
+                uint64_t step_last = 0;
+
+                std::unique_lock<std::mutex> lock(mutex);
+                while (true) {
+                    cv_work.wait(lock, [&]() { return stop || step != step_last; });
+                    if (stop) {
+                        return;
+                    }
+
+                    step_last = step;
+                    if (iw >= n_work) {
+                        continue;
+                    }
+
+                    lock.unlock();
+                    work(iw);
+                    lock.lock();
+
+                    if (--n_busy == 0) {
+                        cv_done.notify_one();
+                    }
+                }
+            });
+        }
+    }
+
+    ~whisper_decoder_pool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv_work.notify_all();
+
+        for (auto & worker : workers) {
+            worker.join();
+        }
+    }
+
+    // run f(0), ..., f(n - 1) concurrently and wait for all of them
+    void run(int n, std::function<void(int)> f) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            work   = std::move(f);
+            n_work = n;
+            n_busy = n - 1;
+            step++;
+        }
+        cv_work.notify_all();
+
+        work(0);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        cv_done.wait(lock, [&]() { return n_busy == 0; });
+    }
 };
 
 struct whisper_state {
@@ -657,8 +832,6 @@ struct whisper_state {
     // work container used to avoid memory allocations
     std::vector<std::pair<double, whisper_vocab::id>> logits_id;
 
-    mutable std::mt19937 rng; // used for sampling at t > 0.0
-
     int lang_id = 0; // english by default
 
     std::string path_model; // populated by whisper_init_from_file()
@@ -679,6 +852,39 @@ struct whisper_state {
     // [EXPERIMENTAL] speed-up techniques
     int32_t exp_n_audio_ctx = 0; // 0 - use default
 
+    // [EXPERIMENTAL] the decoder thread count picked by the calibration (see whisper_full_params.n_threads_decoder)
+    int32_t n_threads_decoder_tuned = 0;
+
+    // [EXPERIMENTAL] long-form transcription (see whisper_full_long()) - whisper_full_with_state() leaves the windows
+    // that start after seek_stop to the next call (-1 - no limit) and sets seek_next to the start of the next window
+    int32_t seek_stop = -1;
+    int32_t seek_next =  0;
+
+    // [EXPERIMENTAL] start of each clip concatenated by whisper_full_clips() [10 ms] - the prompt is not carried over
+    // from one clip to the next
+    std::vector<int64_t> clip_t0;
+
+    // [EXPERIMENTAL] states used to decode the fallback temperatures concurrently (see whisper_full_params.temperature_n_parallel)
+    // they do not own their kv_cross - it is the kv_cross of this state
+    std::vector<whisper_state *> states_fallback;
+
+    // [EXPERIMENTAL] state used to encode the next window ahead (see whisper_full_params.encode_ahead)
+    // its kv_cross is swapped with the kv_cross of this state when the guess was right
+    whisper_state * state_ahead = nullptr;
+
+    // [EXPERIMENTAL] state of the draft model for speculative decoding (see whisper_full_params.draft_ctx)
+    // each state has its own, so that a draft model can be shared by concurrent calls
+    whisper_state   * state_draft = nullptr;
+    whisper_context * ctx_draft   = nullptr; // the draft model state_draft was created for
+
+    // [EXPERIMENTAL] the encoder shared with other tasks on the same audio (see whisper_full_multi())
+    struct whisper_encoder_share * encoder_share = nullptr;
+    bool encoder_share_used = false; // are we using the window in the shared kv_cross
+    whisper_kv_cache kv_cross_own;   // our kv_cross while kv_cross may point to the shared one (not owned)
+
+    // [EXPERIMENTAL] started by the first decoding step with concurrent decoders
+    std::unique_ptr<whisper_decoder_pool> decoder_pool;
+
     void use_buf(struct ggml_context * ctx, int i) {
 #if defined(WHISPER_USE_SCRATCH)
         size_t last_size = 0;
@@ -812,6 +1018,16 @@ static void kv_cache_free(struct whisper_kv_cache & cache) {
 //
 // see the convert-pt-to-ggml.py script for details
 //
+// in the packed format (WHISPER_FILE_MAGIC_PACKED), the weights are instead:
+//
+//   - version, alignment, layout (0 - the ggml rows, as in the regular format), number of tensors
+//   - offset of the tensor data in the file
+//   - tensor table: dims, name length, type, shape, name, offset from the start of the data, size
+//   - size of the padding up to the tensor data, padding
+//   - tensor data, each tensor starting at a multiple of the alignment
+//
+// a memory-mapped packed model is not read - the tensors point into the mapping
+//
 static bool whisper_model_load(struct whisper_model_loader * loader, whisper_context & wctx) {
     if (DEBUG_MODE) {
       fprintf(stderr, "%s: loading model\n", __func__);
@@ -824,11 +1040,14 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
     auto & model = wctx.model;
     auto & vocab = wctx.vocab;
 
+    bool packed = false;
+
     // verify magic
     {
         uint32_t magic;
         read_safe(loader, magic);
-        if (magic != GGML_FILE_MAGIC) {
+        packed = magic == WHISPER_FILE_MAGIC_PACKED;
+        if (magic != GGML_FILE_MAGIC && !packed) {
             fprintf(stderr, "%s: invalid model data (bad magic)\n", __func__);
             return false;
         }
@@ -928,7 +1147,13 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         // always have at least one decoder
 
         wctx.model.buf = new std::vector<uint8_t>();
-        wctx.model.buf->resize(scale*MEM_REQ_MODEL.at(wctx.wtype).at(model.type));
+
+        // the weights of a memory-mapped model are not allocated, only the tensor objects
+        if (model.mapping) {
+            wctx.model.buf->resize((15 + 15*hparams.n_audio_layer + 24*hparams.n_text_layer)*ggml_tensor_overhead());
+        } else {
+            wctx.model.buf->resize(scale*MEM_REQ_MODEL.at(wctx.wtype).at(model.type));
+        }
 
         // we skip initialization of the state until it is needed
         // because it might be that state will always be provided externally.
@@ -1023,6 +1248,31 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
                 vocab.id_to_token[i] = word;
             }
         }
+
+        // resolve the token sets of the logit filters once, instead of looking up strings for every sampled token
+        {
+            const auto it = vocab.token_to_id.find(" ");
+            if (it != vocab.token_to_id.end()) {
+                vocab.token_blank = it->second;
+            }
+
+            // allow hyphens "-" and single quotes "'" between words, but not at the beginning of a word
+            std::vector<std::string> suppress_tokens = { " -", " '" };
+            for (const std::string & token : non_speech_tokens) {
+                suppress_tokens.push_back(token);
+                suppress_tokens.push_back(" " + token);
+            }
+
+            for (const std::string & token : suppress_tokens) {
+                const auto it = vocab.token_to_id.find(token);
+                if (it != vocab.token_to_id.end()) {
+                    vocab.token_non_speech.push_back(it->second);
+                }
+            }
+
+            std::sort(vocab.token_non_speech.begin(), vocab.token_non_speech.end());
+            vocab.token_non_speech.erase(std::unique(vocab.token_non_speech.begin(), vocab.token_non_speech.end()), vocab.token_non_speech.end());
+        }
     }
 
     size_t ctx_size = 0;
@@ -1147,7 +1397,7 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         struct ggml_init_params params = {
             /*.mem_size   =*/ wctx.model.buf->size(),
             /*.mem_buffer =*/ wctx.model.buf->data(),
-            /*.no_alloc   =*/ false,
+            /*.no_alloc   =*/ model.mapping != nullptr,
         };
 
         model.ctx = ggml_init(params);
@@ -1359,64 +1609,204 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
 
         model.n_loaded = 0;
 
-        while (true) {
+        // the model tensor for a tensor of the file, after checking its shape and type - nullptr if they do not match
+        auto get_tensor = [&](const std::string & name, const int32_t * ne, int32_t ttype) -> ggml_tensor * {
+            if (model.tensors.find(name) == model.tensors.end()) {
+                fprintf(stderr, "%s: unknown tensor '%s' in model file\n", __func__, name.data());
+                return nullptr;
+            }
+
+            const int32_t nelements = ne[0]*ne[1]*ne[2]*ne[3];
+
+            auto tensor = model.tensors[name.data()];
+            if (ggml_nelements(tensor) != nelements) {
+                fprintf(stderr, "%s: tensor '%s' has wrong size in model file\n", __func__, name.data());
+                fprintf(stderr, "%s: shape: [%d, %d, %d], expected: [%d, %d, %d]\n",
+                        __func__, ne[0], ne[1], ne[2], (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2]);
+                return nullptr;
+            }
+
+            if (tensor->ne[0] != ne[0] || tensor->ne[1] != ne[1] || tensor->ne[2] != ne[2]) {
+                fprintf(stderr, "%s: tensor '%s' has wrong shape in model file: got [%d, %d, %d], expected [%d, %d, %d]\n",
+                        __func__, name.data(), (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2], ne[0], ne[1], ne[2]);
+                return nullptr;
+            }
+
+            // models quantized with a profile (see examples/quantize) store some weights in a different type
+            // the model type is the widest one, so the memory allocated for the tensor is enough for the stored type
+            if (tensor->type != ggml_type(ttype) && tensor->type == wtype && ttype >= 0 && ttype < GGML_TYPE_COUNT) {
+                const ggml_type type = ggml_type(ttype);
+
+                if (ggml_blck_size(type) == 0 || ne[0] % ggml_blck_size(type) != 0 ||
+                    (nelements*ggml_type_size(type))/ggml_blck_size(type) > ggml_nbytes(tensor)) {
+                    fprintf(stderr, "%s: tensor '%s' has type %s in model file, which does not fit a %s tensor\n",
+                            __func__, name.data(), ggml_type_name(type), ggml_type_name(tensor->type));
+                    return nullptr;
+                }
+
+                tensor->type  = type;
+                tensor->nb[0] = ggml_type_size(type);
+                tensor->nb[1] = tensor->nb[0]*(tensor->ne[0]/ggml_blck_size(type));
+                for (int i = 2; i < GGML_MAX_DIMS; i++) {
+                    tensor->nb[i] = tensor->nb[i - 1]*tensor->ne[i - 1];
+                }
+            }
+
+            const size_t bpe = ggml_type_size(ggml_type(ttype));
+
+            if ((nelements*bpe)/ggml_blck_size(tensor->type) != ggml_nbytes(tensor)) {
+                fprintf(stderr, "%s: tensor '%s' has wrong size in model file: got %zu, expected %zu\n",
+                        __func__, name.data(), ggml_nbytes(tensor), nelements*bpe);
+                return nullptr;
+            }
+
+            return tensor;
+        };
+
+        auto read_tensor_header = [&](int32_t & ttype, int32_t * ne, std::string & name) {
             int32_t n_dims;
             int32_t length;
-            int32_t ttype;
 
             read_safe(loader, n_dims);
             read_safe(loader, length);
             read_safe(loader, ttype);
 
             if (loader->eof(loader->context)) {
-                break;
+                return false;
             }
 
-            int32_t nelements = 1;
-            int32_t ne[4] = { 1, 1, 1, 1 };
-            for (int i = 0; i < n_dims; ++i) {
+            for (int i = 0; i < 4; ++i) {
+                ne[i] = 1;
+            }
+            for (int i = 0; i < std::min(n_dims, 4); ++i) {
                 read_safe(loader, ne[i]);
-                nelements *= ne[i];
             }
 
-            std::string name;
             std::vector<char> tmp(length); // create a buffer
-            loader->read(loader->context, &tmp[0], tmp.size()); // read to buffer
-            name.assign(&tmp[0], tmp.size());
+            loader->read(loader->context, tmp.data(), tmp.size()); // read to buffer
+            name.assign(tmp.data(), tmp.size());
 
-            if (model.tensors.find(name) == model.tensors.end()) {
-                fprintf(stderr, "%s: unknown tensor '%s' in model file\n", __func__, name.data());
-                return false;
-            }
+            return true;
+        };
 
-            auto tensor = model.tensors[name.data()];
-            if (ggml_nelements(tensor) != nelements) {
-                fprintf(stderr, "%s: tensor '%s' has wrong size in model file\n", __func__, name.data());
-                fprintf(stderr, "%s: shape: [%d, %d, %d], expected: [%d, %d, %d]\n",
-                        __func__, ne[0], ne[1], ne[2], (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2]);
+        if (!packed) {
+            while (true) {
+                int32_t ttype;
+                int32_t ne[4];
+
+                std::string name;
+
+                if (!read_tensor_header(ttype, ne, name)) {
+                    break;
+                }
+
+                auto tensor = get_tensor(name, ne, ttype);
+                if (!tensor) {
+                    return false;
+                }
+
+                loader->read(loader->context, tensor->data, ggml_nbytes(tensor));
+                BYTESWAP_TENSOR(tensor);
+
+                //printf("%48s - [%5d, %5d, %5d], type = %6s, %6.2f MB\n", name.data(), ne[0], ne[1], ne[2], ggml_type_name((ggml_type) ttype), ggml_nbytes(tensor)/1024.0/1024.0);
+                total_size += ggml_nbytes(tensor);
+                model.n_loaded++;
+            }
+        } else {
+            uint32_t version;
+            uint32_t alignment;
+            uint32_t layout;
+            uint32_t n_tensors;
+            uint64_t data_offset;
+
+            read_safe(loader, version);
+            read_safe(loader, alignment);
+            read_safe(loader, layout);
+            read_safe(loader, n_tensors);
+            read_safe(loader, data_offset);
+
+            if (version != WHISPER_FILE_VERSION_PACKED || layout != 0) {
+                fprintf(stderr, "%s: unsupported packed model (version %u, layout %u)\n", __func__, version, layout);
                 return false;
             }
 
-            if (tensor->ne[0] != ne[0] || tensor->ne[1] != ne[1] || tensor->ne[2] != ne[2]) {
-                fprintf(stderr, "%s: tensor '%s' has wrong shape in model file: got [%d, %d, %d], expected [%d, %d, %d]\n",
-                        __func__, name.data(), (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2], ne[0], ne[1], ne[2]);
+            if (alignment == 0 || (alignment & (alignment - 1)) != 0 || data_offset % alignment != 0) {
+                fprintf(stderr, "%s: invalid packed model (alignment %u, data offset %zu)\n", __func__, alignment, (size_t) data_offset);
                 return false;
             }
 
-            const size_t bpe = ggml_type_size(ggml_type(ttype));
+            struct packed_tensor {
+                std::string   name;
+                ggml_tensor * tensor;
 
-            if ((nelements*bpe)/ggml_blck_size(tensor->type) != ggml_nbytes(tensor)) {
-                fprintf(stderr, "%s: tensor '%s' has wrong size in model file: got %zu, expected %zu\n",
-                        __func__, name.data(), ggml_nbytes(tensor), nelements*bpe);
-                return false;
+                uint64_t offset;
+                uint64_t size;
+            };
+
+            std::vector<packed_tensor> table(n_tensors);
+
+            for (auto & entry : table) {
+                int32_t ttype;
+                int32_t ne[4];
+
+                if (!read_tensor_header(ttype, ne, entry.name)) {
+                    fprintf(stderr, "%s: unexpected end of the packed model tensor table\n", __func__);
+                    return false;
+                }
+
+                read_safe(loader, entry.offset);
+                read_safe(loader, entry.size);
+
+                entry.tensor = get_tensor(entry.name, ne, ttype);
+                if (!entry.tensor) {
+                    return false;
+                }
+
+                if (entry.size != ggml_nbytes(entry.tensor) || entry.offset % alignment != 0) {
+                    fprintf(stderr, "%s: tensor '%s' has a wrong size or offset in the packed model\n", __func__, entry.name.c_str());
+                    return false;
+                }
             }
 
-            loader->read(loader->context, tensor->data, ggml_nbytes(tensor));
-            BYTESWAP_TENSOR(tensor);
+            uint32_t n_pad;
+            read_safe(loader, n_pad);
+
+            if (model.mapping) {
+                for (const auto & entry : table) {
+                    if (data_offset + entry.offset + entry.size > model.mapping_size) {
+                        fprintf(stderr, "%s: tensor '%s' extends past the end of the model file\n", __func__, entry.name.c_str());
+                        return false;
+                    }
+
+                    entry.tensor->data = (uint8_t *) model.mapping + data_offset + entry.offset;
+                }
+            } else {
+                std::vector<uint8_t> pad(n_pad);
+                loader->read(loader->context, pad.data(), pad.size());
+
+                // the tensors are stored in the order of the table, so they are read sequentially
+                uint64_t pos = 0;
+
+                for (const auto & entry : table) {
+                    if (entry.offset < pos) {
+                        fprintf(stderr, "%s: the tensors of the packed model are not in order\n", __func__);
+                        return false;
+                    }
+
+                    pad.resize(entry.offset - pos);
+                    loader->read(loader->context, pad.data(), pad.size());
 
-            //printf("%48s - [%5d, %5d, %5d], type = %6s, %6.2f MB\n", name.data(), ne[0], ne[1], ne[2], ggml_type_name((ggml_type) ttype), ggml_nbytes(tensor)/1024.0/1024.0);
-            total_size += ggml_nbytes(tensor);
-            model.n_loaded++;
+                    loader->read(loader->context, entry.tensor->data, entry.size);
+                    BYTESWAP_TENSOR(entry.tensor);
+
+                    pos = entry.offset + entry.size;
+                }
+            }
+
+            for (const auto & entry : table) {
+                total_size += entry.size;
+                model.n_loaded++;
+            }
         }
 
         if (DEBUG_MODE) {
@@ -1436,63 +1826,41 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
     return true;
 }
 
+// a window to encode: the log mel spectrogram of mel starting at mel_offset, encoded into the kv_cross of state
+struct whisper_encode_input {
+    whisper_state     * state;
+    const whisper_mel * mel;
+    int                 mel_offset;
+};
+
 // evaluate the encoder with the given state
 //
 // given audio recording (more specifically, its log mel spectrogram), runs forward pass of the encoder
 // part of the transformer model and returns the encoded features
 //
 //   - wctx:      the model
-//   - wstate:     the state of the encoder
+//   - wstate:     the state with the compute buffers of the encoder, and the audio context to use
+//   - inputs:     the windows to encode with a single batched graph (usually one window of wstate.mel into wstate)
 //   - n_threads:  number of threads to use
-//   - mel_offset: offset in the mel spectrogram (i.e. audio offset)
 //
 static bool whisper_encode_internal(
-        whisper_context & wctx,
-          whisper_state & wstate,
-              const int   mel_offset,
-              const int   n_threads){
+                        whisper_context & wctx,
+                          whisper_state & wstate,
+    const std::vector<whisper_encode_input> & inputs,
+                              const int   n_threads){
 
     const int64_t t_start_us = ggml_time_us();
 
     const auto & model   = wctx.model;
-    const auto & mel_inp = wstate.mel;
     const auto & hparams = model.hparams;
 
     const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
     const int n_state = hparams.n_audio_state;
     const int n_head  = hparams.n_audio_head;
     const int n_layer = hparams.n_audio_layer;
+    const int n_batch = inputs.size();
 
     const int n_mels = hparams.n_mels;
-    assert(mel_inp.n_mel == n_mels);
-
-    struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.buf_compute.size(),
-        /*.mem_buffer =*/ wstate.buf_compute.data(),
-        /*.no_alloc   =*/ false,
-    };
-
-    struct ggml_context * ctx0 = ggml_init(params);
-
-    wstate.use_buf(ctx0, 0);
-
-    struct ggml_tensor * mel = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 2*n_ctx, n_mels);
-    assert(mel->type == GGML_TYPE_F32);
-    {
-        float * dst = (float *) mel->data;
-        memset(dst, 0, ggml_nbytes(mel));
-
-        const int i0 = std::min(mel_offset, mel_inp.n_len);
-        const int i1 = std::min(mel_offset + 2*n_ctx, mel_inp.n_len);
-
-        for (int j = 0; j < mel_inp.n_mel; ++j) {
-            for (int i = i0; i < i1; ++i) {
-                dst[j*2*n_ctx + (i - i0)] = mel_inp.data[j*mel_inp.n_len + i];
-            }
-        }
-    }
-
-    struct ggml_tensor * cur;
 
 #ifndef WHISPER_USE_COREML
     const bool use_coreml = false;
@@ -1506,33 +1874,62 @@ static bool whisper_encode_internal(
     const bool use_openvino = wstate.ctx_openvino != nullptr;
 #endif
 
-    if (!use_coreml && !use_openvino) {
-        // convolution + gelu
-        {
-            wstate.use_buf(ctx0, 1);
+    // the external encoders process one window at a time
+    if (n_batch > 1 && (use_coreml || use_openvino)) {
+        for (const auto & input : inputs) {
+            if (!whisper_encode_internal(wctx, wstate, { input }, n_threads)) {
+                return false;
+            }
+        }
 
-            cur = ggml_conv_1d_ph(ctx0, model.e_conv_1_w, mel, 1, 1);
-            cur = ggml_add(ctx0,
-                    ggml_repeat(ctx0,
-                        model.e_conv_1_b,
-                        cur),
-                    cur);
+        return true;
+    }
 
-            cur = ggml_gelu(ctx0, cur);
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ wstate.buf_compute.size(),
+        /*.mem_buffer =*/ wstate.buf_compute.data(),
+        /*.no_alloc   =*/ false,
+    };
 
-            wstate.use_buf(ctx0, 0);
+    struct ggml_context * ctx0 = ggml_init(params);
+    if (!ctx0) {
+        fprintf(stderr, "%s: ggml_init() failed\n", __func__);
+        return false;
+    }
 
-            cur = ggml_conv_1d_ph(ctx0, model.e_conv_2_w, cur, 2, 1);
-            cur = ggml_add(ctx0,
-                    ggml_repeat(ctx0,
-                        model.e_conv_2_b,
-                        cur),
-                    cur);
+    // in a batch, all spectrograms are needed at the same time, so they cannot share a scratch buffer
+    wstate.use_buf(ctx0, n_batch == 1 ? 0 : -1);
 
-            cur = ggml_gelu(ctx0, cur);
+    std::vector<struct ggml_tensor *> mels(n_batch);
+
+    for (int ib = 0; ib < n_batch; ++ib) {
+        const auto & mel_inp    = *inputs[ib].mel;
+        const int    mel_offset =  inputs[ib].mel_offset;
+
+        assert(mel_inp.n_mel == n_mels);
+
+        struct ggml_tensor * mel = mels[ib] = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 2*n_ctx, n_mels);
+        assert(mel->type == GGML_TYPE_F32);
+        {
+            float * dst = (float *) mel->data;
+            memset(dst, 0, ggml_nbytes(mel));
+
+            const int i0 = std::min(mel_offset, mel_inp.n_len);
+            const int i1 = std::min(mel_offset + 2*n_ctx, mel_inp.n_len);
+
+            for (int j = 0; j < mel_inp.n_mel; ++j) {
+                for (int i = i0; i < i1; ++i) {
+                    dst[j*2*n_ctx + (i - i0)] = mel_inp.data[j*mel_inp.n_len + i];
+                }
+            }
         }
+    }
+
+    struct ggml_tensor * cur;
 
-        wstate.use_buf(ctx0, 3);
+    if (!use_coreml && !use_openvino) {
+        struct ggml_cgraph gf = {};
+        gf.n_threads = n_threads;
 
         // ===================================================================
         // NOTE: experimenting with partial evaluation of the encoder (ignore)
@@ -1553,17 +1950,60 @@ static bool whisper_encode_internal(
 
         struct ggml_tensor * e_pe = ggml_view_2d(ctx0, model.e_pe, model.e_pe->ne[0], n_ctx, e_pe_stride, e_pe_offset);
 
-        cur = ggml_add(ctx0, e_pe, ggml_transpose(ctx0, cur));
-
         // ===================================================================
 
-        // original:
-        //cur = ggml_add(ctx0, model.e_pe, ggml_transpose(ctx0, cur));
+        // the windows of a batch are placed one after the other: [n_state, n_ctx*n_batch]
+        struct ggml_tensor * inpL = nullptr;
 
-        struct ggml_tensor * inpL = cur;
+        if (n_batch > 1) {
+            wstate.use_buf(ctx0, 3);
 
-        for (int il = 0; il < n_layer; ++il) {
-            const auto & layer = model.layers_encoder[il];
+            inpL = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_ctx*n_batch);
+        }
+
+        for (int ib = 0; ib < n_batch; ++ib) {
+            // convolution + gelu
+            {
+                wstate.use_buf(ctx0, 1);
+
+                cur = ggml_conv_1d_ph(ctx0, model.e_conv_1_w, mels[ib], 1, 1);
+                cur = ggml_add(ctx0,
+                        ggml_repeat(ctx0,
+                            model.e_conv_1_b,
+                            cur),
+                        cur);
+
+                cur = ggml_gelu(ctx0, cur);
+
+                wstate.use_buf(ctx0, 0);
+
+                cur = ggml_conv_1d_ph(ctx0, model.e_conv_2_w, cur, 2, 1);
+                cur = ggml_add(ctx0,
+                        ggml_repeat(ctx0,
+                            model.e_conv_2_b,
+                            cur),
+                        cur);
+
+                cur = ggml_gelu(ctx0, cur);
+            }
+
+            wstate.use_buf(ctx0, n_batch == 1 ? 3 : 2);
+
+            cur = ggml_add(ctx0, e_pe, ggml_transpose(ctx0, cur));
+
+            // original:
+            //cur = ggml_add(ctx0, model.e_pe, ggml_transpose(ctx0, cur));
+
+            if (n_batch == 1) {
+                inpL = cur;
+            } else {
+                // the convolutions of the windows are computed one after the other, reusing the same scratch buffers
+                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, cur, ggml_view_2d(ctx0, inpL, n_state, n_ctx, inpL->nb[1], ib*n_ctx*inpL->nb[1])));
+            }
+        }
+
+        for (int il = 0; il < n_layer; ++il) {
+            const auto & layer = model.layers_encoder[il];
 
             // norm
             {
@@ -1616,29 +2056,30 @@ static bool whisper_encode_internal(
 
                 wstate.use_buf(ctx0, 0);
 
+                // the windows of a batch attend only to themselves: [n_state/n_head, n_ctx, n_head, n_batch]
 #ifdef WHISPER_USE_FLASH_ATTN
                 struct ggml_tensor * Q =
                     ggml_permute(ctx0,
                             ggml_cpy(ctx0,
                                 Qcur,
-                                ggml_new_tensor_3d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx)),
+                                ggml_new_tensor_4d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx, n_batch)),
                             0, 2, 1, 3);
 
                 struct ggml_tensor * K =
                     ggml_permute(ctx0,
                             ggml_cpy(ctx0,
                                 Kcur,
-                                ggml_new_tensor_3d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx)),
+                                ggml_new_tensor_4d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx, n_batch)),
                             0, 2, 1, 3);
 
                 struct ggml_tensor * V =
                     ggml_cpy(ctx0,
                             ggml_permute(ctx0,
-                                ggml_reshape_3d(ctx0,
+                                ggml_reshape_4d(ctx0,
                                     Vcur,
-                                    n_state/n_head, n_head, n_ctx),
+                                    n_state/n_head, n_head, n_ctx, n_batch),
                                 1, 2, 0, 3),
-                            ggml_new_tensor_3d(ctx0, wctx.itype, n_ctx, n_state/n_head, n_head));
+                            ggml_new_tensor_4d(ctx0, wctx.itype, n_ctx, n_state/n_head, n_head, n_batch));
 
                 struct ggml_tensor * KQV = ggml_flash_attn(ctx0, Q, K, V, false);
 #else
@@ -1646,14 +2087,14 @@ static bool whisper_encode_internal(
                     ggml_permute(ctx0,
                             ggml_cpy(ctx0,
                                 Qcur,
-                                ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, n_ctx)),
+                                ggml_new_tensor_4d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, n_ctx, n_batch)),
                             0, 2, 1, 3);
 
                 struct ggml_tensor * K =
                     ggml_permute(ctx0,
                             ggml_cpy(ctx0,
                                 Kcur,
-                                ggml_new_tensor_3d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx)),
+                                ggml_new_tensor_4d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx, n_batch)),
                             0, 2, 1, 3);
 
                 // K * Q
@@ -1670,11 +2111,11 @@ static bool whisper_encode_internal(
                 struct ggml_tensor * V =
                     ggml_cpy(ctx0,
                             ggml_permute(ctx0,
-                                ggml_reshape_3d(ctx0,
+                                ggml_reshape_4d(ctx0,
                                     Vcur,
-                                    n_state/n_head, n_head, n_ctx),
+                                    n_state/n_head, n_head, n_ctx, n_batch),
                                 1, 2, 0, 3),
-                            ggml_new_tensor_3d(ctx0, wctx.itype, n_ctx, n_state/n_head, n_head)
+                            ggml_new_tensor_4d(ctx0, wctx.itype, n_ctx, n_state/n_head, n_head, n_batch)
                             );
 
                 struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
@@ -1685,7 +2126,7 @@ static bool whisper_encode_internal(
 
                 cur = ggml_cpy(ctx0,
                         KQV_merged,
-                        ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_ctx));
+                        ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_ctx*n_batch));
             }
 
             // projection
@@ -1732,7 +2173,7 @@ static bool whisper_encode_internal(
                 wstate.use_buf(ctx0, 0);
 
                 cur = ggml_flash_ff(ctx0,
-                        ggml_cpy(ctx0, cur, ggml_new_tensor_2d(ctx0, wstate.itype, n_state, n_ctx)),
+                        ggml_cpy(ctx0, cur, ggml_new_tensor_2d(ctx0, wstate.itype, n_state, n_ctx*n_batch)),
                         layer.mlp_0_w, layer.mlp_0_b, layer.mlp_1_w, layer.mlp_1_b);
 #else
                 wstate.use_buf(ctx0, 0);
@@ -1795,9 +2236,6 @@ static bool whisper_encode_internal(
 
         // run the computation
         {
-            struct ggml_cgraph gf = {};
-            gf.n_threads = n_threads;
-
             ggml_build_forward_expand(&gf, cur);
             ggml_graph_compute(ctx0, &gf);
 
@@ -1810,7 +2248,7 @@ static bool whisper_encode_internal(
 
         cur = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_ctx);
 
-        whisper_coreml_encode(wstate.ctx_coreml, (float *) mel->data, (float *) cur->data);
+        whisper_coreml_encode(wstate.ctx_coreml, (float *) mels[0]->data, (float *) cur->data);
     }
 #endif
 #ifdef WHISPER_USE_OPENVINO
@@ -1819,7 +2257,7 @@ static bool whisper_encode_internal(
 
         cur = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_ctx);
 
-        if (!whisper_openvino_encode(wstate.ctx_openvino, mel, cur)) {
+        if (!whisper_openvino_encode(wstate.ctx_openvino, mels[0], cur)) {
             return false;
         }
     }
@@ -1849,6 +2287,8 @@ static bool whisper_encode_internal(
         cur->src0 = nullptr;
         cur->src1 = nullptr;
 
+        const int n_text_head = hparams.n_text_head;
+
         for (int il = 0; il < model.hparams.n_text_layer; ++il) {
             auto& layer = model.layers_decoder[il];
 
@@ -1860,6 +2300,11 @@ static bool whisper_encode_internal(
 
             Kcross = ggml_scale_inplace(ctx0, Kcross, ggml_new_f32(ctx0, pow(float(n_state) / n_head, -0.25)));
 
+            // head-major: [n_batch][n_text_head][n_ctx][n_state/n_text_head]
+            Kcross = ggml_permute(ctx0,
+                    ggml_reshape_4d(ctx0, Kcross, n_state/n_text_head, n_text_head, n_ctx, n_batch),
+                    0, 2, 1, 3);
+
             wstate.use_buf(ctx0, 1);
 
             struct ggml_tensor* Vcross = ggml_mul_mat(ctx0,
@@ -1874,15 +2319,21 @@ static bool whisper_encode_internal(
 
             wstate.use_buf(ctx0, -1);
 
-            Vcross = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcross, n_state, n_ctx));
+            // scatter the windows of the batch to their kv_cross
+            for (int ib = 0; ib < n_batch; ++ib) {
+                const auto & kv_cross = inputs[ib].state->kv_cross;
+
+                struct ggml_tensor * Kcross_cur = ggml_view_3d(ctx0, Kcross, Kcross->ne[0], Kcross->ne[1], Kcross->ne[2], Kcross->nb[1], Kcross->nb[2], ib*Kcross->nb[3]);
+                struct ggml_tensor * Vcross_cur = ggml_transpose(ctx0, ggml_view_2d(ctx0, Vcross, n_state, n_ctx, Vcross->nb[1], ib*n_ctx*Vcross->nb[1]));
 
-            struct ggml_tensor * k = ggml_view_1d(ctx0, wstate.kv_cross.k, n_state*n_ctx, (ggml_element_size(wstate.kv_cross.k)*n_state)*(il*n_ctx));
-            struct ggml_tensor * v = ggml_view_2d(ctx0, wstate.kv_cross.v, n_ctx, n_state,
-                    (   n_ctx)*ggml_element_size(wstate.kv_cross.v),
-                    (il*n_ctx)*ggml_element_size(wstate.kv_cross.v)*n_state);
+                struct ggml_tensor * k = ggml_view_1d(ctx0, kv_cross.k, n_state*n_ctx, (ggml_element_size(kv_cross.k)*n_state)*(il*n_ctx));
+                struct ggml_tensor * v = ggml_view_2d(ctx0, kv_cross.v, n_ctx, n_state,
+                        (   n_ctx)*ggml_element_size(kv_cross.v),
+                        (il*n_ctx)*ggml_element_size(kv_cross.v)*n_state);
 
-            ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcross, k));
-            ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcross, v));
+                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcross_cur, k));
+                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcross_cur, v));
+            }
         }
 
         ggml_graph_compute(ctx0, &gf);
@@ -1900,42 +2351,81 @@ static bool whisper_encode_internal(
 
     ggml_free(ctx0);
 
-    wstate.t_encode_us += ggml_time_us() - t_start_us;
-    wstate.n_encode++;
+    const int64_t t_encode_us = ggml_time_us() - t_start_us;
+
+    for (const auto & input : inputs) {
+        input.state->t_encode_us += t_encode_us/n_batch;
+        input.state->n_encode++;
+    }
 
     return true;
 }
 
-// evaluate the decoder
-//
-// given text prompt + audio features -> computes the logits for the next token
-//
-//   - model:      the model
-//   - n_threads:  number of threads to use
-//   - tokens:     text prompt
-//   - n_tokens:   number of tokens in the prompt
-//   - n_past:     number of past tokens to prefix the prompt with
-//
-static bool whisper_decode_internal(
+static bool whisper_encode_internal(
         whisper_context & wctx,
           whisper_state & wstate,
-        whisper_decoder & decoder,
-    const whisper_token * tokens,
-              const int   n_tokens,
-              const int   n_past,
+      const whisper_mel & mel,
+              const int   mel_offset,
               const int   n_threads) {
-    const int64_t t_start_us = ggml_time_us();
+    return whisper_encode_internal(wctx, wstate, { { &wstate, &mel, mel_offset } }, n_threads);
+}
 
-    const auto & model   = wctx.model;
-    const auto & hparams = model.hparams;
+static bool whisper_encode_internal(
+        whisper_context & wctx,
+          whisper_state & wstate,
+              const int   mel_offset,
+              const int   n_threads) {
+    return whisper_encode_internal(wctx, wstate, wstate.mel, mel_offset, n_threads);
+}
 
-    auto & kv_self = decoder.kv_self;
+// memory needed for the context of a cached single-token decoder graph
+// the intermediate results live in the scratch buffers, so this is mostly tensor meta data + the compute work buffer
+static size_t whisper_graph_decoder_mem_size(const whisper_hparams & hparams, int n_threads, int n_logits_ids) {
+    const size_t n_tensors = 16 + 128*hparams.n_text_layer;
+
+    const size_t n_work = std::max({
+        hparams.n_audio_ctx*hparams.n_text_head,
+        hparams.n_text_ctx*hparams.n_text_head,
+        4*hparams.n_text_state,
+    });
 
-    WHISPER_ASSERT(!!kv_self.ctx);
+    return n_tensors*ggml_tensor_overhead() + (n_work + n_logits_ids*hparams.n_text_state)*sizeof(float) + 128*n_threads + 64*1024;
+}
 
-    auto & logits_out = wstate.logits;
+// the size of each scratch buffer of a single-token decoder graph
+// a scratch buffer holds at most a few [n_state] tensors and one of: the logits, the self- or the cross-attention weights
+static size_t whisper_graph_decoder_scratch_size(const whisper_hparams & hparams) {
+    const size_t n_max = std::max({
+        hparams.n_vocab,
+        hparams.n_audio_ctx*hparams.n_text_head,
+        hparams.n_text_ctx*hparams.n_text_head,
+    });
 
-    const int n_vocab = hparams.n_vocab;
+    return (n_max + 16*hparams.n_text_state)*sizeof(float) + 16*1024;
+}
+
+// build the decoder graph for n_tokens new tokens, with n_past tokens already in the KV cache
+// the tensors that depend on n_past are recorded in the graph, so that it can be replayed later for another n_past
+//
+//   - graph:        graph.ctx must be initialized, the rest is populated by this function
+//   - n_tokens:     number of tokens in the prompt
+//   - n_past:       number of past tokens to prefix the prompt with
+//   - n_logits_ids: if > 0, project only onto this many active tokens, provided through graph.logits_ids
+//   - logits_all:   compute the logits for all tokens, instead of only for the last one
+//
+static void whisper_build_graph_decoder(
+          whisper_context & wctx,
+            whisper_state & wstate,
+          whisper_decoder & decoder,
+    whisper_graph_decoder & graph,
+                const int   n_tokens,
+                const int   n_past,
+                const int   n_logits_ids,
+               const bool   logits_all) {
+    const auto & model   = wctx.model;
+    const auto & hparams = model.hparams;
+
+    auto & kv_self = decoder.kv_self;
 
     const int n_ctx   = hparams.n_text_ctx;
     const int n_state = hparams.n_text_state;
@@ -1947,26 +2437,29 @@ static bool whisper_decode_internal(
 
     //WHISPER_PRINT_DEBUG("%s: n_past = %d, N = %d, M = %d, n_ctx = %d\n", __func__, n_past, N, M, n_ctx);
 
-    struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.buf_compute.size(),
-        /*.mem_buffer =*/ wstate.buf_compute.data(),
-        /*.no_alloc   =*/ false,
-    };
+    struct ggml_context * ctx0 = graph.ctx;
+    struct ggml_cgraph  & gf   = graph.gf;
 
-    struct ggml_context * ctx0 = ggml_init(params);
+    graph.n_audio_ctx  = M;
+    graph.n_logits_ids = n_logits_ids;
+    graph.kv_cross_k   = wstate.kv_cross.k;
 
-    struct ggml_cgraph gf = {};
-    gf.n_threads = n_threads;
+    graph.k_cpy      .resize(n_layer);
+    graph.v_cpy      .resize(n_layer);
+    graph.K          .resize(n_layer);
+    graph.V          .resize(n_layer);
+    graph.KQ         .resize(n_layer);
+    graph.KQ_masked  .resize(n_layer);
+    graph.KQ_soft_max.resize(n_layer);
 
-    struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
-    memcpy(embd->data, tokens, N*ggml_element_size(embd));
+    struct ggml_tensor * embd     = graph.embd     = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
+    struct ggml_tensor * position = graph.position = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
 
-    struct ggml_tensor * position = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
-    for (int i = 0; i < N; ++i) {
-        ((int32_t *) position->data)[i] = n_past + i;
+    if (n_logits_ids > 0) {
+        graph.logits_ids = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_logits_ids);
     }
 
-    wstate.use_buf(ctx0, 3);
+    graph.use_buf(ctx0, 3);
 
     // token encoding + position encoding
     struct ggml_tensor * cur =
@@ -1981,7 +2474,7 @@ static bool whisper_decode_internal(
 
         // norm
         {
-            wstate.use_buf(ctx0, 0);
+            graph.use_buf(ctx0, 0);
 
             cur = ggml_norm(ctx0, inpL);
 
@@ -2028,34 +2521,43 @@ static bool whisper_decode_internal(
 
                 Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcur, n_state, N));
 
-                struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, N*n_state, (ggml_element_size(kv_self.k)*n_state)*(il*n_ctx + n_past));
+                Kcur = ggml_permute(ctx0,
+                        ggml_reshape_3d(ctx0, Kcur, n_state/n_head, n_head, N),
+                        0, 2, 1, 3);
+
+                struct ggml_tensor * k = ggml_view_3d(ctx0, kv_self.k,
+                        n_state/n_head, N, n_head,
+                        (n_state/n_head)*ggml_element_size(kv_self.k),
+                        (n_state/n_head)*ggml_element_size(kv_self.k)*n_ctx,
+                        (il*n_ctx)*ggml_element_size(kv_self.k)*n_state + n_past*ggml_element_size(kv_self.k)*n_state/n_head);
                 struct ggml_tensor * v = ggml_view_2d(ctx0, kv_self.v, N, n_state,
                         (   n_ctx)*ggml_element_size(kv_self.v),
                         (il*n_ctx)*ggml_element_size(kv_self.v)*n_state + n_past*ggml_element_size(kv_self.v));
 
-                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcur, k));
-                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcur, v));
+                graph.k_cpy[il] = ggml_cpy(ctx0, Kcur, k);
+                graph.v_cpy[il] = ggml_cpy(ctx0, Vcur, v);
+
+                ggml_build_forward_expand(&gf, graph.k_cpy[il]);
+                ggml_build_forward_expand(&gf, graph.v_cpy[il]);
             }
 
             // ------
 
-            wstate.use_buf(ctx0, 0);
+            graph.use_buf(ctx0, 0);
 
             struct ggml_tensor * Q =
                 ggml_permute(ctx0,
-                        ggml_cpy(ctx0,
-                            Qcur,
-                            ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, N)),
+                        ggml_reshape_3d(ctx0, Qcur, n_state/n_head, n_head, N),
                         0, 2, 1, 3);
 
             struct ggml_tensor * K =
-                ggml_permute(ctx0,
-                        ggml_reshape_3d(ctx0,
-                            ggml_view_1d(ctx0, kv_self.k, (n_past + N)*n_state, il*n_ctx*ggml_element_size(kv_self.k)*n_state),
-                            n_state/n_head, n_head, n_past + N),
-                        0, 2, 1, 3);
+                ggml_view_3d(ctx0, kv_self.k,
+                        n_state/n_head, n_past + N, n_head,
+                        (n_state/n_head)*ggml_element_size(kv_self.k),
+                        (n_state/n_head)*ggml_element_size(kv_self.k)*n_ctx,
+                        (il*n_ctx)*ggml_element_size(kv_self.k)*n_state);
 
-            wstate.use_buf(ctx0, 1);
+            graph.use_buf(ctx0, 1);
 
             // K * Q
             struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
@@ -2077,6 +2579,12 @@ static bool whisper_decode_internal(
                         n_ctx*ggml_element_size(kv_self.v)*n_state/n_head,
                         il*n_ctx*ggml_element_size(kv_self.v)*n_state);
 
+            graph.K[il]           = K;
+            graph.V[il]           = V;
+            graph.KQ[il]          = KQ;
+            graph.KQ_masked[il]   = KQ_masked;
+            graph.KQ_soft_max[il] = KQ_soft_max;
+
             struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
 
             struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
@@ -2088,27 +2596,27 @@ static bool whisper_decode_internal(
 
         // projection
         {
-            wstate.use_buf(ctx0, 0);
+            graph.use_buf(ctx0, 0);
 
             cur = ggml_mul_mat(ctx0,
                     layer.attn_ln_1_w,
                     cur);
 
-            wstate.use_buf(ctx0, 1);
+            graph.use_buf(ctx0, 1);
 
             cur = ggml_add(ctx0,
                     ggml_repeat(ctx0, layer.attn_ln_1_b, cur),
                     cur);
         }
 
-        wstate.use_buf(ctx0, 2);
+        graph.use_buf(ctx0, 2);
 
         // add the input
         struct ggml_tensor * inpCA = ggml_add(ctx0, cur, inpL);
 
         // norm
         {
-            wstate.use_buf(ctx0, 0);
+            graph.use_buf(ctx0, 0);
 
             cur = ggml_norm(ctx0, inpCA); // note: we use inpCA here
 
@@ -2134,21 +2642,13 @@ static bool whisper_decode_internal(
 
             Qcur = ggml_scale_inplace(ctx0, Qcur, ggml_new_f32(ctx0, pow(float(n_state)/n_head, -0.25)));
 
-            // Kcross is already scaled
-            struct ggml_tensor * Kcross =
-                ggml_reshape_3d(ctx0,
-                        ggml_view_1d(ctx0, wstate.kv_cross.k, M*n_state, il*M*ggml_element_size(wstate.kv_cross.k)*n_state),
-                        n_state/n_head, n_head, M);
-
-            //struct ggml_tensor * Vcross =
-            //    ggml_reshape_3d(ctx0,
-            //            ggml_view_1d(ctx0, wstate.kv_cross.v, M*n_state, il*M*ggml_element_size(wstate.kv_cross.v)*n_state),
-            //            n_state/n_head, n_head, M);
-
-            //struct ggml_tensor * V_trans =
-            //    ggml_cpy(ctx0,
-            //            ggml_permute(ctx0, Vcross, 1, 2, 0, 3),
-            //            ggml_new_tensor_3d(ctx0, Vcross->type, M, n_state/n_head, n_head));
+            // Kcross is already scaled and stored head-major by the encoder
+            struct ggml_tensor * K =
+                ggml_view_3d(ctx0, wstate.kv_cross.k,
+                        n_state/n_head, M, n_head,
+                        (n_state/n_head)*ggml_element_size(wstate.kv_cross.k),
+                        (n_state/n_head)*ggml_element_size(wstate.kv_cross.k)*M,
+                        (il*M)*ggml_element_size(wstate.kv_cross.k)*n_state);
 
             struct ggml_tensor * V =
                 ggml_view_3d(ctx0, wstate.kv_cross.v,
@@ -2161,13 +2661,9 @@ static bool whisper_decode_internal(
 
             struct ggml_tensor * Q =
                 ggml_permute(ctx0,
-                        ggml_cpy(ctx0,
-                            Qcur,
-                            ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, N)),
+                        ggml_reshape_3d(ctx0, Qcur, n_state/n_head, n_head, N),
                         0, 2, 1, 3);
 
-            struct ggml_tensor * K = ggml_permute(ctx0, Kcross, 0, 2, 1, 3);
-
             // K * Q
             struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
 
@@ -2194,20 +2690,20 @@ static bool whisper_decode_internal(
 
         // projection
         {
-            wstate.use_buf(ctx0, 0);
+            graph.use_buf(ctx0, 0);
 
             cur = ggml_mul_mat(ctx0,
                     layer.cross_attn_ln_1_w,
                     cur);
 
-            wstate.use_buf(ctx0, 1);
+            graph.use_buf(ctx0, 1);
 
             cur = ggml_add(ctx0,
                     ggml_repeat(ctx0, layer.cross_attn_ln_1_b, cur),
                     cur);
         }
 
-        wstate.use_buf(ctx0, 2);
+        graph.use_buf(ctx0, 2);
 
         // add the input
         cur = ggml_add(ctx0, cur, inpCA);
@@ -2218,11 +2714,11 @@ static bool whisper_decode_internal(
         {
             // norm
             {
-                wstate.use_buf(ctx0, 0);
+                graph.use_buf(ctx0, 0);
 
                 cur = ggml_norm(ctx0, inpFF);
 
-                wstate.use_buf(ctx0, 1);
+                graph.use_buf(ctx0, 1);
 
                 // cur = mlp_ln_w*cur + mlp_ln_b
                 cur = ggml_add(ctx0,
@@ -2232,39 +2728,39 @@ static bool whisper_decode_internal(
                         ggml_repeat(ctx0, layer.mlp_ln_b, cur));
             }
 
-            wstate.use_buf(ctx0, 0);
+            graph.use_buf(ctx0, 0);
 
             // fully connected
             cur = ggml_mul_mat(ctx0,
                     layer.mlp_0_w,
                     cur);
 
-            wstate.use_buf(ctx0, 1);
+            graph.use_buf(ctx0, 1);
 
             cur = ggml_add(ctx0,
                     ggml_repeat(ctx0, layer.mlp_0_b, cur),
                     cur);
 
-            wstate.use_buf(ctx0, 0);
+            graph.use_buf(ctx0, 0);
 
             // GELU activation
             cur = ggml_gelu(ctx0, cur);
 
-            wstate.use_buf(ctx0, 1);
+            graph.use_buf(ctx0, 1);
 
             // projection
             cur = ggml_mul_mat(ctx0,
                     layer.mlp_1_w,
                     cur);
 
-            wstate.use_buf(ctx0, 0);
+            graph.use_buf(ctx0, 0);
 
             cur = ggml_add(ctx0,
                     ggml_repeat(ctx0, layer.mlp_1_b, cur),
                     cur);
         }
 
-        wstate.use_buf(ctx0, 3);
+        graph.use_buf(ctx0, 3);
 
         inpL = ggml_add(ctx0, cur, inpFF);
     }
@@ -2273,11 +2769,11 @@ static bool whisper_decode_internal(
 
     // norm
     {
-        wstate.use_buf(ctx0, 0);
+        graph.use_buf(ctx0, 0);
 
         cur = ggml_norm(ctx0, cur);
 
-        wstate.use_buf(ctx0, 1);
+        graph.use_buf(ctx0, 1);
 
         cur = ggml_add(ctx0,
                 ggml_mul(ctx0,
@@ -2286,44 +2782,309 @@ static bool whisper_decode_internal(
                 ggml_repeat(ctx0, model.d_ln_b, cur));
     }
 
-    wstate.use_buf(ctx0, 0);
+    graph.use_buf(ctx0, 0);
+
+    // compute logits only for the last token, unless all of them are needed (e.g. to verify draft tokens)
+    if (!logits_all) {
+        cur = ggml_view_2d(ctx0, cur, cur->ne[0], 1, cur->nb[1], (cur->ne[1] - 1)*cur->nb[1]);
+    }
+
+    // the output projection is restricted either to the active tokens, or to a prefix of the vocabulary
+    // the prefix is a view, so that its length can be changed when the graph is replayed
+    if (n_logits_ids > 0) {
+        // the gathered rows are computed before the layers, so they cannot live in the scratch buffers
+        graph.use_buf(ctx0, -1);
+
+        graph.d_te = ggml_get_rows(ctx0, model.d_te, graph.logits_ids);
+
+        graph.use_buf(ctx0, 0);
+    } else {
+        graph.d_te = ggml_view_2d(ctx0, model.d_te, model.d_te->ne[0], model.d_te->ne[1], model.d_te->nb[1], 0);
+    }
+
+    struct ggml_tensor * logits = ggml_mul_mat(ctx0, graph.d_te, cur);
+
+    graph.use_buf(ctx0, -1);
+
+    ggml_build_forward_expand(&gf, logits);
+
+    graph.logits = logits;
+}
+
+// set the length of the vocabulary prefix that the output projection of the graph computes
+static void whisper_graph_decoder_set_n_logits(whisper_graph_decoder & graph, const int n_logits) {
+    graph.d_te->ne[1] = n_logits;
+
+    auto * t = graph.logits;
+
+    t->ne[0] = n_logits;
+    t->nb[1] = t->nb[0]*t->ne[0];
+    t->nb[2] = t->nb[1]*t->ne[1];
+    t->nb[3] = t->nb[2]*t->ne[2];
+}
+
+// update the n_past-dependent tensors of a graph built with whisper_build_graph_decoder()
+//
+// the graph must have been built for an n_past at least as large as the new one, so that the
+// buffers of the intermediate tensors are big enough
+//
+static void whisper_graph_decoder_set_n_past(
+          whisper_context & wctx,
+          whisper_decoder & decoder,
+    whisper_graph_decoder & graph,
+                const int   n_past) {
+    const auto & hparams = wctx.model.hparams;
+
+    const auto & kv_self = decoder.kv_self;
+
+    const int n_ctx   = hparams.n_text_ctx;
+    const int n_state = hparams.n_text_state;
+    const int n_head  = hparams.n_text_head;
+    const int n_layer = hparams.n_text_layer;
+
+    const int N    = graph.embd->ne[0];
+    const int n_kv = n_past + N;
+
+    const size_t esk = ggml_element_size(kv_self.k);
+    const size_t esv = ggml_element_size(kv_self.v);
+
+    for (int il = 0; il < n_layer; ++il) {
+        // the results of ggml_cpy() are views of the destination, so both have to be moved
+        {
+            auto * k = graph.k_cpy[il];
+            auto * v = graph.v_cpy[il];
+
+            k->data = k->src1->data = (char *) kv_self.k->data + (il*n_ctx)*esk*n_state + n_past*esk*n_state/n_head;
+            v->data = v->src1->data = (char *) kv_self.v->data + (il*n_ctx)*esv*n_state + n_past*esv;
+        }
+
+        graph.K[il]->ne[1] = n_kv;
+        graph.V[il]->ne[0] = n_kv;
+
+        // KQ is contiguous [n_kv, N, n_head] and the masked / soft-maxed tensors are in-place views of it
+        for (auto * t : { graph.KQ[il], graph.KQ_masked[il], graph.KQ_soft_max[il] }) {
+            t->ne[0] = n_kv;
+            t->nb[1] = t->nb[0]*t->ne[0];
+            t->nb[2] = t->nb[1]*t->ne[1];
+            t->nb[3] = t->nb[2]*t->ne[2];
+        }
+
+        ((int32_t *) graph.KQ_masked[il]->src1->data)[0] = n_past;
+    }
+}
+
+// evaluate the decoder
+//
+// given text prompt + audio features -> computes the logits for the next token
+//
+// single-token steps replay the graph cached in the decoder, which is rebuilt only when the audio
+// context changes or when more threads are requested
+//
+//   - model:      the model
+//   - n_threads:  number of threads to use
+//   - tokens:     text prompt
+//   - n_tokens:   number of tokens in the prompt
+//   - n_past:     number of past tokens to prefix the prompt with
+//   - n_logits:   compute only the logits of the first n_logits tokens of the vocabulary
+//   - logits_ids: if not empty, compute only the logits of these tokens
+//   - logits_all: output the logits of all n_tokens tokens ([n_tokens][n_vocab]), instead of only the last one
+//                 cannot be combined with n_logits and logits_ids
+//   - logits_dst: if not null, the logits are stored here instead of in wstate.logits, and wstate is not modified
+//                 the single-token steps of different decoders of the same state can then run concurrently
+//
+// the logits that are not computed are set to -INFINITY
+//
+static bool whisper_decode_internal(
+                   whisper_context & wctx,
+                     whisper_state & wstate,
+                   whisper_decoder & decoder,
+               const whisper_token * tokens,
+                         const int   n_tokens,
+                         const int   n_past,
+                         const int   n_threads,
+                         const int   n_logits,
+    const std::vector<whisper_token> & logits_ids,
+                        const bool   logits_all = false,
+                std::vector<float> * logits_dst = nullptr) {
+    const int64_t t_start_us = ggml_time_us();
+
+    const auto & hparams = wctx.model.hparams;
+
+    WHISPER_ASSERT(!!decoder.kv_self.ctx);
+
+    auto & logits_out = logits_dst ? *logits_dst : wstate.logits;
+
+    const int n_vocab = hparams.n_vocab;
+    const int n_ctx   = hparams.n_text_ctx;
+
+    const int N = n_tokens;
+    const int M = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+
+    // the rows of the active tokens are gathered in the context memory, so large sets of tokens use the
+    // full projection and are masked afterwards
+    const bool use_ids = !logits_ids.empty() && logits_ids.size()*hparams.n_text_state*sizeof(float) <= 1*MB;
+
+    const int n_logits_ids = use_ids ? logits_ids.size() : 0;
+
+    WHISPER_ASSERT(n_logits > 0 && n_logits <= n_vocab);
+    WHISPER_ASSERT(!logits_all || (n_logits == n_vocab && logits_ids.empty()));
+
+    const bool use_cache = N == 1;
+
+    WHISPER_ASSERT(use_cache || logits_dst == nullptr);
+
+    // the multi-token prompts are evaluated with a one-off graph in the shared compute and scratch buffers
+    std::unique_ptr<whisper_graph_decoder> graph_tmp;
+
+    if (!use_cache) {
+        graph_tmp.reset(new whisper_graph_decoder);
+
+        for (int i = 0; i < WHISPER_MAX_SCRATCH_BUFFERS; ++i) {
+            graph_tmp->buf_scratch[i].swap(wstate.buf_scratch[i]);
+        }
+
+        struct ggml_init_params params = {
+            /*.mem_size   =*/ wstate.buf_compute.size(),
+            /*.mem_buffer =*/ wstate.buf_compute.data(),
+            /*.no_alloc   =*/ false,
+        };
+
+        graph_tmp->ctx = ggml_init(params);
+        if (!graph_tmp->ctx) {
+            fprintf(stderr, "%s: ggml_init() failed\n", __func__);
+
+            for (int i = 0; i < WHISPER_MAX_SCRATCH_BUFFERS; ++i) {
+                graph_tmp->buf_scratch[i].swap(wstate.buf_scratch[i]);
+            }
+
+            return false;
+        }
+
+        whisper_build_graph_decoder(wctx, wstate, decoder, *graph_tmp, N, n_past, n_logits_ids, logits_all);
+    } else if (decoder.graph.gf.n_nodes == 0 || decoder.graph.n_audio_ctx != M || decoder.graph.n_threads < n_threads || decoder.graph.n_logits_ids != n_logits_ids || decoder.graph.kv_cross_k != wstate.kv_cross.k) {
+        auto & graph = decoder.graph;
+
+        graph = {};
+        graph.buf.resize(whisper_graph_decoder_mem_size(hparams, n_threads, n_logits_ids));
+
+        for (auto & buf : graph.buf_scratch) {
+            buf.resize(whisper_graph_decoder_scratch_size(hparams));
+        }
+
+        struct ggml_init_params params = {
+            /*.mem_size   =*/ graph.buf.size(),
+            /*.mem_buffer =*/ graph.buf.data(),
+            /*.no_alloc   =*/ false,
+        };
+
+        graph.ctx = ggml_init(params);
+        if (!graph.ctx) {
+            fprintf(stderr, "%s: ggml_init() failed\n", __func__);
+            graph = {};
+            return false;
+        }
+
+        // build for the largest n_past, so that all intermediate buffers fit any later step
+        whisper_build_graph_decoder(wctx, wstate, decoder, graph, N, n_ctx - N, n_logits_ids, false);
+
+        // ggml_graph_compute() cannot grow the work buffer once it is allocated, so we allocate it
+        // for the largest n_past upfront - no matrix multiplication needs more than 4 bytes per src1 element
+        {
+            size_t work_size = 0;
+
+            for (int i = 0; i < graph.gf.n_nodes; ++i) {
+                const auto * node = graph.gf.nodes[i];
+
+                if (node->op == GGML_OP_MUL_MAT) {
+                    work_size = std::max(work_size, ggml_nelements(node->src1)*sizeof(float));
+                }
+            }
+
+            graph.gf.work_size = work_size + 128*n_threads;
+            graph.gf.work      = ggml_new_tensor_1d(graph.ctx, GGML_TYPE_I8, graph.gf.work_size);
+        }
+
+        // the tensors live in graph.buf, so the context is not needed after the graph is built
+        // this releases its slot - there are only GGML_MAX_CONTEXTS, and each state has a graph per decoder
+        ggml_free(graph.ctx);
+        graph.ctx = nullptr;
+
+        graph.n_threads = n_threads;
+    }
+
+    auto & graph = use_cache ? decoder.graph : *graph_tmp;
+
+    if (use_cache) {
+        whisper_graph_decoder_set_n_past(wctx, decoder, graph, n_past);
+    }
 
-    // compute logits only for the last token
-    // comment this line to compute logits for all N tokens
-    // might be useful in the future
-    cur = ggml_view_2d(ctx0, cur, cur->ne[0], 1, cur->nb[1], (cur->ne[1] - 1)*cur->nb[1]);
+    if (n_logits_ids > 0) {
+        memcpy(graph.logits_ids->data, logits_ids.data(), n_logits_ids*ggml_element_size(graph.logits_ids));
+    } else {
+        whisper_graph_decoder_set_n_logits(graph, n_logits);
+    }
 
-    struct ggml_tensor * logits = ggml_mul_mat(ctx0, model.d_te, cur);
+    memcpy(graph.embd->data, tokens, N*ggml_element_size(graph.embd));
 
-    wstate.use_buf(ctx0, -1);
+    for (int i = 0; i < N; ++i) {
+        ((int32_t *) graph.position->data)[i] = n_past + i;
+    }
 
     // run the computation
     {
-        ggml_build_forward_expand(&gf, logits);
-        ggml_graph_compute       (ctx0, &gf);
+        graph.gf.n_threads = n_threads;
+
+        // the work buffer of a cached graph is allocated, so the compute does not need its context
+        ggml_graph_compute(graph.ctx, &graph.gf);
     }
 
-    // extract logits for all N tokens
-    //logits_out.resize(N*n_vocab);
-    //memcpy(logits_out.data(), ggml_get_data(logits), sizeof(float)*N*n_vocab);
+    if (logits_all) {
+        // extract logits for all N tokens
+        logits_out.resize(N*n_vocab);
+        memcpy(logits_out.data(), ggml_get_data(graph.logits), sizeof(float)*N*n_vocab);
+    } else if (n_logits_ids > 0) {
+        // extract logits only for the last token
+        const float * data = ggml_get_data_f32(graph.logits);
 
-    // extract logits only for the last token
-    logits_out.resize(n_vocab);
-    memcpy(logits_out.data(), ggml_get_data(logits), sizeof(float)*n_vocab);
+        logits_out.assign(n_vocab, -INFINITY);
+        for (int i = 0; i < n_logits_ids; ++i) {
+            logits_out[logits_ids[i]] = data[i];
+        }
+    } else {
+        logits_out.resize(n_vocab);
+        memcpy(logits_out.data(), ggml_get_data(graph.logits), sizeof(float)*n_logits);
+        std::fill(logits_out.begin() + n_logits, logits_out.end(), -INFINITY);
+
+        if (!logits_ids.empty()) {
+            std::vector<float> tmp(n_vocab, -INFINITY);
+            for (const auto id : logits_ids) {
+                tmp[id] = logits_out[id];
+            }
+            logits_out = std::move(tmp);
+        }
+    }
 
     if (N > 1) {
         //printf("%s: used_mem = %f MB, %f MB, %f MB %f MB %f MB\n", __func__,
-        //        ggml_used_mem(ctx0)/1024.0/1024.0,
+        //        ggml_used_mem(graph.ctx)/1024.0/1024.0,
         //        wstate.get_buf_max_mem(0)/1024.0/1024.0,
         //        wstate.get_buf_max_mem(1)/1024.0/1024.0,
         //        wstate.get_buf_max_mem(2)/1024.0/1024.0,
         //        wstate.get_buf_max_mem(3)/1024.0/1024.0);
     }
 
-    ggml_free(ctx0);
+    if (!use_cache) {
+        ggml_free(graph.ctx);
+
+        for (int i = 0; i < WHISPER_MAX_SCRATCH_BUFFERS; ++i) {
+            graph.buf_scratch[i].swap(wstate.buf_scratch[i]);
+        }
+    }
 
-    wstate.t_decode_us += ggml_time_us() - t_start_us;
-    wstate.n_decode++;
+    if (logits_dst == nullptr) {
+        wstate.t_decode_us += ggml_time_us() - t_start_us;
+        wstate.n_decode++;
+    }
 
     return true;
 }
@@ -2753,7 +3514,9 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
     state->buf_scratch[2].resize(MEM_REQ_SCRATCH2.at(ctx->model.type));
     state->buf_scratch[3].resize(MEM_REQ_SCRATCH3.at(ctx->model.type));
 
-    state->rng = std::mt19937(0);
+    for (int j = 0; j < WHISPER_MAX_DECODERS; ++j) {
+        state->decoders[j].rng = std::mt19937(j);
+    }
 
     return state;
 }
@@ -2807,21 +3570,74 @@ int whisper_ctx_init_openvino_encoder(
 #endif
 }
 
+#ifdef WHISPER_USE_MMAP
+// map a packed model file (WHISPER_FILE_MAGIC_PACKED) into memory
+// returns nullptr if the file is not packed or cannot be mapped, so that it is read instead
+static void * whisper_mmap_packed(const char * path_model, size_t & size) {
+    const int fd = open(path_model, O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    void * addr = nullptr;
+
+    struct stat st;
+    uint32_t magic = 0;
+
+    if (fstat(fd, &st) == 0 && pread(fd, &magic, sizeof(magic), 0) == (ssize_t) sizeof(magic) && magic == WHISPER_FILE_MAGIC_PACKED) {
+        addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED) {
+            fprintf(stderr, "%s: failed to mmap '%s' - reading it instead\n", __func__, path_model);
+            addr = nullptr;
+        } else {
+            size = st.st_size;
+        }
+    }
+
+    close(fd);
+
+    return addr;
+}
+#endif
+
+static struct whisper_context * whisper_init_no_state_impl(struct whisper_model_loader * loader, void * mapping, size_t mapping_size);
+
+static struct whisper_context * whisper_init_from_buffer_impl(void * buffer, size_t buffer_size, bool mapped);
+
 struct whisper_context * whisper_init_from_file_no_state(const char * path_model) {
 
     if (DEBUG_MODE) {
       fprintf(stderr, "%s: loading model from '%s'\n", __func__, path_model);
     }
 
-    auto fin = std::ifstream(path_model, std::ios::binary);
-    if (!fin) {
-        fprintf(stderr, "%s: failed to open '%s'\n", __func__, path_model);
-        return nullptr;
-    }
-
-    whisper_model_loader loader = {};
+#ifdef WHISPER_USE_MMAP
+    {
+        size_t mapping_size = 0;
 
-    loader.context = &fin;
+        void * mapping = whisper_mmap_packed(path_model, mapping_size);
+        if (mapping) {
+            auto ctx = whisper_init_from_buffer_impl(mapping, mapping_size, true);
+
+            if (ctx) {
+                ctx->path_model = path_model;
+            } else {
+                munmap(mapping, mapping_size);
+            }
+
+            return ctx;
+        }
+    }
+#endif
+
+    auto fin = std::ifstream(path_model, std::ios::binary);
+    if (!fin) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, path_model);
+        return nullptr;
+    }
+
+    whisper_model_loader loader = {};
+
+    loader.context = &fin;
 
     loader.read = [](void * ctx, void * output, size_t read_size) {
         std::ifstream * fin = (std::ifstream*)ctx;
@@ -2849,6 +3665,13 @@ struct whisper_context * whisper_init_from_file_no_state(const char * path_model
 }
 
 struct whisper_context * whisper_init_from_buffer_no_state(void * buffer, size_t buffer_size) {
+    fprintf(stderr, "%s: loading model from buffer\n", __func__);
+
+    return whisper_init_from_buffer_impl(buffer, buffer_size, false);
+}
+
+// the tensors of a packed model point into a mapped buffer, instead of being copied
+static struct whisper_context * whisper_init_from_buffer_impl(void * buffer, size_t buffer_size, bool mapped) {
     struct buf_context {
         uint8_t* buffer;
         size_t size;
@@ -2857,8 +3680,6 @@ struct whisper_context * whisper_init_from_buffer_no_state(void * buffer, size_t
 
     buf_context ctx = { reinterpret_cast<uint8_t*>(buffer), buffer_size, 0 };
 
-    fprintf(stderr, "%s: loading model from buffer\n", __func__);
-
     whisper_model_loader loader = {};
 
     loader.context = &ctx;
@@ -2882,14 +3703,21 @@ struct whisper_context * whisper_init_from_buffer_no_state(void * buffer, size_t
 
     loader.close = [](void * /*ctx*/) { };
 
-    return whisper_init_no_state(&loader);
+    return whisper_init_no_state_impl(&loader, mapped ? buffer : nullptr, mapped ? buffer_size : 0);
 }
 
 struct whisper_context * whisper_init_no_state(struct whisper_model_loader * loader) {
+    return whisper_init_no_state_impl(loader, nullptr, 0);
+}
+
+static struct whisper_context * whisper_init_no_state_impl(struct whisper_model_loader * loader, void * mapping, size_t mapping_size) {
     ggml_time_init();
 
     whisper_context * ctx = new whisper_context;
 
+    ctx->model.mapping      = mapping;
+    ctx->model.mapping_size = mapping_size;
+
     if (!whisper_model_load(loader, *ctx)) {
         loader->close(loader->context);
         fprintf(stderr, "%s: failed to load model\n", __func__);
@@ -2947,9 +3775,26 @@ struct whisper_context * whisper_init(struct whisper_model_loader * loader) {
     return ctx;
 }
 
+struct whisper_state * whisper_get_state(struct whisper_context * ctx) {
+    return ctx->state;
+}
+
 void whisper_free_state(struct whisper_state * state)
 {
     if (state) {
+        for (auto * state_fallback : state->states_fallback) {
+            state_fallback->kv_cross.ctx = nullptr; // not owned
+            whisper_free_state(state_fallback);
+        }
+
+        if (state->state_ahead) {
+            whisper_free_state(state->state_ahead);
+        }
+
+        if (state->state_draft) {
+            whisper_free_state(state->state_draft);
+        }
+
         kv_cache_free(state->kv_cross);
 
         for (int i = 0; i < WHISPER_MAX_DECODERS; ++i) {
@@ -2982,6 +3827,11 @@ void whisper_free(struct whisper_context * ctx) {
         if (ctx->model.buf) {
             delete ctx->model.buf;
         }
+#ifdef WHISPER_USE_MMAP
+        if (ctx->model.mapping) {
+            munmap(ctx->model.mapping, ctx->model.mapping_size);
+        }
+#endif
 
         whisper_free_state(ctx->state);
 
@@ -3073,7 +3923,7 @@ int whisper_encode(struct whisper_context * ctx, int offset, int n_threads) {
 int whisper_decode_with_state(struct whisper_context * ctx, struct whisper_state * state, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
     const int selected_decoder_id = 0;
 
-    if (!whisper_decode_internal(*ctx, *state, state->decoders[selected_decoder_id], tokens, n_tokens, n_past, n_threads)) {
+    if (!whisper_decode_internal(*ctx, *state, state->decoders[selected_decoder_id], tokens, n_tokens, n_past, n_threads, ctx->vocab.n_vocab, {})) {
         fprintf(stderr, "%s: failed to eval\n", __func__);
         return 1;
     }
@@ -3091,7 +3941,7 @@ int whisper_decode(struct whisper_context * ctx, const whisper_token * tokens, i
     }
 
 
-    if (!whisper_decode_internal(*ctx, *ctx->state, ctx->state->decoders[selected_decoder_id], tokens, n_tokens, n_past, n_threads)) {
+    if (!whisper_decode_internal(*ctx, *ctx->state, ctx->state->decoders[selected_decoder_id], tokens, n_tokens, n_past, n_threads, ctx->vocab.n_vocab, {})) {
         fprintf(stderr, "%s: failed to eval\n", __func__);
         return 1;
     }
@@ -3518,6 +4368,26 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
 
         /*.logits_filter_callback           =*/ nullptr,
         /*.logits_filter_callback_user_data =*/ nullptr,
+
+        /*.allowed_tokens    =*/ nullptr,
+        /*.allowed_n_tokens  =*/ 0,
+
+        /*.temperature_n_parallel =*/ 0,
+
+        /*.draft_ctx         =*/ nullptr,
+        /*.draft_n_tokens    =*/ 4,
+
+        /*.encode_ahead           =*/ false,
+
+        /*.audio_ctx_auto    =*/ false,
+
+        /*.encoder_batch     =*/ nullptr,
+
+        /*.n_threads_encoder =*/ 0,
+        /*.n_threads_decoder =*/ 0,
+        /*.n_threads_mel     =*/ 0,
+
+        /*.cpu_offset        =*/ -1,
     };
 
     switch (strategy) {
@@ -3610,20 +4480,13 @@ static int whisper_wrap_segment(struct whisper_context & ctx, struct whisper_sta
     return res;
 }
 
-static const std::vector<std::string> non_speech_tokens = {
-    "\"", "#", "(", ")", "*", "+", "/", ":", ";", "<", "=", ">", "@", "[", "\\", "]", "^",
-    "_", "`", "{", "|", "}", "~", "「", "」", "『", "』", "<<", ">>", "<<<", ">>>", "--",
-    "---", "-(", "-[", "('", "(\"", "((", "))", "(((", ")))", "[[", "]]", "{{", "}}", "♪♪",
-    "♪♪♪","♩", "♪", "♫", "♬", "♭", "♮", "♯"
-};
-
 // process the logits for the selected decoder
 // - applies logit filters
 // - computes logprobs and probs
 static void whisper_process_logits(
               struct whisper_context & ctx,
                struct whisper_state  & state,
-    const struct whisper_full_params   params,
+    const struct whisper_full_params & params,
               struct whisper_decoder & decoder,
                                float   temperature) {
     const auto & vocab      = ctx.vocab;
@@ -3640,13 +4503,16 @@ static void whisper_process_logits(
     auto & logits   = decoder.logits;
     auto & logprobs = decoder.logprobs;
     {
+        const float * logits_src = state.logits.data() + (state.logits.size() - n_logits);
+
         logits.resize(n_logits);
-        memcpy(logits.data(), state.logits.data() + (state.logits.size() - n_logits), n_logits*sizeof(float));
 
         if (temperature > 0.0f) {
             for (int i = 0; i < n_logits; i++) {
-                logits[i] /= temperature;
+                logits[i] = logits_src[i]/temperature;
             }
+        } else {
+            memcpy(logits.data(), logits_src, n_logits*sizeof(float));
         }
 
         // will be populated a bit later
@@ -3661,8 +4527,10 @@ static void whisper_process_logits(
         // https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L388-L390
         if (params.suppress_blank) {
             if (is_initial) {
-                logits[vocab.token_eot]           = -INFINITY;
-                logits[vocab.token_to_id.at(" ")] = -INFINITY;
+                logits[vocab.token_eot] = -INFINITY;
+                if (vocab.token_blank >= 0) {
+                    logits[vocab.token_blank] = -INFINITY;
+                }
             }
         }
 
@@ -3690,21 +4558,8 @@ static void whisper_process_logits(
         // suppress non-speech tokens
         // ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
         if (params.suppress_non_speech_tokens) {
-            for (const std::string & token : non_speech_tokens) {
-                const std::string suppress_tokens[] = {token, " " + token};
-                for (const std::string & suppress_token : suppress_tokens) {
-                    if (vocab.token_to_id.find(suppress_token) != vocab.token_to_id.end()) {
-                        logits[vocab.token_to_id.at(suppress_token)] = -INFINITY;
-                    }
-                }
-            }
-
-            // allow hyphens "-" and single quotes "'" between words, but not at the beginning of a word
-            if (vocab.token_to_id.find(" -") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" -")] = -INFINITY;
-            }
-            if (vocab.token_to_id.find(" '") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" '")] = -INFINITY;
+            for (const auto id : vocab.token_non_speech) {
+                logits[id] = -INFINITY;
             }
         }
 
@@ -3751,8 +4606,15 @@ static void whisper_process_logits(
         }
 
         // populate the logprobs array (log_softmax)
+        // the maxima of the text and timestamp logprobs that are needed below are found in the same pass
+        float max_text_token_logprob = -INFINITY;
+        float max_timestamp_logprob  = -INFINITY;
         {
-            const float logit_max = *std::max_element(logits.begin(), logits.end());
+            float logit_max = -INFINITY;
+            for (int i = 0; i < n_logits; ++i) {
+                logit_max = std::max(logit_max, logits[i]);
+            }
+
             float logsumexp = 0.0f;
             for (int i = 0; i < n_logits; ++i) {
                 if (logits[i] > -INFINITY) {
@@ -3761,12 +4623,14 @@ static void whisper_process_logits(
             }
             logsumexp = logf(logsumexp) + logit_max;
 
-            for (int i = 0; i < n_logits; ++i) {
-                if (logits[i] > -INFINITY) {
-                    logprobs[i] = logits[i] - logsumexp;
-                } else {
-                    logprobs[i] = -INFINITY;
-                }
+            for (int i = 0; i < vocab.token_beg; ++i) {
+                logprobs[i] = logits[i] > -INFINITY ? logits[i] - logsumexp : -INFINITY;
+                max_text_token_logprob = std::max(max_text_token_logprob, logprobs[i]);
+            }
+
+            for (int i = vocab.token_beg; i < n_logits; ++i) {
+                logprobs[i] = logits[i] > -INFINITY ? logits[i] - logsumexp : -INFINITY;
+                max_timestamp_logprob = std::max(max_timestamp_logprob, logprobs[i]);
             }
         }
 
@@ -3775,21 +4639,16 @@ static void whisper_process_logits(
         {
             // logsumexp over timestamps
             float timestamp_logprob = -INFINITY;
-            {
+            if (max_timestamp_logprob > -INFINITY) {
                 float logsumexp = 0.0f;
-                const float logprob_max = *std::max_element(logprobs.begin() + vocab.token_beg, logprobs.end());
                 for (int i = vocab.token_beg; i < n_logits; ++i) {
                     if (logprobs[i] > -INFINITY) {
-                        logsumexp += expf(logprobs[i] - logprob_max);
+                        logsumexp += expf(logprobs[i] - max_timestamp_logprob);
                     }
                 }
-                if (logsumexp > 0.0f) {
-                    timestamp_logprob = logf(logsumexp) + logprob_max;
-                }
+                timestamp_logprob = logf(logsumexp) + max_timestamp_logprob;
             }
 
-            const float max_text_token_logprob = *std::max_element(logprobs.begin(), logprobs.begin() + vocab.token_beg);
-
             //fprintf(stderr, "timestamp_logprob=%f max_text_token_logprob=%f\n", timestamp_logprob, max_text_token_logprob);
 
             if (timestamp_logprob > max_text_token_logprob) {
@@ -3888,9 +4747,26 @@ static whisper_token_data whisper_sample_token(
             }
         }
     } else {
-        std::discrete_distribution<> dist(probs.begin(), probs.end());
+        // inverse transform sampling over the cumulative distribution, computed on the fly
+        // draws the same tokens as std::discrete_distribution, without allocating its tables on every call
+        double sum = 0.0;
+        for (int i = 0; i < n_logits; ++i) {
+            sum += probs[i];
+        }
+
+        const double u = std::uniform_real_distribution<double>(0.0, 1.0)(decoder.rng);
+
+        result.id = n_logits - 1;
+
+        double cumsum = 0.0;
+        for (int i = 0; i < n_logits - 1; ++i) {
+            cumsum += probs[i]/sum;
+            if (cumsum >= u) {
+                result.id = i;
+                break;
+            }
+        }
 
-        result.id   = dist(state.rng);
         result.p    = probs[result.id];
         result.plog = logprobs[result.id];
     }
@@ -3918,19 +4794,28 @@ static std::vector<whisper_token_data> whisper_sample_token_topk(
 
     const int n_logits = vocab.n_vocab;
 
+    // select the top k logits in a single pass, keeping them in a min-heap of size k
+    // ties are broken by the lower token id, so that the selection is deterministic
     auto & logits_id = state.logits_id;
 
+    const auto better = [](const std::pair<double, whisper_token> & a, const std::pair<double, whisper_token> & b) {
+        return a.first > b.first || (a.first == b.first && a.second < b.second);
+    };
+
     logits_id.clear();
     for (int i = 0; i < n_logits; ++i) {
-        logits_id.push_back({ logits[i], i });
+        if ((int) logits_id.size() < k) {
+            logits_id.push_back({ logits[i], i });
+            std::push_heap(logits_id.begin(), logits_id.end(), better);
+        } else if (logits[i] > logits_id.front().first) {
+            std::pop_heap(logits_id.begin(), logits_id.end(), better);
+            logits_id.back() = { logits[i], i };
+            std::push_heap(logits_id.begin(), logits_id.end(), better);
+        }
     }
 
-    std::partial_sort(
-            logits_id.begin(),
-            logits_id.begin() + k, logits_id.end(),
-            [](const std::pair<double, whisper_token> & a, const std::pair<double, whisper_token> & b) {
-                return a.first > b.first;
-            });
+    // best first
+    std::sort_heap(logits_id.begin(), logits_id.end(), better);
 
     std::vector<whisper_token_data> result;
     result.reserve(k);
@@ -3976,6 +4861,37 @@ static std::vector<whisper_token_data> whisper_sample_token_topk(
     return result;
 }
 
+// the entropy of the last 32 tokens of the sequence before n_end
+// low values indicate that the decoder is stuck in a repetition loop
+static double whisper_sequence_entropy(const whisper_sequence & sequence, int n_end) {
+    whisper_token ids[32];
+
+    const int n = std::min(n_end, (int) (sizeof(ids)/sizeof(ids[0])));
+
+    for (int i = 0; i < n; ++i) {
+        ids[i] = sequence.tokens[n_end - n + i].id;
+    }
+
+    // count the occurrences of each token by sorting the window
+    std::sort(ids, ids + n);
+
+    double entropy = 0.0f;
+
+    for (int i = 0; i < n; ) {
+        int j = i + 1;
+        while (j < n && ids[j] == ids[i]) {
+            ++j;
+        }
+
+        const auto p = (j - i)/(double)n;
+        entropy -= p*log(p);
+
+        i = j;
+    }
+
+    return entropy;
+}
+
 // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L178-L192
 static void whisper_sequence_score(
         const struct whisper_full_params & params,
@@ -4002,191 +4918,480 @@ static void whisper_sequence_score(
     sequence.score = result/penalty;
 
     // compute the entropy of the sequence of the last 32 tokens
-    {
-        const int n = 32;
+    sequence.entropy = whisper_sequence_entropy(sequence, sequence.result_len);
+}
 
-        int cnt = 0;
-        double entropy = 0.0f;
+// allocate the self-attention KV caches and the work buffers of the first n_decoders decoders
+// TAGS: WHISPER_DECODER_INIT
+static bool whisper_full_init_decoders(whisper_context & ctx, whisper_state & state, int n_decoders) {
+    for (int j = 1; j < n_decoders; j++) {
+        auto & decoder = state.decoders[j];
 
-        std::map<whisper_token, int> token_counts;
-        for (int i = std::max(0, sequence.result_len - n); i < sequence.result_len; ++i) {
-            token_counts[sequence.tokens[i].id]++;
-            cnt++;
-        }
+        if (decoder.kv_self.ctx == nullptr) {
+            decoder.kv_self = state.decoders[0].kv_self;
+            if (!kv_cache_reinit(decoder.kv_self)) {
+                fprintf(stderr, "%s: kv_cache_reinit() failed for self-attention, decoder %d\n", __func__, j);
+                return false;
+            }
+
+            WHISPER_PRINT_DEBUG("%s: initialized self-attention kv cache, decoder %d\n", __func__, j);
 
-        for (const auto & kv : token_counts) {
-            const auto p = kv.second/(double)cnt;
-            entropy -= p*log(p);
+            decoder.sequence.tokens.reserve(state.decoders[0].sequence.tokens.capacity());
 
-            //WHISPER_PRINT_DEBUG("entropy: %d %f %f, count %d\n", kv.first, p, log(p), kv.second);
+            decoder.probs.resize   (ctx.vocab.n_vocab);
+            decoder.logits.resize  (ctx.vocab.n_vocab);
+            decoder.logprobs.resize(ctx.vocab.n_vocab);
         }
-
-        sequence.entropy = entropy;
     }
+
+    return true;
 }
 
-int whisper_full_with_state(
-        struct whisper_context * ctx,
-          struct whisper_state * state,
-    struct whisper_full_params   params,
-                   const float * samples,
-                           int   n_samples) {
-    // clear old results
-    auto & result_all = state->result_all;
+// [EXPERIMENTAL] the number of threads of each computation stage (see whisper_full_params.n_threads_encoder)
+static int whisper_full_n_threads_encoder(const whisper_full_params & params) {
+    return params.n_threads_encoder > 0 ? params.n_threads_encoder : params.n_threads;
+}
 
-    result_all.clear();
+static int whisper_full_n_threads_decoder(const whisper_full_params & params) {
+    return params.n_threads_decoder > 0 ? params.n_threads_decoder : params.n_threads;
+}
 
-    // compute log mel spectrogram
-    if (params.speed_up) {
-        if (whisper_pcm_to_mel_phase_vocoder_with_state(ctx, state, samples, n_samples, params.n_threads) != 0) {
-            fprintf(stderr, "%s: failed to compute log mel spectrogram\n", __func__);
-            return -1;
+static int whisper_full_n_threads_mel(const whisper_full_params & params) {
+    return params.n_threads_mel > 0 ? params.n_threads_mel : params.n_threads;
+}
+
+// [EXPERIMENTAL] pick the number of threads for the single-token decoder steps
+// the steps are timed with n_threads_max, n_threads_max/2, ..., 1 threads and the fastest count is returned
+// uses decoder 0 and the window that is currently encoded in kv_cross - the KV cache of the decoder is overwritten
+static int whisper_tune_n_threads_decoder(whisper_context & ctx, whisper_state & state, int n_threads_max) {
+    auto & decoder = state.decoders[0];
+
+    const whisper_token token = whisper_token_sot(&ctx);
+
+    const int n_steps = 4;
+
+    std::vector<float> logits;
+
+    int     n_threads_best = n_threads_max;
+    int64_t t_best_us      = 0;
+
+    // the graph of the decoder is built for the largest count first, and can then be reused with less threads
+    for (int n_threads = n_threads_max; n_threads >= 1; n_threads /= 2) {
+        int64_t t_us = 0;
+
+        // the first step is a warm-up
+        for (int i = 0; i <= n_steps; ++i) {
+            const int64_t t_start_us = ggml_time_us();
+
+            if (!whisper_decode_internal(ctx, state, decoder, &token, 1, i, n_threads, ctx.vocab.n_vocab, {}, false, &logits)) {
+                return n_threads_max;
+            }
+
+            if (i > 0) {
+                t_us += ggml_time_us() - t_start_us;
+            }
         }
-    } else {
-        if (whisper_pcm_to_mel_with_state(ctx, state, samples, n_samples, params.n_threads) != 0) {
-            fprintf(stderr, "%s: failed to compute log mel spectrogram\n", __func__);
-            return -2;
+
+        WHISPER_PRINT_DEBUG("%s: n_threads = %2d, %8.3f ms per step\n", __func__, n_threads, 1e-3*t_us/n_steps);
+
+        if (n_threads == n_threads_max || t_us < t_best_us) {
+            n_threads_best = n_threads;
+            t_best_us      = t_us;
         }
     }
 
-    // auto-detect language if not specified
-    if (params.language == nullptr || strlen(params.language) == 0 || strcmp(params.language, "auto") == 0 || params.detect_language) {
-        std::vector<float> probs(whisper_lang_max_id() + 1, 0.0f);
+    return n_threads_best;
+}
 
-        const auto lang_id = whisper_lang_auto_detect_with_state(ctx, state, 0, params.n_threads, probs.data());
-        if (lang_id < 0) {
-            fprintf(stderr, "%s: failed to auto-detect language\n", __func__);
-            return -3;
+// [EXPERIMENTAL] restricts the calling thread to the CPUs [cpu_first, cpu_first + n_cpus) while in scope
+// the threads that it creates (e.g. the ggml workers) inherit the restriction
+struct whisper_cpu_affinity {
+#if defined(__linux__) && !defined(__BIONIC__)
+    bool      set = false;
+    cpu_set_t mask_org;
+
+    whisper_cpu_affinity(int cpu_first, int n_cpus) {
+        if (cpu_first < 0 || n_cpus <= 0) {
+            return;
         }
-        state->lang_id = lang_id;
-        params.language = whisper_lang_str(lang_id);
 
-        fprintf(stderr, "%s: auto-detected language: %s (p = %f)\n", __func__, params.language, probs[whisper_lang_id(params.language)]);
-        if (params.detect_language) {
-            return 0;
+        if (pthread_getaffinity_np(pthread_self(), sizeof(mask_org), &mask_org) != 0) {
+            return;
         }
-    }
 
-    if (params.token_timestamps) {
-        state->t_beg    = 0;
-        state->t_last   = 0;
-        state->tid_last = 0;
-        state->energy = get_signal_energy(samples, n_samples, 32);
-    }
+        cpu_set_t mask;
+        CPU_ZERO(&mask);
+        for (int i = cpu_first; i < cpu_first + n_cpus && i < CPU_SETSIZE; ++i) {
+            CPU_SET(i, &mask);
+        }
 
-    const int seek_start = params.offset_ms/10;
-    const int seek_end = params.duration_ms == 0 ? whisper_n_len_from_state(state) : seek_start + params.duration_ms/10;
+        const int rv = pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+        if (rv != 0) {
+            fprintf(stderr, "%s: warning: pthread_setaffinity_np() failed: %s\n", __func__, strerror(rv));
+            return;
+        }
 
-    // if length of spectrogram is less than 1s (100 samples), then return
-    // basically don't process anything that is less than 1s
-    // see issue #39: https://github.com/ggerganov/whisper.cpp/issues/39
-    if (seek_end < seek_start + (params.speed_up ? 50 : 100)) {
-        return 0;
+        set = true;
     }
 
-    // a set of temperatures to use
-    // [ t0, t0 + delta, t0 + 2*delta, ..., < 1.0f + 1e-6f ]
-    std::vector<float> temperatures;
-    if (params.temperature_inc > 0.0f) {
-        for (float t = params.temperature; t < 1.0f + 1e-6f; t += params.temperature_inc) {
-            temperatures.push_back(t);
+    ~whisper_cpu_affinity() {
+        if (set) {
+            pthread_setaffinity_np(pthread_self(), sizeof(mask_org), &mask_org);
         }
-    } else {
-        temperatures.push_back(params.temperature);
     }
+#else
+    whisper_cpu_affinity(int cpu_first, int n_cpus) {
+        if (cpu_first >= 0) {
+            fprintf(stderr, "%s: warning: CPU affinity is not supported on this platform\n", __func__);
+        }
+        (void) n_cpus;
+    }
+#endif
 
-    // initialize the decoders
-    int n_decoders = 1;
+    whisper_cpu_affinity(const whisper_cpu_affinity &) = delete;
+    whisper_cpu_affinity & operator=(const whisper_cpu_affinity &) = delete;
+};
 
-    switch (params.strategy) {
-        case WHISPER_SAMPLING_GREEDY:
-            {
-                n_decoders = params.greedy.best_of;
-            } break;
-        case WHISPER_SAMPLING_BEAM_SEARCH:
-            {
-                n_decoders = std::max(params.greedy.best_of, params.beam_search.beam_size);
-            } break;
-    };
+// [EXPERIMENTAL] speculative decoding
+// the draft model proposes tokens that are verified with a single multi-token pass of the decoder of the main model
+struct whisper_speculative {
+    whisper_context * ctx   = nullptr; // the draft model
+    whisper_state   * state = nullptr;
 
-    n_decoders = std::max(1, n_decoders);
+    // the tokens in the KV cache of the draft decoder, by position
+    std::vector<whisper_token> past;
 
-    // TAGS: WHISPER_DECODER_INIT
-    for (int j = 1; j < n_decoders; j++) {
-        auto & decoder = state->decoders[j];
+    // the proposed tokens and the logits of the main model after the last sampled token and after each of them
+    std::vector<whisper_token> tokens; // [n]
+    std::vector<float>         logits; // [n + 1][n_vocab]
 
-        if (decoder.kv_self.ctx == nullptr) {
-            decoder.kv_self = state->decoders[0].kv_self;
-            if (!kv_cache_reinit(decoder.kv_self)) {
-                fprintf(stderr, "%s: kv_cache_reinit() failed for self-attention, decoder %d\n", __func__, j);
-                return -4;
-            }
+    int n_used = 0; // number of proposed tokens that were accepted so far
+};
 
-            WHISPER_PRINT_DEBUG("%s: initialized self-attention kv cache, decoder %d\n", __func__, j);
+// propose up to n_draft tokens following the tokens in past (the prompt + the sequence of the main decoder)
+// the draft decoder mirrors the sequence of the main decoder, so that the same logit filters apply
+static bool whisper_speculative_draft(
+                 whisper_speculative & spec,
+    const struct whisper_full_params & params,
+               const whisper_decoder & decoder,
+    const std::vector<whisper_token> & past,
+                                 int   n_draft) {
+    auto & ctx_draft   = *spec.ctx;
+    auto & state_draft = *spec.state;
 
-            decoder.sequence.tokens.reserve(state->decoders[0].sequence.tokens.capacity());
+    auto & decoder_draft = state_draft.decoders[0];
 
-            decoder.probs.resize   (ctx->vocab.n_vocab);
-            decoder.logits.resize  (ctx->vocab.n_vocab);
-            decoder.logprobs.resize(ctx->vocab.n_vocab);
-        }
+    spec.tokens.clear();
+
+    n_draft = std::min(n_draft, ctx_draft.model.hparams.n_text_ctx - (int) past.size());
+    if (n_draft <= 0) {
+        return true;
     }
 
-    // the accumulated text context so far
-    auto & prompt_past = state->prompt_past;
-    if (params.no_context) {
-        prompt_past.clear();
+    // keep the part of the draft KV cache that is still valid
+    int n_keep = 0;
+    while (n_keep < (int) spec.past.size() && n_keep < (int) past.size() - 1 && spec.past[n_keep] == past[n_keep]) {
+        ++n_keep;
     }
 
-    // prepare prompt
-    {
-        std::vector<whisper_token> prompt_tokens;
+    spec.past.assign(past.begin(), past.end());
 
-        // initial prompt
-        if (!params.prompt_tokens && params.initial_prompt) {
-            prompt_tokens.resize(1024);
-            prompt_tokens.resize(whisper_tokenize(ctx, params.initial_prompt, prompt_tokens.data(), prompt_tokens.size()));
-            params.prompt_tokens   = prompt_tokens.data();
-            params.prompt_n_tokens = prompt_tokens.size();
+    if (!whisper_decode_internal(ctx_draft, state_draft, decoder_draft, past.data() + n_keep, past.size() - n_keep, n_keep, whisper_full_n_threads_decoder(params), ctx_draft.vocab.n_vocab, {})) {
+        return false;
+    }
+
+    // the user callback is meant for the main model
+    whisper_full_params params_draft = params;
+    params_draft.logits_filter_callback = nullptr;
+
+    decoder_draft.sequence   = decoder.sequence;
+    decoder_draft.seek_delta = decoder.seek_delta;
+    decoder_draft.has_ts     = decoder.has_ts;
+
+    for (int i = 0; i < n_draft; ++i) {
+        whisper_process_logits(ctx_draft, state_draft, params_draft, decoder_draft, 0.0f);
+
+        const auto token = whisper_sample_token(ctx_draft, state_draft, decoder_draft, true);
+
+        spec.tokens.push_back(token.id);
+
+        if (token.id == ctx_draft.vocab.token_eot || i == n_draft - 1) {
+            break;
         }
 
-        // prepend the prompt tokens to the prompt_past
-        if (params.prompt_tokens && params.prompt_n_tokens > 0) {
-            // parse tokens from the pointer
-            for (int i = 0; i < params.prompt_n_tokens; i++) {
-                prompt_past.push_back(params.prompt_tokens[i]);
-            }
-            std::rotate(prompt_past.begin(), prompt_past.end() - params.prompt_n_tokens, prompt_past.end());
+        decoder_draft.sequence.tokens.push_back(token);
+        if (token.id > ctx_draft.vocab.token_beg) {
+            decoder_draft.seek_delta = 2*(token.id - ctx_draft.vocab.token_beg);
+            decoder_draft.has_ts     = true;
+        }
+
+        if (!whisper_decode_internal(ctx_draft, state_draft, decoder_draft, &token.id, 1, spec.past.size(), whisper_full_n_threads_decoder(params), ctx_draft.vocab.n_vocab, {})) {
+            return false;
         }
+
+        spec.past.push_back(token.id);
     }
 
-    // overwrite audio_ctx, max allowed is hparams.n_audio_ctx
-    if (params.audio_ctx > whisper_n_audio_ctx(ctx)) {
-        fprintf(stderr, "%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params.audio_ctx, whisper_n_audio_ctx(ctx));
-        return -5;
+    return true;
+}
+
+// [EXPERIMENTAL] the audio context to encode the window at offset seek with (0 = use default)
+// with audio_ctx_auto, a window with less than 30 s of audio left gets just enough context for the remaining audio,
+// plus 1 s of padding, rounded up to a multiple of 64 (2 mel frames per encoder position)
+static int whisper_full_audio_ctx(const whisper_context & ctx, const whisper_full_params & params, int seek, int seek_end) {
+    const int n_audio_ctx = params.audio_ctx > 0 ? params.audio_ctx : ctx.model.hparams.n_audio_ctx;
+
+    if (!params.audio_ctx_auto) {
+        return params.audio_ctx;
     }
-    state->exp_n_audio_ctx = params.audio_ctx;
 
-    // these tokens determine the task that will be performed
-    std::vector<whisper_token> prompt_init = { whisper_token_sot(ctx) };
-    if (whisper_is_multilingual(ctx)) {
-        const int lang_id = whisper_lang_id(params.language);
-        state->lang_id = lang_id;
-        prompt_init.push_back(whisper_token_lang(ctx, lang_id));
-        if (params.translate) {
-            prompt_init.push_back(whisper_token_translate(ctx));
-        } else {
-            prompt_init.push_back(whisper_token_transcribe(ctx));
+    const int n_frames = std::max(0, seek_end - seek);
+    const int n_ctx    = 64*((n_frames/2 + 50 + 63)/64);
+
+    return n_ctx < n_audio_ctx ? n_ctx : params.audio_ctx;
+}
+
+// [EXPERIMENTAL] batching of the encoder passes of concurrent whisper_full_with_state() calls
+// there is no scheduling thread - the first pending call that runs out of time or finds a full batch encodes it
+struct whisper_encoder_batch {
+    whisper_context * ctx = nullptr;
+    whisper_state   * state = nullptr; // the compute buffers for n_batch windows
+
+    int     n_batch   = 1;
+    int64_t t_wait_us = 0;
+    int     n_threads = 1;
+
+    struct request {
+        whisper_encode_input input;
+
+        int n_audio_ctx;
+
+        bool done;
+        bool ok;
+    };
+
+    std::mutex              mutex;
+    std::condition_variable cv;
+
+    std::vector<request *> pending;
+
+    bool busy = false; // a batch is being encoded
+};
+
+struct whisper_encoder_batch * whisper_encoder_batch_init(struct whisper_context * ctx, int n_batch, int t_wait_ms, int n_threads) {
+    whisper_state * state = whisper_init_state(ctx);
+    if (!state) {
+        return nullptr;
+    }
+
+    n_batch = std::max(1, n_batch);
+
+    // only the compute buffers are needed, for n_batch windows
+    kv_cache_free(state->kv_cross);
+    state->kv_cross.buf.clear();
+    state->kv_cross.buf.shrink_to_fit();
+
+    state->buf_compute.resize(n_batch*state->buf_compute.size());
+    for (auto & buf : state->buf_scratch) {
+        buf.resize(n_batch*buf.size());
+    }
+
+    whisper_encoder_batch * batch = new whisper_encoder_batch;
+
+    batch->ctx       = ctx;
+    batch->state     = state;
+    batch->n_batch   = n_batch;
+    batch->t_wait_us = 1000ll*t_wait_ms;
+    batch->n_threads = n_threads;
+
+    return batch;
+}
+
+void whisper_encoder_batch_free(struct whisper_encoder_batch * batch) {
+    if (batch) {
+        whisper_free_state(batch->state);
+        delete batch;
+    }
+}
+
+// encode the window of mel at offset mel_offset into the kv_cross of state, batched with the windows of other calls
+static bool whisper_encoder_batch_encode(whisper_encoder_batch & batch, whisper_state & state, const whisper_mel & mel, int mel_offset) {
+    whisper_encoder_batch::request req = { { &state, &mel, mel_offset }, state.exp_n_audio_ctx, false, false };
+
+    std::unique_lock<std::mutex> lock(batch.mutex);
+
+    batch.pending.push_back(&req);
+    batch.cv.notify_all();
+
+    const auto t_end = std::chrono::steady_clock::now() + std::chrono::microseconds(batch.t_wait_us);
+
+    while (!req.done) {
+        if (batch.busy) {
+            batch.cv.wait(lock);
+            continue;
+        }
+
+        // collect the pending windows with the same audio context
+        std::vector<whisper_encoder_batch::request *> reqs;
+        for (auto * other : batch.pending) {
+            if (other->n_audio_ctx == req.n_audio_ctx && (int) reqs.size() < batch.n_batch) {
+                reqs.push_back(other);
+            }
+        }
+
+        if ((int) reqs.size() < batch.n_batch && std::chrono::steady_clock::now() < t_end) {
+            batch.cv.wait_until(lock, t_end);
+            continue;
+        }
+
+        for (auto * other : reqs) {
+            batch.pending.erase(std::find(batch.pending.begin(), batch.pending.end(), other));
+        }
+
+        batch.busy = true;
+        lock.unlock();
+
+        std::vector<whisper_encode_input> inputs;
+        for (auto * other : reqs) {
+            inputs.push_back(other->input);
+        }
+
+        batch.state->exp_n_audio_ctx = req.n_audio_ctx;
+
+        const bool ok = whisper_encode_internal(*batch.ctx, *batch.state, inputs, batch.n_threads);
+
+        lock.lock();
+        batch.busy = false;
+
+        for (auto * other : reqs) {
+            other->done = true;
+            other->ok   = ok;
         }
+
+        batch.cv.notify_all();
     }
 
-    int progress_prev = 0;
-    int progress_step = 5;
+    return req.ok;
+}
 
-    int seek = seek_start;
+// [EXPERIMENTAL] an encoder shared by several tasks that decode the same audio concurrently (see whisper_full_multi())
+// the tasks that reach the window in the shared kv_cross use it, so it is encoded only once for all of them
+// a task that needs another window while the shared one is in use encodes it in its own kv_cross, without waiting
+struct whisper_encoder_share {
+    const whisper_mel * mel = nullptr;
 
-    std::vector<whisper_token> prompt;
-    prompt.reserve(whisper_n_text_ctx(ctx));
+    whisper_kv_cache kv_cross;
+
+    std::mutex              mutex;
+    std::condition_variable cv;
+
+    int  seek        = -1; // the window currently in kv_cross
+    int  n_audio_ctx = -1;
+    int  n_users     =  0; // number of tasks decoding it
+    bool encoding    = false; // is a task encoding it
+};
+
+// stop using the shared window, if any
+static void whisper_encoder_share_release(whisper_state & state) {
+    auto & share = *state.encoder_share;
+
+    std::unique_lock<std::mutex> lock(share.mutex);
+
+    if (state.encoder_share_used) {
+        state.encoder_share_used = false;
+
+        share.n_users--;
+    }
+}
+
+// make state.kv_cross hold the window at offset seek: the shared kv_cross if it holds that window or is not in use,
+// our own kv_cross otherwise - the window is encoded with our compute buffers if needed
+static bool whisper_encoder_share_acquire(whisper_context & ctx, whisper_state & state, int seek, int n_threads) {
+    whisper_encoder_share_release(state);
+
+    auto & share = *state.encoder_share;
+
+    std::unique_lock<std::mutex> lock(share.mutex);
+
+    const auto is_current = [&]() {
+        return share.seek == seek && share.n_audio_ctx == state.exp_n_audio_ctx;
+    };
+
+    // if another task is encoding our window in the shared kv_cross, wait for it instead of encoding it again
+    share.cv.wait(lock, [&]() { return !share.encoding || !is_current(); });
+
+    if (is_current()) {
+        share.n_users++;
+        state.encoder_share_used = true;
+
+        state.kv_cross.k   = share.kv_cross.k;
+        state.kv_cross.v   = share.kv_cross.v;
+        state.kv_cross.ctx = share.kv_cross.ctx;
+
+        return true;
+    }
+
+    if (share.n_users > 0 || share.encoding) {
+        lock.unlock();
+
+        state.kv_cross.k   = state.kv_cross_own.k;
+        state.kv_cross.v   = state.kv_cross_own.v;
+        state.kv_cross.ctx = state.kv_cross_own.ctx;
+
+        return whisper_encode_internal(ctx, state, *share.mel, seek, n_threads);
+    }
+
+    // the shared kv_cross is free - encode our window there, for the other tasks that reach it
+    share.seek        = seek;
+    share.n_audio_ctx = state.exp_n_audio_ctx;
+    share.n_users++;
+    share.encoding    = true;
+
+    state.encoder_share_used = true;
+
+    state.kv_cross.k   = share.kv_cross.k;
+    state.kv_cross.v   = share.kv_cross.v;
+    state.kv_cross.ctx = share.kv_cross.ctx;
+
+    lock.unlock();
+
+    const bool ok = whisper_encode_internal(ctx, state, *share.mel, seek, n_threads);
+
+    lock.lock();
+
+    if (!ok) {
+        share.seek = -1;
+    }
+
+    share.encoding = false;
+    share.cv.notify_all();
+
+    return ok;
+}
+
+// decode the current audio window at temperature t_cur (temperatures[it]), using the audio features in state.kv_cross
+// returns the id of the best decoder in state.decoders, or a negative error code
+//
+//   - can_fallback: the window will be retried at a higher temperature if this decoding fails
+//   - prompt:       populated with the prompt that was used for the decoding
+//   - it_done:      if not null, the decoding stops as soon as it holds a temperature index lower than it
+//
+static int whisper_full_decode(
+              struct whisper_context & ctx_ref,
+                struct whisper_state & state_ref,
+    const struct whisper_full_params & params,
+                               float   t_cur,
+                                 int   it,
+                                bool   can_fallback,
+                                 int   seek,
+                                 int   seek_end,
+    const std::vector<whisper_token> & prompt_past,
+    const std::vector<whisper_token> & prompt_init,
+    const std::vector<whisper_token> & allowed_tokens,
+          std::vector<whisper_token> & prompt,
+              const std::atomic<int> * it_done) {
+    auto * ctx   = &ctx_ref;
+    auto * state = &state_ref;
 
     // beam-search helpers
     struct kv_buf {
@@ -4207,419 +5412,1002 @@ int whisper_full_with_state(
 
     std::vector<beam_candidate> beam_candidates;
 
-    // main loop
-    while (true) {
-        const int progress_cur = (100*(seek - seek_start))/(seek_end - seek_start);
-        while (progress_cur >= progress_prev + progress_step) {
-            progress_prev += progress_step;
-            if (params.print_progress) {
-                fprintf(stderr, "%s: progress = %3d%%\n", __func__, progress_prev);
-            }
+    int best_decoder_id = 0;
+
+    int n_decoders_cur = 1;
+
+    switch (params.strategy) {
+        case whisper_sampling_strategy::WHISPER_SAMPLING_GREEDY:
+            {
+                if (t_cur > 0.0f) {
+                    n_decoders_cur = params.greedy.best_of;
+                }
+            } break;
+        case whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH:
+            {
+                if (t_cur > 0.0f) {
+                    n_decoders_cur = params.greedy.best_of;
+                } else {
+                    n_decoders_cur = params.beam_search.beam_size;
+                }
+            } break;
+    };
+
+    n_decoders_cur = std::max(1, n_decoders_cur);
+
+    WHISPER_PRINT_DEBUG("\n%s: decoding with %d decoders, temperature = %.2f\n", __func__, n_decoders_cur, t_cur);
+
+    // [EXPERIMENTAL] speculative decoding, for greedy sampling with a single decoder
+    whisper_speculative spec;
+
+    const bool use_spec = params.draft_ctx && params.draft_n_tokens > 0 && n_decoders_cur == 1 && t_cur < 1e-6f && allowed_tokens.empty();
+
+    if (use_spec) {
+        spec.ctx   = params.draft_ctx;
+        spec.state = state->state_draft;
+
+        spec.state->exp_n_audio_ctx = state->exp_n_audio_ctx;
+
+        // the draft model has the same mel bins, so it encodes our spectrogram
+        const auto & mel = state->encoder_share ? *state->encoder_share->mel : state->mel;
+
+        if (!whisper_encode_internal(*spec.ctx, *spec.state, mel, seek, whisper_full_n_threads_encoder(params))) {
+            fprintf(stderr, "%s: failed to encode with the draft model\n", __func__);
+            return -6;
         }
-        if (params.progress_callback) {
-            params.progress_callback(
-                ctx, ctx->state, progress_prev, params.progress_callback_user_data);
+    }
+
+    // TAGS: WHISPER_DECODER_INIT
+    for (int j = 0; j < n_decoders_cur; ++j) {
+        auto & decoder = state->decoders[j];
+
+        decoder.kv_self.n = 0;
+
+        decoder.sequence.tokens.clear();
+        decoder.sequence.result_len       = 0;
+        decoder.sequence.sum_logprobs_all = 0.0;
+        decoder.sequence.sum_logprobs     = -INFINITY;
+        decoder.sequence.avg_logprobs     = -INFINITY;
+        decoder.sequence.entropy          = 0.0;
+        decoder.sequence.score            = -INFINITY;
+
+        decoder.seek_delta = 100*WHISPER_CHUNK_SIZE;
+
+        decoder.failed    = false;
+        decoder.completed = false;
+        decoder.has_ts    = false;
+
+        // the sampling stream depends only on the decoder, the temperature and the window, so that the fallback
+        // temperatures decoded concurrently (see temperature_n_parallel) sample as they would one after the other
+        std::seed_seq seed = { j, it, seek };
+        decoder.rng.seed(seed);
+    }
+
+    // init prompt and kv cache for the current iteration
+    // run whisper_decoder() only for decoder 0 and copy the results for the other decoders
+    {
+        prompt.clear();
+
+        // if we have already generated some text, use it as a prompt to condition the next generation
+        if (!prompt_past.empty() && t_cur < 0.5f && params.n_max_text_ctx > 0) {
+            int n_take = std::min(std::min(params.n_max_text_ctx, whisper_n_text_ctx(ctx)/2), int(prompt_past.size()));
+
+            prompt = { whisper_token_prev(ctx) };
+            prompt.insert(prompt.begin() + 1, prompt_past.end() - n_take, prompt_past.end());
         }
 
-        // of only 1 second left, then stop
-        if (seek + 100 >= seek_end) {
-            break;
+        // init new transcription with sot, language (opt) and task tokens
+        prompt.insert(prompt.end(), prompt_init.begin(), prompt_init.end());
+
+        // print the prompt
+        WHISPER_PRINT_DEBUG("\n\n");
+        for (int i = 0; i < (int) prompt.size(); i++) {
+            WHISPER_PRINT_DEBUG("%s: prompt[%d] = %s\n", __func__, i, ctx->vocab.id_to_token.at(prompt[i]).c_str());
         }
+        WHISPER_PRINT_DEBUG("\n\n");
 
-        if (params.encoder_begin_callback) {
-            if (params.encoder_begin_callback(ctx, state, params.encoder_begin_callback_user_data) == false) {
-                fprintf(stderr, "%s: encoder_begin_callback returned false - aborting\n", __func__);
-                break;
-            }
+        if (!whisper_decode_internal(*ctx, *state, state->decoders[0], prompt.data(), prompt.size(), 0, whisper_full_n_threads_decoder(params), ctx->vocab.n_vocab, allowed_tokens)) {
+            fprintf(stderr, "%s: failed to decode\n", __func__);
+            return -7;
         }
 
-        // encode audio features starting at offset seek
-        if (!whisper_encode_internal(*ctx, *state, seek, params.n_threads)) {
-            fprintf(stderr, "%s: failed to encode\n", __func__);
-            return -6;
+        {
+            const int64_t t_start_sample_us = ggml_time_us();
+
+            whisper_process_logits(*ctx, *state, params, state->decoders[0], t_cur);
+
+            state->decoders[0].kv_self.n += prompt.size();
+
+            for (int j = 1; j < n_decoders_cur; ++j) {
+                auto & decoder = state->decoders[j];
+
+                memcpy(decoder.kv_self.k->data, state->decoders[0].kv_self.k->data, ggml_nbytes(decoder.kv_self.k));
+                memcpy(decoder.kv_self.v->data, state->decoders[0].kv_self.v->data, ggml_nbytes(decoder.kv_self.v));
+
+                decoder.kv_self.n += prompt.size();
+
+                memcpy(decoder.probs.data(), state->decoders[0].probs.data(),    decoder.probs.size()*sizeof(decoder.probs[0]));
+                memcpy(decoder.logits.data(), state->decoders[0].logits.data(),   decoder.logits.size()*sizeof(decoder.logits[0]));
+                memcpy(decoder.logprobs.data(), state->decoders[0].logprobs.data(), decoder.logprobs.size()*sizeof(decoder.logprobs[0]));
+            }
+
+            state->t_sample_us += ggml_time_us() - t_start_sample_us;
         }
+    }
 
-        // if there is a very short audio segment left to process, we remove any past prompt since it tends
-        // to confuse the decoder and often make it repeat or hallucinate stuff
-        if (seek > seek_start && seek + 500 >= seek_end) {
-            prompt_past.clear();
+    for (int i = 0, n_max = whisper_n_text_ctx(ctx)/2 - 4; i < n_max; ++i) {
+        // the result is not needed anymore
+        if (it_done && it_done->load() < it) {
+            return best_decoder_id;
         }
 
-        int best_decoder_id = 0;
+        const int64_t t_start_sample_us = ggml_time_us();
 
-        for (int it = 0; it < (int) temperatures.size(); ++it) {
-            const float t_cur = temperatures[it];
+        // store the KV caches of all decoders when doing beam-search
+        if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH) {
+            kv_bufs.resize(n_decoders_cur);
+            for (int j = 0; j < n_decoders_cur; ++j) {
+                auto & decoder = state->decoders[j];
+
+                if (decoder.completed || decoder.failed) {
+                    continue;
+                }
 
-            int n_decoders_cur = 1;
+                kv_bufs[j].k.resize(ggml_nbytes(decoder.kv_self.k));
+                kv_bufs[j].v.resize(ggml_nbytes(decoder.kv_self.v));
+
+                memcpy(kv_bufs[j].k.data(), decoder.kv_self.k->data, kv_bufs[j].k.size());
+                memcpy(kv_bufs[j].v.data(), decoder.kv_self.v->data, kv_bufs[j].v.size());
+            }
+
+            beam_candidates.clear();
+        }
+
+        // generate new sequence candidates for each decoder
+        for (int j = 0; j < n_decoders_cur; ++j) {
+            auto & decoder = state->decoders[j];
+
+            if (decoder.completed || decoder.failed) {
+                continue;
+            }
 
             switch (params.strategy) {
                 case whisper_sampling_strategy::WHISPER_SAMPLING_GREEDY:
                     {
-                        if (t_cur > 0.0f) {
-                            n_decoders_cur = params.greedy.best_of;
+                        if (t_cur < 1e-6f) {
+                            decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, *state, decoder, true));
+                        } else {
+                            decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, *state, decoder, false));
                         }
+
+                        decoder.sequence.sum_logprobs_all += decoder.sequence.tokens.back().plog;
                     } break;
                 case whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH:
                     {
-                        if (t_cur > 0.0f) {
-                            n_decoders_cur = params.greedy.best_of;
-                        } else {
-                            n_decoders_cur = params.beam_search.beam_size;
+                        const auto tokens_new = whisper_sample_token_topk(*ctx, *state, decoder, params.beam_search.beam_size);
+
+                        for (const auto & token : tokens_new) {
+                            beam_candidates.push_back({ j, decoder.seek_delta, decoder.has_ts, decoder.sequence });
+                            beam_candidates.back().sequence.tokens.push_back(token);
+                            beam_candidates.back().sequence.sum_logprobs_all += token.plog;
+
+                            //WHISPER_PRINT_DEBUG("%s: beam candidate: %s (%f, %f)\n", __func__, ctx->vocab.id_to_token.at(token.id).c_str(), token.plog, beam_candidates.back().sequence.sum_logprobs_all);
                         }
                     } break;
             };
+        }
 
-            n_decoders_cur = std::max(1, n_decoders_cur);
+        // for beam-search, choose the top candidates and update the KV caches
+        if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH) {
+            std::sort(
+                    beam_candidates.begin(),
+                    beam_candidates.end(),
+                    [](const beam_candidate & a, const beam_candidate & b) {
+                return a.sequence.sum_logprobs_all > b.sequence.sum_logprobs_all;
+            });
 
-            WHISPER_PRINT_DEBUG("\n%s: decoding with %d decoders, temperature = %.2f\n", __func__, n_decoders_cur, t_cur);
+            uint32_t cur_c = 0;
 
-            // TAGS: WHISPER_DECODER_INIT
             for (int j = 0; j < n_decoders_cur; ++j) {
                 auto & decoder = state->decoders[j];
 
-                decoder.kv_self.n = 0;
+                if (decoder.completed || decoder.failed) {
+                    continue;
+                }
+
+                auto & cur = beam_candidates[cur_c++];
+
+                while (beam_candidates.size() > cur_c && beam_candidates[cur_c].sequence.sum_logprobs_all == cur.sequence.sum_logprobs_all && i > 0) {
+                    ++cur_c;
+                }
 
-                decoder.sequence.tokens.clear();
-                decoder.sequence.result_len       = 0;
-                decoder.sequence.sum_logprobs_all = 0.0;
-                decoder.sequence.sum_logprobs     = -INFINITY;
-                decoder.sequence.avg_logprobs     = -INFINITY;
-                decoder.sequence.entropy          = 0.0;
-                decoder.sequence.score            = -INFINITY;
+                decoder.sequence   = cur.sequence;
+                decoder.seek_delta = cur.seek_delta;
+                decoder.has_ts     = cur.has_ts;
 
-                decoder.seek_delta = 100*WHISPER_CHUNK_SIZE;
+                memcpy(decoder.kv_self.k->data, kv_bufs[cur.decoder_idx].k.data(), kv_bufs[cur.decoder_idx].k.size());
+                memcpy(decoder.kv_self.v->data, kv_bufs[cur.decoder_idx].v.data(), kv_bufs[cur.decoder_idx].v.size());
 
-                decoder.failed    = false;
-                decoder.completed = false;
-                decoder.has_ts    = false;
+                WHISPER_PRINT_DEBUG("%s: beam search: decoder %d: from decoder %d: token = %10s, plog = %8.5f, sum_logprobs = %8.5f\n",
+                        __func__, j, cur.decoder_idx, ctx->vocab.id_to_token.at(decoder.sequence.tokens.back().id).c_str(), decoder.sequence.tokens.back().plog, decoder.sequence.sum_logprobs_all);
             }
+        }
 
-            // init prompt and kv cache for the current iteration
-            // run whisper_decoder() only for decoder 0 and copy the results for the other decoders
-            {
-                prompt.clear();
+        // update the decoder state
+        // - check if the sequence is completed
+        // - check if the sequence is failed
+        // - update sliding window based on timestamp tokens
+        for (int j = 0; j < n_decoders_cur; ++j) {
+            auto & decoder = state->decoders[j];
 
-                // if we have already generated some text, use it as a prompt to condition the next generation
-                if (!prompt_past.empty() && t_cur < 0.5f && params.n_max_text_ctx > 0) {
-                    int n_take = std::min(std::min(params.n_max_text_ctx, whisper_n_text_ctx(ctx)/2), int(prompt_past.size()));
+            if (decoder.completed || decoder.failed) {
+                continue;
+            }
 
-                    prompt = { whisper_token_prev(ctx) };
-                    prompt.insert(prompt.begin() + 1, prompt_past.end() - n_take, prompt_past.end());
-                }
+            auto & has_ts     = decoder.has_ts;
+            auto & failed     = decoder.failed;
+            auto & completed  = decoder.completed;
+            auto & seek_delta = decoder.seek_delta;
+            auto & result_len = decoder.sequence.result_len;
 
-                // init new transcription with sot, language (opt) and task tokens
-                prompt.insert(prompt.end(), prompt_init.begin(), prompt_init.end());
+            {
+                const auto & token = decoder.sequence.tokens.back();
 
-                // print the prompt
-                WHISPER_PRINT_DEBUG("\n\n");
-                for (int i = 0; i < (int) prompt.size(); i++) {
-                    WHISPER_PRINT_DEBUG("%s: prompt[%d] = %s\n", __func__, i, ctx->vocab.id_to_token.at(prompt[i]).c_str());
-                }
-                WHISPER_PRINT_DEBUG("\n\n");
+                // timestamp token - update sliding window
+                if (token.id > whisper_token_beg(ctx)) {
+                    const int seek_delta_new = 2*(token.id - whisper_token_beg(ctx));
+
+                    // do not allow to go back in time
+                    if (has_ts && seek_delta > seek_delta_new && result_len < i) {
+                        failed = true; // TODO: maybe this is not a failure ?
+                        continue;
+                    }
 
-                if (!whisper_decode_internal(*ctx, *state, state->decoders[0], prompt.data(), prompt.size(), 0, params.n_threads)) {
-                    fprintf(stderr, "%s: failed to decode\n", __func__);
-                    return -7;
+                    seek_delta = seek_delta_new;
+                    result_len = i + 1;
+                    has_ts = true;
                 }
 
+#ifdef WHISPER_DEBUG
                 {
-                    const int64_t t_start_sample_us = ggml_time_us();
+                    const auto tt = token.pt > 0.10 ? ctx->vocab.id_to_token.at(token.tid) : "[?]";
+                    WHISPER_PRINT_DEBUG("%s: id = %3d, decoder = %d, token = %6d, p = %6.3f, ts = %10s, %6.3f, result_len = %4d '%s'\n",
+                            __func__, i, j, token.id, token.p, tt.c_str(), token.pt, result_len, ctx->vocab.id_to_token.at(token.id).c_str());
+                }
+#endif
 
-                    whisper_process_logits(*ctx, *state, params, state->decoders[0], t_cur);
+                // end of segment
+                if (token.id == whisper_token_eot(ctx) ||               // end of text token
+                   (params.max_tokens > 0 && i >= params.max_tokens) || // max tokens per segment reached
+                   (has_ts && seek + seek_delta + 100 >= seek_end)      // end of audio reached
+                   ) {
+                    if (result_len == 0) {
+                        if (seek + seek_delta + 100 >= seek_end) {
+                            result_len = i + 1;
+                        } else {
+                            failed = true;
+                            continue;
+                        }
+                    }
 
-                    state->decoders[0].kv_self.n += prompt.size();
+                    if (params.single_segment) {
+                        result_len = i + 1;
+                        seek_delta = 100*WHISPER_CHUNK_SIZE;
+                    }
 
-                    for (int j = 1; j < n_decoders_cur; ++j) {
-                        auto & decoder = state->decoders[j];
+                    completed = true;
+                    continue;
+                }
 
-                        memcpy(decoder.kv_self.k->data, state->decoders[0].kv_self.k->data, ggml_nbytes(decoder.kv_self.k));
-                        memcpy(decoder.kv_self.v->data, state->decoders[0].kv_self.v->data, ggml_nbytes(decoder.kv_self.v));
+                // TESTS: if no tensors are loaded, it means we are running tests
+                if (ctx->model.n_loaded == 0) {
+                    seek_delta = 100*WHISPER_CHUNK_SIZE;
+                    completed = true;
+                    continue;
+                }
+            }
 
-                        decoder.kv_self.n += prompt.size();
+            // abort the decoders that are on track to fail the entropy and logprob checks done after the decoding,
+            // instead of letting them run until the end of the segment - the fallback can then start right away
+            if (can_fallback) {
+                const int n_tokens = decoder.sequence.tokens.size();
 
-                        memcpy(decoder.probs.data(), state->decoders[0].probs.data(),    decoder.probs.size()*sizeof(decoder.probs[0]));
-                        memcpy(decoder.logits.data(), state->decoders[0].logits.data(),   decoder.logits.size()*sizeof(decoder.logits[0]));
-                        memcpy(decoder.logprobs.data(), state->decoders[0].logprobs.data(), decoder.logprobs.size()*sizeof(decoder.logprobs[0]));
-                    }
+                if (n_tokens > 32 && whisper_sequence_entropy(decoder.sequence, n_tokens) < params.entropy_thold) {
+                    WHISPER_PRINT_DEBUG("%s: decoder %2d: aborted due to entropy < %8.5f\n", __func__, j, params.entropy_thold);
 
-                    state->t_sample_us += ggml_time_us() - t_start_sample_us;
+                    failed = true;
+                    state->n_fail_h++;
+                    continue;
                 }
-            }
 
-            for (int i = 0, n_max = whisper_n_text_ctx(ctx)/2 - 4; i < n_max; ++i) {
-                const int64_t t_start_sample_us = ggml_time_us();
+                if (n_tokens > 32 && decoder.sequence.sum_logprobs_all/n_tokens < params.logprob_thold) {
+                    WHISPER_PRINT_DEBUG("%s: decoder %2d: aborted due to avg logprob < %8.5f\n", __func__, j, params.logprob_thold);
 
-                // store the KV caches of all decoders when doing beam-search
-                if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH) {
-                    kv_bufs.resize(n_decoders_cur);
-                    for (int j = 0; j < n_decoders_cur; ++j) {
-                        auto & decoder = state->decoders[j];
+                    failed = true;
+                    continue;
+                }
+            }
 
-                        if (decoder.completed || decoder.failed) {
-                            continue;
-                        }
+            // sometimes, the decoding can get stuck in a repetition loop
+            // this is an attempt to mitigate such cases - we flag the decoding as failed and use a fallback strategy
+            if (i == n_max - 1 && (result_len == 0 || seek_delta < 100*WHISPER_CHUNK_SIZE/2)) {
+                failed = true;
+                continue;
+            }
+        }
 
-                        kv_bufs[j].k.resize(ggml_nbytes(decoder.kv_self.k));
-                        kv_bufs[j].v.resize(ggml_nbytes(decoder.kv_self.v));
+        // check if all decoders have finished (i.e. completed or failed)
+        {
+            bool completed_all = true;
 
-                        memcpy(kv_bufs[j].k.data(), decoder.kv_self.k->data, kv_bufs[j].k.size());
-                        memcpy(kv_bufs[j].v.data(), decoder.kv_self.v->data, kv_bufs[j].v.size());
-                    }
+            for (int j = 0; j < n_decoders_cur; ++j) {
+                auto & decoder = state->decoders[j];
 
-                    beam_candidates.clear();
+                if (decoder.completed || decoder.failed) {
+                    continue;
                 }
 
-                // generate new sequence candidates for each decoder
-                for (int j = 0; j < n_decoders_cur; ++j) {
-                    auto & decoder = state->decoders[j];
+                completed_all = false;
+            }
 
-                    if (decoder.completed || decoder.failed) {
-                        continue;
-                    }
+            if (completed_all) {
+                break;
+            }
+        }
 
-                    switch (params.strategy) {
-                        case whisper_sampling_strategy::WHISPER_SAMPLING_GREEDY:
-                            {
-                                if (t_cur < 1e-6f) {
-                                    decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, *state, decoder, true));
-                                } else {
-                                    decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, *state, decoder, false));
-                                }
+        state->t_sample_us += ggml_time_us() - t_start_sample_us;
 
-                                decoder.sequence.sum_logprobs_all += decoder.sequence.tokens.back().plog;
-                            } break;
-                        case whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH:
-                            {
-                                const auto tokens_new = whisper_sample_token_topk(*ctx, *state, decoder, params.beam_search.beam_size);
+        // after a pair of timestamps, whisper_process_logits() suppresses all timestamp tokens,
+        // so there is no need to compute their logits (unless the user wants to see them)
+        const auto get_n_logits = [&](const whisper_decoder & decoder) {
+            const auto & tokens_cur = decoder.sequence.tokens;
 
-                                for (const auto & token : tokens_new) {
-                                    beam_candidates.push_back({ j, decoder.seek_delta, decoder.has_ts, decoder.sequence });
-                                    beam_candidates.back().sequence.tokens.push_back(token);
-                                    beam_candidates.back().sequence.sum_logprobs_all += token.plog;
+            const bool last_was_timestamp        = tokens_cur.size() > 0 && tokens_cur.back().id >= ctx->vocab.token_beg;
+            const bool penultimate_was_timestamp = tokens_cur.size() < 2 || tokens_cur[tokens_cur.size() - 2].id >= ctx->vocab.token_beg;
 
-                                    //WHISPER_PRINT_DEBUG("%s: beam candidate: %s (%f, %f)\n", __func__, ctx->vocab.id_to_token.at(token.id).c_str(), token.plog, beam_candidates.back().sequence.sum_logprobs_all);
-                                }
-                            } break;
-                    };
-                }
+            if (last_was_timestamp && penultimate_was_timestamp && params.logits_filter_callback == nullptr) {
+                return ctx->vocab.token_beg;
+            }
 
-                // for beam-search, choose the top candidates and update the KV caches
-                if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH) {
-                    std::sort(
-                            beam_candidates.begin(),
-                            beam_candidates.end(),
-                            [](const beam_candidate & a, const beam_candidate & b) {
-                        return a.sequence.sum_logprobs_all > b.sequence.sum_logprobs_all;
-                    });
+            return ctx->vocab.n_vocab;
+        };
 
-                    uint32_t cur_c = 0;
+        std::vector<int> decoders_active;
 
-                    for (int j = 0; j < n_decoders_cur; ++j) {
-                        auto & decoder = state->decoders[j];
+        for (int j = 0; j < n_decoders_cur; ++j) {
+            auto & decoder = state->decoders[j];
 
-                        if (decoder.completed || decoder.failed) {
-                            continue;
-                        }
+            if (decoder.failed || decoder.completed) {
+                continue;
+            }
 
-                        auto & cur = beam_candidates[cur_c++];
+            decoder.tokens_tmp.resize(1);
+            decoder.tokens_tmp[0] = decoder.sequence.tokens.back().id;
 
-                        while (beam_candidates.size() > cur_c && beam_candidates[cur_c].sequence.sum_logprobs_all == cur.sequence.sum_logprobs_all && i > 0) {
-                            ++cur_c;
-                        }
+            decoders_active.push_back(j);
+        }
+
+        // [EXPERIMENTAL] evaluate the active decoders concurrently, each worker with its share of the n_threads threads
+        // (at most n_threads_decoder) - the logits are then processed sequentially below, in the order of the decoders
+        const int n_workers = use_spec ? 1 : std::min((int) decoders_active.size(), params.n_threads);
+
+        if (n_workers > 1) {
+            const int64_t t_start_us = ggml_time_us();
+
+            std::vector<char> ok(n_workers, true);
 
-                        decoder.sequence   = cur.sequence;
-                        decoder.seek_delta = cur.seek_delta;
-                        decoder.has_ts     = cur.has_ts;
+            const auto work = [&](int iw) {
+                const int n_threads = std::min(whisper_full_n_threads_decoder(params), params.n_threads/n_workers + (iw < params.n_threads % n_workers ? 1 : 0));
 
-                        memcpy(decoder.kv_self.k->data, kv_bufs[cur.decoder_idx].k.data(), kv_bufs[cur.decoder_idx].k.size());
-                        memcpy(decoder.kv_self.v->data, kv_bufs[cur.decoder_idx].v.data(), kv_bufs[cur.decoder_idx].v.size());
+                for (int k = iw; k < (int) decoders_active.size(); k += n_workers) {
+                    auto & decoder = state->decoders[decoders_active[k]];
 
-                        WHISPER_PRINT_DEBUG("%s: beam search: decoder %d: from decoder %d: token = %10s, plog = %8.5f, sum_logprobs = %8.5f\n",
-                                __func__, j, cur.decoder_idx, ctx->vocab.id_to_token.at(decoder.sequence.tokens.back().id).c_str(), decoder.sequence.tokens.back().plog, decoder.sequence.sum_logprobs_all);
+                    if (!whisper_decode_internal(*ctx, *state, decoder, decoder.tokens_tmp.data(), decoder.tokens_tmp.size(), decoder.kv_self.n, n_threads, get_n_logits(decoder), allowed_tokens, false, &decoder.logits_tmp)) {
+                        ok[iw] = false;
+                        return;
                     }
                 }
+            };
 
-                // update the decoder state
-                // - check if the sequence is completed
-                // - check if the sequence is failed
-                // - update sliding window based on timestamp tokens
-                for (int j = 0; j < n_decoders_cur; ++j) {
-                    auto & decoder = state->decoders[j];
+            if (!state->decoder_pool || (int) state->decoder_pool->workers.size() < n_workers - 1) {
+                // sized for the most decoders of any temperature
+                const int n_pool = std::min(std::max(params.greedy.best_of, params.beam_search.beam_size), params.n_threads);
 
-                    if (decoder.completed || decoder.failed) {
-                        continue;
-                    }
+                state->decoder_pool.reset(new whisper_decoder_pool(std::max(n_pool, n_workers) - 1));
+            }
 
-                    auto & has_ts     = decoder.has_ts;
-                    auto & failed     = decoder.failed;
-                    auto & completed  = decoder.completed;
-                    auto & seek_delta = decoder.seek_delta;
-                    auto & result_len = decoder.sequence.result_len;
+            state->decoder_pool->run(n_workers, work);
 
-                    {
-                        const auto & token = decoder.sequence.tokens.back();
+            state->t_decode_us += ggml_time_us() - t_start_us;
+            state->n_decode    += decoders_active.size();
 
-                        // timestamp token - update sliding window
-                        if (token.id > whisper_token_beg(ctx)) {
-                            const int seek_delta_new = 2*(token.id - whisper_token_beg(ctx));
+            if (std::find(ok.begin(), ok.end(), false) != ok.end()) {
+                fprintf(stderr, "%s: failed to decode\n", __func__);
+                return -8;
+            }
+        }
 
-                            // do not allow to go back in time
-                            if (has_ts && seek_delta > seek_delta_new && result_len < i) {
-                                failed = true; // TODO: maybe this is not a failure ?
-                                continue;
-                            }
+        // obtain logits for the next token
+        for (const int j : decoders_active) {
+            auto & decoder = state->decoders[j];
 
-                            seek_delta = seek_delta_new;
-                            result_len = i + 1;
-                            has_ts = true;
-                        }
+            //WHISPER_PRINT_DEBUG("%s: decoder %d: token %d, kv_self.n %d, seek_delta %d\n", __func__, j, decoder.tokens_tmp[0], decoder.kv_self.n, decoder.seek_delta);
 
-#ifdef WHISPER_DEBUG
-                        {
-                            const auto tt = token.pt > 0.10 ? ctx->vocab.id_to_token.at(token.tid) : "[?]";
-                            WHISPER_PRINT_DEBUG("%s: id = %3d, decoder = %d, token = %6d, p = %6.3f, ts = %10s, %6.3f, result_len = %4d '%s'\n",
-                                    __func__, i, j, token.id, token.p, tt.c_str(), token.pt, result_len, ctx->vocab.id_to_token.at(token.id).c_str());
-                        }
-#endif
+            if (use_spec) {
+                const int n_vocab = ctx->vocab.n_vocab;
+
+                if (spec.n_used < (int) spec.tokens.size() && spec.tokens[spec.n_used] == decoder.tokens_tmp[0]) {
+                    // the sampled token is the next draft token, so its logits were already computed by the verification pass
+                    // its K and V are also already in the KV cache
+                    spec.n_used++;
+                } else {
+                    // the draft tokens after a rejected one are discarded - the KV cache entries beyond kv_self.n are overwritten
+                    std::vector<whisper_token> past = prompt;
+                    for (const auto & token : decoder.sequence.tokens) {
+                        past.push_back(token.id);
+                    }
+
+                    const int n_draft = std::min(params.draft_n_tokens, whisper_n_text_ctx(ctx) - decoder.kv_self.n - 1);
+
+                    if (!whisper_speculative_draft(spec, params, decoder, past, n_draft)) {
+                        fprintf(stderr, "%s: failed to decode with the draft model\n", __func__);
+                        return -8;
+                    }
+
+                    decoder.tokens_tmp.insert(decoder.tokens_tmp.end(), spec.tokens.begin(), spec.tokens.end());
+
+                    if (!whisper_decode_internal(*ctx, *state, decoder, decoder.tokens_tmp.data(), decoder.tokens_tmp.size(), decoder.kv_self.n, whisper_full_n_threads_decoder(params), n_vocab, {}, true)) {
+                        fprintf(stderr, "%s: failed to decode\n", __func__);
+                        return -8;
+                    }
+
+                    spec.logits.swap(state->logits);
+                    spec.n_used = 0;
+                }
+
+                state->logits.assign(spec.logits.begin() + spec.n_used*n_vocab, spec.logits.begin() + (spec.n_used + 1)*n_vocab);
+
+                const int64_t t_start_sample_us = ggml_time_us();
+
+                whisper_process_logits(*ctx, *state, params, decoder, t_cur);
+
+                ++decoder.kv_self.n;
+
+                state->t_sample_us += ggml_time_us() - t_start_sample_us;
+
+                continue;
+            }
+
+            if (n_workers > 1) {
+                state->logits.swap(decoder.logits_tmp);
+            } else if (!whisper_decode_internal(*ctx, *state, decoder, decoder.tokens_tmp.data(), decoder.tokens_tmp.size(), decoder.kv_self.n, whisper_full_n_threads_decoder(params), get_n_logits(decoder), allowed_tokens)) {
+                fprintf(stderr, "%s: failed to decode\n", __func__);
+                return -8;
+            }
+
+            {
+                const int64_t t_start_sample_us = ggml_time_us();
+
+                whisper_process_logits(*ctx, *state, params, decoder, t_cur);
+
+                ++decoder.kv_self.n;
+
+                state->t_sample_us += ggml_time_us() - t_start_sample_us;
+            }
+        }
+    }
+
+    // rank the resulting sequences and select the best one
+    {
+        double best_score = -INFINITY;
+
+        for (int j = 0; j < n_decoders_cur; ++j) {
+            auto & decoder = state->decoders[j];
+
+            if (decoder.failed) {
+                continue;
+            }
+
+            decoder.sequence.tokens.resize(decoder.sequence.result_len);
+            whisper_sequence_score(params, decoder.sequence);
+
+            WHISPER_PRINT_DEBUG("%s: decoder %2d: score = %8.5f, result_len = %3d, avg_logprobs = %8.5f, entropy = %8.5f\n",
+                    __func__, j, decoder.sequence.score, decoder.sequence.result_len, decoder.sequence.avg_logprobs, decoder.sequence.entropy);
+
+            if (decoder.sequence.result_len > 32 && decoder.sequence.entropy < params.entropy_thold) {
+                WHISPER_PRINT_DEBUG("%s: decoder %2d: failed due to entropy %8.5f < %8.5f\n",
+                        __func__, j, decoder.sequence.entropy, params.entropy_thold);
+
+                decoder.failed = true;
+                state->n_fail_h++;
+
+                continue;
+            }
+
+            if (best_score < decoder.sequence.score) {
+                best_score = decoder.sequence.score;
+                best_decoder_id = j;
+            }
+        }
+
+        WHISPER_PRINT_DEBUG("%s: best decoder = %d\n", __func__, best_decoder_id);
+    }
+
+    return best_decoder_id;
+}
+
+int whisper_full_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+    struct whisper_full_params   params,
+                   const float * samples,
+                           int   n_samples) {
+    // clear old results
+    auto & result_all = state->result_all;
+
+    result_all.clear();
+
+    // [EXPERIMENTAL] pin the computation to a range of CPUs
+    const whisper_cpu_affinity cpu_affinity(params.cpu_offset, params.n_threads);
+
+    // compute log mel spectrogram, unless it is shared with other tasks
+    if (state->encoder_share) {
+        // already computed
+    } else if (params.speed_up) {
+        if (whisper_pcm_to_mel_phase_vocoder_with_state(ctx, state, samples, n_samples, whisper_full_n_threads_mel(params)) != 0) {
+            fprintf(stderr, "%s: failed to compute log mel spectrogram\n", __func__);
+            return -1;
+        }
+    } else {
+        if (whisper_pcm_to_mel_with_state(ctx, state, samples, n_samples, whisper_full_n_threads_mel(params)) != 0) {
+            fprintf(stderr, "%s: failed to compute log mel spectrogram\n", __func__);
+            return -2;
+        }
+    }
+
+    // overwrite audio_ctx, max allowed is hparams.n_audio_ctx
+    if (params.audio_ctx > whisper_n_audio_ctx(ctx)) {
+        fprintf(stderr, "%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params.audio_ctx, whisper_n_audio_ctx(ctx));
+        return -5;
+    }
+    state->exp_n_audio_ctx = params.audio_ctx;
+
+    // the window that is currently encoded in kv_cross, if any, and its audio context
+    int seek_encoded        = -1;
+    int n_audio_ctx_encoded =  0;
+
+    const int seek_start = params.offset_ms/10;
+    const int n_len      = state->encoder_share ? state->encoder_share->mel->n_len_org : whisper_n_len_from_state(state);
+    const int seek_end   = params.duration_ms == 0 ? n_len : seek_start + params.duration_ms/10;
+
+    // [EXPERIMENTAL] speculative decoding - the draft model decodes in a state of its own, attached to ours
+    if (params.draft_ctx) {
+        auto * ctx_draft = params.draft_ctx;
+
+        if (ctx_draft->vocab.n_vocab != ctx->vocab.n_vocab || ctx_draft->model.hparams.n_mels != ctx->model.hparams.n_mels) {
+            fprintf(stderr, "%s: the draft model must have the same vocabulary and mel bins as the main model\n", __func__);
+            return -11;
+        }
+
+        if (state->state_draft && state->ctx_draft != ctx_draft) {
+            whisper_free_state(state->state_draft);
+            state->state_draft = nullptr;
+        }
+
+        if (state->state_draft == nullptr) {
+            state->state_draft = whisper_init_state(ctx_draft);
+            if (!state->state_draft) {
+                fprintf(stderr, "%s: failed to init the state for the draft model\n", __func__);
+                return -11;
+            }
+
+            state->ctx_draft = ctx_draft;
+        }
+    }
+
+    // auto-detect language if not specified
+    if (params.language == nullptr || strlen(params.language) == 0 || strcmp(params.language, "auto") == 0 || params.detect_language) {
+        std::vector<float> probs(whisper_lang_max_id() + 1, 0.0f);
+
+        state->exp_n_audio_ctx = whisper_full_audio_ctx(*ctx, params, 0, seek_end);
+
+        const auto lang_id = whisper_lang_auto_detect_with_state(ctx, state, 0, whisper_full_n_threads_encoder(params), probs.data());
+        if (lang_id < 0) {
+            fprintf(stderr, "%s: failed to auto-detect language\n", __func__);
+            return -3;
+        }
+        state->lang_id = lang_id;
+        params.language = whisper_lang_str(lang_id);
+
+        // the language detection encoded the first window
+        seek_encoded        = 0;
+        n_audio_ctx_encoded = state->exp_n_audio_ctx;
+
+        fprintf(stderr, "%s: auto-detected language: %s (p = %f)\n", __func__, params.language, probs[whisper_lang_id(params.language)]);
+        if (params.detect_language) {
+            return 0;
+        }
+    }
+
+    if (params.token_timestamps) {
+        state->t_beg    = 0;
+        state->t_last   = 0;
+        state->tid_last = 0;
+        state->energy = get_signal_energy(samples, n_samples, 32);
+    }
+
+    // if length of spectrogram is less than 1s (100 samples), then return
+    // basically don't process anything that is less than 1s
+    // see issue #39: https://github.com/ggerganov/whisper.cpp/issues/39
+    if (seek_end < seek_start + (params.speed_up ? 50 : 100)) {
+        return 0;
+    }
+
+    // a set of temperatures to use
+    // [ t0, t0 + delta, t0 + 2*delta, ..., < 1.0f + 1e-6f ]
+    std::vector<float> temperatures;
+    if (params.temperature_inc > 0.0f) {
+        for (float t = params.temperature; t < 1.0f + 1e-6f; t += params.temperature_inc) {
+            temperatures.push_back(t);
+        }
+    } else {
+        temperatures.push_back(params.temperature);
+    }
+
+    // initialize the decoders
+    int n_decoders = 1;
+
+    switch (params.strategy) {
+        case WHISPER_SAMPLING_GREEDY:
+            {
+                n_decoders = params.greedy.best_of;
+            } break;
+        case WHISPER_SAMPLING_BEAM_SEARCH:
+            {
+                n_decoders = std::max(params.greedy.best_of, params.beam_search.beam_size);
+            } break;
+    };
+
+    n_decoders = std::max(1, n_decoders);
+
+    if (!whisper_full_init_decoders(*ctx, *state, n_decoders)) {
+        return -4;
+    }
+
+    // the accumulated text context so far
+    auto & prompt_past = state->prompt_past;
+    if (params.no_context) {
+        prompt_past.clear();
+    }
+
+    // prepare prompt
+    {
+        std::vector<whisper_token> prompt_tokens;
+
+        // initial prompt
+        if (!params.prompt_tokens && params.initial_prompt) {
+            prompt_tokens.resize(1024);
+            prompt_tokens.resize(whisper_tokenize(ctx, params.initial_prompt, prompt_tokens.data(), prompt_tokens.size()));
+            params.prompt_tokens   = prompt_tokens.data();
+            params.prompt_n_tokens = prompt_tokens.size();
+        }
+
+        // prepend the prompt tokens to the prompt_past
+        if (params.prompt_tokens && params.prompt_n_tokens > 0) {
+            // parse tokens from the pointer
+            for (int i = 0; i < params.prompt_n_tokens; i++) {
+                prompt_past.push_back(params.prompt_tokens[i]);
+            }
+            std::rotate(prompt_past.begin(), prompt_past.end() - params.prompt_n_tokens, prompt_past.end());
+        }
+    }
+
+    // these tokens determine the task that will be performed
+    std::vector<whisper_token> prompt_init = { whisper_token_sot(ctx) };
+    if (whisper_is_multilingual(ctx)) {
+        const int lang_id = whisper_lang_id(params.language);
+        state->lang_id = lang_id;
+        prompt_init.push_back(whisper_token_lang(ctx, lang_id));
+        if (params.translate) {
+            prompt_init.push_back(whisper_token_translate(ctx));
+        } else {
+            prompt_init.push_back(whisper_token_transcribe(ctx));
+        }
+    }
+
+    // the set of tokens that the decoder computes logits for (empty = the whole vocabulary)
+    std::vector<whisper_token> allowed_tokens;
+    if (params.allowed_tokens && params.allowed_n_tokens > 0) {
+        for (int i = 0; i < params.allowed_n_tokens; ++i) {
+            const whisper_token id = params.allowed_tokens[i];
+            if (id < 0 || id >= ctx->vocab.n_vocab) {
+                fprintf(stderr, "%s: invalid allowed token %d\n", __func__, id);
+                return -9;
+            }
+            allowed_tokens.push_back(id);
+        }
+    }
+
+    int progress_prev = 0;
+    int progress_step = 5;
+
+    int seek = seek_start;
+
+    std::vector<whisper_token> prompt;
+    prompt.reserve(whisper_n_text_ctx(ctx));
+
+    // [EXPERIMENTAL] the window that is being encoded ahead in state->state_ahead, if any
+    int seek_ahead = -1;
+    std::future<bool> encoded_ahead;
+
+    // with timestamps, the next window starts at the last timestamp of the best decoding, which is only known at its end,
+    // so the guess that the window is consumed is only reliable with single_segment
+    const bool encode_ahead = params.encode_ahead && params.single_segment && !state->encoder_share;
+
+    if (params.encode_ahead && !params.single_segment) {
+        fprintf(stderr, "%s: WARNING: encode_ahead is only used with single_segment\n", __func__);
+    }
+
+    if (encode_ahead && state->state_ahead == nullptr) {
+        state->state_ahead = whisper_init_state(ctx);
+        if (!state->state_ahead) {
+            fprintf(stderr, "%s: failed to init the state for encoding ahead\n", __func__);
+            return -10;
+        }
+    }
+
+    // main loop
+    while (true) {
+        const int progress_cur = (100*(seek - seek_start))/(seek_end - seek_start);
+        while (progress_cur >= progress_prev + progress_step) {
+            progress_prev += progress_step;
+            if (params.print_progress) {
+                fprintf(stderr, "%s: progress = %3d%%\n", __func__, progress_prev);
+            }
+        }
+        if (params.progress_callback) {
+            params.progress_callback(
+                ctx, ctx->state, progress_prev, params.progress_callback_user_data);
+        }
+
+        // of only 1 second left, then stop
+        if (seek + 100 >= seek_end) {
+            break;
+        }
+
+        // [EXPERIMENTAL] the rest of the audio is transcribed by the next call (see whisper_full_long())
+        if (state->seek_stop >= 0 && seek > state->seek_stop) {
+            break;
+        }
+
+        if (params.encoder_begin_callback) {
+            if (params.encoder_begin_callback(ctx, state, params.encoder_begin_callback_user_data) == false) {
+                fprintf(stderr, "%s: encoder_begin_callback returned false - aborting\n", __func__);
+                break;
+            }
+        }
+
+        state->exp_n_audio_ctx = whisper_full_audio_ctx(*ctx, params, seek, seek_end);
+
+        // encode audio features starting at offset seek, unless they were already encoded
+        bool is_encoded = seek == seek_encoded && state->exp_n_audio_ctx == n_audio_ctx_encoded;
+
+        seek_encoded = -1;
+
+        if (state->encoder_share) {
+            if (!whisper_encoder_share_acquire(*ctx, *state, seek, whisper_full_n_threads_encoder(params))) {
+                fprintf(stderr, "%s: failed to encode\n", __func__);
+                return -6;
+            }
+
+            is_encoded = true;
+        }
+
+        if (seek_ahead >= 0) {
+            auto * state_ahead = state->state_ahead;
+
+            if (!encoded_ahead.get()) {
+                fprintf(stderr, "%s: failed to encode ahead\n", __func__);
+                return -6;
+            }
+
+            if (seek_ahead == seek && state_ahead->exp_n_audio_ctx == state->exp_n_audio_ctx) {
+                std::swap(state->kv_cross, state_ahead->kv_cross);
+                is_encoded = true;
+            }
+
+            state->t_encode_us += state_ahead->t_encode_us;
+            state->n_encode    += state_ahead->n_encode;
+
+            state_ahead->t_encode_us = 0;
+            state_ahead->n_encode    = 0;
+
+            seek_ahead = -1;
+        }
+
+        if (!is_encoded && params.encoder_batch) {
+            if (!whisper_encoder_batch_encode(*params.encoder_batch, *state, state->mel, seek)) {
+                fprintf(stderr, "%s: failed to encode\n", __func__);
+                return -6;
+            }
+        } else if (!is_encoded && !whisper_encode_internal(*ctx, *state, seek, whisper_full_n_threads_encoder(params))) {
+            fprintf(stderr, "%s: failed to encode\n", __func__);
+            return -6;
+        }
+
+        // [EXPERIMENTAL] pick the number of decoder threads on the first encoded window
+        if (params.n_threads_decoder < 0) {
+            if (state->n_threads_decoder_tuned == 0) {
+                state->n_threads_decoder_tuned = whisper_tune_n_threads_decoder(*ctx, *state, params.n_threads);
+
+                fprintf(stderr, "%s: using %d decoder threads\n", __func__, state->n_threads_decoder_tuned);
+            }
+
+            params.n_threads_decoder = std::min(state->n_threads_decoder_tuned, params.n_threads);
+        }
+
+        // the next window starts where the current one ends, so encode it while the current window is decoded
+        // the encoder reads our mel, which does not change during the decoding
+        if (encode_ahead && seek + 100*WHISPER_CHUNK_SIZE + 100 < seek_end) {
+            auto * state_ahead = state->state_ahead;
+
+            seek_ahead = seek + 100*WHISPER_CHUNK_SIZE;
+
+            state_ahead->exp_n_audio_ctx = whisper_full_audio_ctx(*ctx, params, seek_ahead, seek_end);
+
+            const int n_threads = whisper_full_n_threads_encoder(params);
+
+            encoded_ahead = std::async(std::launch::async, [ctx, state, state_ahead, seek_ahead, n_threads]() {
+                return whisper_encode_internal(*ctx, *state_ahead, state->mel, seek_ahead, n_threads);
+            });
+        }
+
+        // if there is a very short audio segment left to process, we remove any past prompt since it tends
+        // to confuse the decoder and often make it repeat or hallucinate stuff
+        if (seek > seek_start && seek + 500 >= seek_end) {
+            prompt_past.clear();
+        }
 
-                        // end of segment
-                        if (token.id == whisper_token_eot(ctx) ||               // end of text token
-                           (params.max_tokens > 0 && i >= params.max_tokens) || // max tokens per segment reached
-                           (has_ts && seek + seek_delta + 100 >= seek_end)      // end of audio reached
-                           ) {
-                            if (result_len == 0) {
-                                if (seek + seek_delta + 100 >= seek_end) {
-                                    result_len = i + 1;
-                                } else {
-                                    failed = true;
-                                    continue;
-                                }
-                            }
+        int best_decoder_id = 0;
 
-                            if (params.single_segment) {
-                                result_len = i + 1;
-                                seek_delta = 100*WHISPER_CHUNK_SIZE;
-                            }
+        // the decoding is accepted if the best decoder did not fail and has a high enough average logprob
+        const auto is_success = [&](const whisper_decoder & decoder) {
+            return !decoder.failed && decoder.sequence.avg_logprobs >= params.logprob_thold;
+        };
 
-                            completed = true;
-                            continue;
-                        }
+        // the temperature to continue with after the concurrent decoding below
+        int it_next = 0;
 
-                        // TESTS: if no tensors are loaded, it means we are running tests
-                        if (ctx->model.n_loaded == 0) {
-                            seek_delta = 100*WHISPER_CHUNK_SIZE;
-                            completed = true;
-                            continue;
-                        }
-                    }
+        // [EXPERIMENTAL] decode the first temperatures concurrently, each one in a separate state that shares our kv_cross
+        // the decodings at higher temperatures stop as soon as a lower temperature succeeds
+        const int n_parallel = std::min(params.temperature_n_parallel, (int) temperatures.size());
 
-                    // sometimes, the decoding can get stuck in a repetition loop
-                    // this is an attempt to mitigate such cases - we flag the decoding as failed and use a fallback strategy
-                    if (i == n_max - 1 && (result_len == 0 || seek_delta < 100*WHISPER_CHUNK_SIZE/2)) {
-                        failed = true;
-                        continue;
-                    }
+        if (n_parallel > 1 && seek_end - seek > 10*WHISPER_CHUNK_SIZE) {
+            while ((int) state->states_fallback.size() < n_parallel - 1) {
+                whisper_state * state_fallback = whisper_init_state(ctx);
+                if (!state_fallback) {
+                    fprintf(stderr, "%s: failed to init the state for the concurrent fallback\n", __func__);
+                    return -10;
                 }
 
-                // check if all decoders have finished (i.e. completed or failed)
-                {
-                    bool completed_all = true;
+                kv_cache_free(state_fallback->kv_cross);
+                state_fallback->kv_cross.buf.clear();
+                state_fallback->kv_cross.buf.shrink_to_fit();
 
-                    for (int j = 0; j < n_decoders_cur; ++j) {
-                        auto & decoder = state->decoders[j];
+                state->states_fallback.push_back(state_fallback);
+            }
 
-                        if (decoder.completed || decoder.failed) {
-                            continue;
-                        }
+            std::vector<whisper_state *> states = { state };
+            for (int it = 1; it < n_parallel; ++it) {
+                states.push_back(state->states_fallback[it - 1]);
 
-                        completed_all = false;
-                    }
+                // our kv_cross can change between windows (see encode_ahead)
+                states[it]->kv_cross.k   = state->kv_cross.k;
+                states[it]->kv_cross.v   = state->kv_cross.v;
+                states[it]->kv_cross.ctx = state->kv_cross.ctx;
 
-                    if (completed_all) {
-                        break;
-                    }
+                if (!whisper_full_init_decoders(*ctx, *states[it], n_decoders)) {
+                    return -4;
                 }
 
-                state->t_sample_us += ggml_time_us() - t_start_sample_us;
+                states[it]->exp_n_audio_ctx = state->exp_n_audio_ctx;
+            }
 
-                // obtain logits for the next token
-                for (int j = 0; j < n_decoders_cur; ++j) {
-                    auto & decoder = state->decoders[j];
+            std::atomic<int> it_done(n_parallel);
 
-                    if (decoder.failed || decoder.completed) {
-                        continue;
-                    }
+            std::vector<int> rets(n_parallel, 0);
+            std::vector<std::vector<whisper_token>> prompts(n_parallel);
 
-                    decoder.tokens_tmp.resize(1);
-                    decoder.tokens_tmp[0] = decoder.sequence.tokens.back().id;
+            const auto decode = [&](int it) {
+                const bool can_fallback = it != (int) temperatures.size() - 1 && seek_end - seek > 10*WHISPER_CHUNK_SIZE;
 
-                    //WHISPER_PRINT_DEBUG("%s: decoder %d: token %d, kv_self.n %d, seek_delta %d\n", __func__, j, decoder.tokens_tmp[0], decoder.kv_self.n, decoder.seek_delta);
+                rets[it] = whisper_full_decode(*ctx, *states[it], params, temperatures[it], it, can_fallback, seek, seek_end, prompt_past, prompt_init, allowed_tokens, prompts[it], &it_done);
 
-                    if (!whisper_decode_internal(*ctx, *state, decoder, decoder.tokens_tmp.data(), decoder.tokens_tmp.size(), decoder.kv_self.n, params.n_threads)) {
-                        fprintf(stderr, "%s: failed to decode\n", __func__);
-                        return -8;
-                    }
+                if (rets[it] >= 0 && is_success(states[it]->decoders[rets[it]])) {
+                    int it_cur = it_done.load();
+                    while (it < it_cur && !it_done.compare_exchange_weak(it_cur, it)) {}
+                }
+            };
 
-                    {
-                        const int64_t t_start_sample_us = ggml_time_us();
+            std::vector<std::thread> workers;
+            for (int it = 1; it < n_parallel; ++it) {
+                workers.emplace_back(decode, it);
+            }
 
-                        whisper_process_logits(*ctx, *state, params, decoder, t_cur);
+            decode(0);
 
-                        ++decoder.kv_self.n;
+            for (auto & worker : workers) {
+                worker.join();
+            }
 
-                        state->t_sample_us += ggml_time_us() - t_start_sample_us;
-                    }
+            for (int it = 0; it < n_parallel; ++it) {
+                if (rets[it] < 0) {
+                    return rets[it];
                 }
             }
 
-            // rank the resulting sequences and select the best one
-            {
-                double best_score = -INFINITY;
+            for (int it = 1; it < n_parallel; ++it) {
+                state->n_sample += states[it]->n_sample;
+                state->n_decode += states[it]->n_decode;
+                state->n_fail_h += states[it]->n_fail_h;
 
-                for (int j = 0; j < n_decoders_cur; ++j) {
-                    auto & decoder = state->decoders[j];
+                states[it]->n_sample = 0;
+                states[it]->n_decode = 0;
+                states[it]->n_fail_h = 0;
+            }
 
-                    if (decoder.failed) {
-                        continue;
-                    }
+            // without a successful decoding, the last temperature is used if it was decoded, as in the sequential fallback
+            int it_best = it_done.load();
+            if (it_best == n_parallel && n_parallel == (int) temperatures.size()) {
+                it_best = n_parallel - 1;
+            }
 
-                    decoder.sequence.tokens.resize(decoder.sequence.result_len);
-                    whisper_sequence_score(params, decoder.sequence);
+            state->n_fail_p += std::min(it_best, n_parallel);
 
-                    WHISPER_PRINT_DEBUG("%s: decoder %2d: score = %8.5f, result_len = %3d, avg_logprobs = %8.5f, entropy = %8.5f\n",
-                            __func__, j, decoder.sequence.score, decoder.sequence.result_len, decoder.sequence.avg_logprobs, decoder.sequence.entropy);
+            if (it_best < n_parallel) {
+                best_decoder_id = rets[it_best];
 
-                    if (decoder.sequence.result_len > 32 && decoder.sequence.entropy < params.entropy_thold) {
-                        WHISPER_PRINT_DEBUG("%s: decoder %2d: failed due to entropy %8.5f < %8.5f\n",
-                                __func__, j, decoder.sequence.entropy, params.entropy_thold);
+                if (it_best > 0) {
+                    auto & dst = state->decoders[best_decoder_id];
+                    const auto & src = states[it_best]->decoders[best_decoder_id];
 
-                        decoder.failed = true;
-                        state->n_fail_h++;
+                    dst.sequence   = src.sequence;
+                    dst.seek_delta = src.seek_delta;
+                    dst.failed     = src.failed;
+                    dst.completed  = src.completed;
+                    dst.has_ts     = src.has_ts;
+                }
 
-                        continue;
-                    }
+                prompt = std::move(prompts[it_best]);
 
-                    if (best_score < decoder.sequence.score) {
-                        best_score = decoder.sequence.score;
-                        best_decoder_id = j;
-                    }
-                }
+                it_next = temperatures.size();
+            } else {
+                it_next = n_parallel;
+            }
+        }
+
+        for (int it = it_next; it < (int) temperatures.size(); ++it) {
+            const float t_cur = temperatures[it];
+
+            // failed decodings are retried at the next temperature (see the fallback conditions below)
+            const bool can_fallback = it != (int) temperatures.size() - 1 && seek_end - seek > 10*WHISPER_CHUNK_SIZE;
 
-                WHISPER_PRINT_DEBUG("%s: best decoder = %d\n", __func__, best_decoder_id);
+            const int ret = whisper_full_decode(*ctx, *state, params, t_cur, it, can_fallback, seek, seek_end, prompt_past, prompt_init, allowed_tokens, prompt, nullptr);
+            if (ret < 0) {
+                return ret;
             }
 
+            best_decoder_id = ret;
+
             // was the decoding successful for the current temperature?
             // do fallback only if:
             // - we are not at the last temperature
             // - we are not at the end of the audio (3 sec)
             if (it != (int) temperatures.size() - 1 &&
                 seek_end - seek > 10*WHISPER_CHUNK_SIZE) {
-                bool success = true;
-
-                const auto & decoder = state->decoders[best_decoder_id];
+                const bool success = is_success(state->decoders[best_decoder_id]);
 
-                if (decoder.failed || decoder.sequence.avg_logprobs < params.logprob_thold) {
-                    success = false;
+                if (!success) {
                     state->n_fail_p++;
                 }
 
@@ -4656,6 +6444,14 @@ int whisper_full_with_state(
                 prompt_past.push_back(tokens_cur[i].id);
             }
 
+            // the next window starts in a new clip (see whisper_full_clips()), as with no_context
+            for (const auto t : state->clip_t0) {
+                if (t > seek && t <= seek + seek_delta) {
+                    prompt_past.clear();
+                    break;
+                }
+            }
+
             if (!tokens_cur.empty() && ctx->model.n_loaded > 0) {
                 int  i0 = 0;
                 auto t0 = seek + 2*(tokens_cur.front().tid - whisper_token_beg(ctx));
@@ -4695,7 +6491,7 @@ int whisper_full_with_state(
 
                             //printf("tt0 = %d, tt1 = %d, text = %s, token = %s, token_id = %d, tid = %d\n", tt0, tt1, text.c_str(), ctx->vocab.id_to_token[tokens_cur[i].id].c_str(), tokens_cur[i].id, tokens_cur[i].tid);
 
-                            result_all.push_back({ tt0, tt1, text, {}, speaker_turn_next });
+                            result_all.push_back({ tt0, tt1, text, {}, speaker_turn_next, 0 });
                             for (int j = i0; j <= i; j++) {
                                 result_all.back().tokens.push_back(tokens_cur[j]);
                             }
@@ -4740,7 +6536,7 @@ int whisper_full_with_state(
                         }
                     }
 
-                    result_all.push_back({ tt0, tt1, text, {} , speaker_turn_next });
+                    result_all.push_back({ tt0, tt1, text, {} , speaker_turn_next, 0 });
                     for (int j = i0; j < (int) tokens_cur.size(); j++) {
                         result_all.back().tokens.push_back(tokens_cur[j]);
                     }
@@ -4768,6 +6564,8 @@ int whisper_full_with_state(
         }
     }
 
+    state->seek_next = seek;
+
     return 0;
 }
 
@@ -4780,6 +6578,452 @@ int whisper_full(
     return whisper_full_with_state(ctx, ctx->state, params, samples, n_samples);
 }
 
+int whisper_full_multi(
+        struct whisper_context * ctx,
+          struct whisper_state ** states,
+const struct whisper_full_params * params,
+                           int   n_tasks,
+                   const float * samples,
+                           int   n_samples) {
+    if (n_tasks <= 0) {
+        return 0;
+    }
+
+    for (int i = 1; i < n_tasks; ++i) {
+        if (states[i] == states[0] || params[i].speed_up != params[0].speed_up) {
+            fprintf(stderr, "%s: the tasks must use different states and the same speed_up\n", __func__);
+            return -12;
+        }
+    }
+
+    auto * state0 = states[0];
+
+    // compute log mel spectrogram once for all the tasks
+    if (params[0].speed_up) {
+        if (whisper_pcm_to_mel_phase_vocoder_with_state(ctx, state0, samples, n_samples, whisper_full_n_threads_mel(params[0])) != 0) {
+            fprintf(stderr, "%s: failed to compute log mel spectrogram\n", __func__);
+            return -1;
+        }
+    } else {
+        if (whisper_pcm_to_mel_with_state(ctx, state0, samples, n_samples, whisper_full_n_threads_mel(params[0])) != 0) {
+            fprintf(stderr, "%s: failed to compute log mel spectrogram\n", __func__);
+            return -2;
+        }
+    }
+
+    whisper_encoder_share share;
+    share.mel = &state0->mel;
+
+    // the shared kv_cross is separate from those of the tasks, where they encode the windows that are not shared
+    {
+        const size_t scale = ctx->model.hparams.ftype ? 1 : 2;
+
+        if (!kv_cache_init(ctx->model.hparams, scale * MEM_REQ_KV_CROSS.at(ctx->model.type), share.kv_cross, ctx->itype, ctx->model.hparams.n_audio_ctx)) {
+            fprintf(stderr, "%s: kv_cache_init() failed for the shared cross-attention cache\n", __func__);
+            return -10;
+        }
+    }
+
+    bool detected = false;
+
+    // auto-detect the language once for all the tasks that need it
+    std::vector<whisper_full_params> params_task(params, params + n_tasks);
+
+    int lang_id = -1;
+
+    for (int i = 0; i < n_tasks; ++i) {
+        auto & p = params_task[i];
+
+        if (p.language == nullptr || strlen(p.language) == 0 || strcmp(p.language, "auto") == 0 || p.detect_language) {
+            if (lang_id < 0) {
+                if (params[0].audio_ctx > whisper_n_audio_ctx(ctx)) {
+                    fprintf(stderr, "%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params[0].audio_ctx, whisper_n_audio_ctx(ctx));
+                    kv_cache_free(share.kv_cross);
+                    return -5;
+                }
+                state0->exp_n_audio_ctx = whisper_full_audio_ctx(*ctx, params[0], 0, state0->mel.n_len_org);
+
+                std::vector<float> probs(whisper_lang_max_id() + 1, 0.0f);
+
+                lang_id = whisper_lang_auto_detect_with_state(ctx, state0, 0, whisper_full_n_threads_encoder(p), probs.data());
+                if (lang_id < 0) {
+                    fprintf(stderr, "%s: failed to auto-detect language\n", __func__);
+                    kv_cache_free(share.kv_cross);
+                    return -3;
+                }
+
+                fprintf(stderr, "%s: auto-detected language: %s (p = %f)\n", __func__, whisper_lang_str(lang_id), probs[lang_id]);
+
+                // the language detection encoded the first window - it becomes the shared one
+                std::swap(share.kv_cross, state0->kv_cross);
+                detected = true;
+
+                share.seek        = 0;
+                share.n_audio_ctx = state0->exp_n_audio_ctx;
+            }
+
+            states[i]->lang_id = lang_id;
+            p.language = whisper_lang_str(lang_id);
+        }
+    }
+
+    // each task uses the shared kv_cross when it can, and its own otherwise
+    for (int i = 0; i < n_tasks; ++i) {
+        states[i]->result_all.clear();
+
+        states[i]->kv_cross_own.k   = states[i]->kv_cross.k;
+        states[i]->kv_cross_own.v   = states[i]->kv_cross.v;
+        states[i]->kv_cross_own.ctx = states[i]->kv_cross.ctx;
+
+        states[i]->encoder_share = &share;
+    }
+
+    std::vector<int> rets(n_tasks, 0);
+
+    const auto run = [&](int i) {
+        if (params_task[i].detect_language) {
+            return;
+        }
+
+        rets[i] = whisper_full_with_state(ctx, states[i], params_task[i], samples, n_samples);
+
+        whisper_encoder_share_release(*states[i]);
+    };
+
+    std::vector<std::thread> workers;
+    for (int i = 1; i < n_tasks; ++i) {
+        workers.emplace_back(run, i);
+    }
+
+    run(0);
+
+    for (auto & worker : workers) {
+        worker.join();
+    }
+
+    for (int i = 0; i < n_tasks; ++i) {
+        states[i]->kv_cross.k   = states[i]->kv_cross_own.k;
+        states[i]->kv_cross.v   = states[i]->kv_cross_own.v;
+        states[i]->kv_cross.ctx = states[i]->kv_cross_own.ctx;
+
+        states[i]->kv_cross_own = {};
+        states[i]->encoder_share = nullptr;
+    }
+
+    if (detected) {
+        std::swap(share.kv_cross, state0->kv_cross);
+    }
+
+    kv_cache_free(share.kv_cross);
+
+    for (int i = 0; i < n_tasks; ++i) {
+        if (rets[i] != 0) {
+            return rets[i];
+        }
+    }
+
+    return 0;
+}
+
+int whisper_full_clips(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+    struct whisper_full_params   params,
+          const float * const * samples,
+                   const int * n_samples,
+                           int   n_clips) {
+    // concatenate the clips, each one followed by silence, so that the decoder can end a segment with the clip
+    const int n_guard = WHISPER_SAMPLE_RATE;
+
+    std::vector<int64_t> clip_t0(n_clips); // start of each clip in the concatenated audio [10 ms]
+    std::vector<int64_t> clip_t1(n_clips);
+
+    std::vector<float> pcm;
+    {
+        size_t n_total = 0;
+        for (int i = 0; i < n_clips; ++i) {
+            n_total += n_samples[i] + n_guard;
+        }
+
+        pcm.reserve(n_total);
+    }
+
+    for (int i = 0; i < n_clips; ++i) {
+        clip_t0[i] = (100*(int64_t) pcm.size())/WHISPER_SAMPLE_RATE;
+        clip_t1[i] = clip_t0[i] + (100*(int64_t) n_samples[i])/WHISPER_SAMPLE_RATE;
+
+        pcm.insert(pcm.end(), samples[i], samples[i] + n_samples[i]);
+        pcm.insert(pcm.end(), n_guard, 0.0f);
+    }
+
+    state->clip_t0 = clip_t0;
+
+    const int ret = whisper_full_with_state(ctx, state, params, pcm.data(), pcm.size());
+
+    state->clip_t0.clear();
+
+    if (ret != 0 || n_clips == 0) {
+        return ret;
+    }
+
+    const auto clip_of = [&](int64_t t) {
+        return std::max(0, int(std::upper_bound(clip_t0.begin(), clip_t0.end(), t) - clip_t0.begin()) - 1);
+    };
+
+    // map the segments back to the clips
+    std::vector<whisper_segment> result_all;
+    result_all.reserve(state->result_all.size());
+
+    for (auto & segment : state->result_all) {
+        const int clip0 = clip_of(segment.t0);
+        const int clip1 = clip_of(segment.t1);
+
+        if (clip0 == clip1) {
+            segment.clip = clip0;
+            result_all.push_back(std::move(segment));
+            continue;
+        }
+
+        // the segment straddles a clip boundary - with token-level timestamps, split it at the boundary
+        if (params.token_timestamps) {
+            whisper_segment cur = { segment.t0, segment.t0, "", {}, false, clip0 };
+
+            for (const auto & token : segment.tokens) {
+                const int clip = token.t0 >= 0 ? clip_of((token.t0 + token.t1)/2) : cur.clip;
+
+                if (clip != cur.clip) {
+                    if (!cur.tokens.empty()) {
+                        result_all.push_back(std::move(cur));
+                    }
+                    cur = { token.t0, token.t0, "", {}, false, clip };
+                }
+
+                if (params.print_special || token.id < whisper_token_eot(ctx)) {
+                    cur.text += whisper_token_to_str(ctx, token.id);
+                }
+                if (token.t1 >= 0) {
+                    cur.t1 = token.t1;
+                }
+                cur.tokens.push_back(token);
+            }
+
+            cur.t1 = segment.t1;
+            cur.speaker_turn_next = segment.speaker_turn_next;
+            result_all.push_back(std::move(cur));
+            continue;
+        }
+
+        // otherwise, assign it to the clip it overlaps the most
+        int64_t overlap_best = -1;
+        for (int clip = clip0; clip <= clip1; ++clip) {
+            const int64_t overlap = std::min(segment.t1, clip_t1[clip]) - std::max(segment.t0, clip_t0[clip]);
+            if (overlap > overlap_best) {
+                overlap_best = overlap;
+                segment.clip = clip;
+            }
+        }
+        result_all.push_back(std::move(segment));
+    }
+
+    // make the timestamps relative to the clip, clamped to it
+    for (auto & segment : result_all) {
+        const int64_t t0 = clip_t0[segment.clip];
+        const int64_t t1 = clip_t1[segment.clip];
+
+        segment.t0 = std::min(std::max(segment.t0, t0), t1) - t0;
+        segment.t1 = std::min(std::max(segment.t1, t0), t1) - t0;
+
+        for (auto & token : segment.tokens) {
+            if (token.t0 >= 0) {
+                token.t0 = std::min(std::max(token.t0, t0), t1) - t0;
+            }
+            if (token.t1 >= 0) {
+                token.t1 = std::min(std::max(token.t1, t0), t1) - t0;
+            }
+        }
+    }
+
+    state->result_all = std::move(result_all);
+
+    return 0;
+}
+
+// [EXPERIMENTAL] long-form transcription
+// the segments of each chunk are shifted to the time of the chunk before they are reported
+struct whisper_full_long_data {
+    whisper_new_segment_callback new_segment_callback;
+    void * new_segment_callback_user_data;
+
+    bool print_realtime;
+    bool print_timestamps;
+
+    int64_t t_offset; // the start of the current chunk, in units of 10 ms
+};
+
+static void whisper_full_long_segment_callback(struct whisper_context * ctx, struct whisper_state * state, int n_new, void * user_data) {
+    const auto & data = *(const whisper_full_long_data *) user_data;
+
+    auto & result_all = state->result_all;
+
+    for (int i = (int) result_all.size() - n_new; i < (int) result_all.size(); ++i) {
+        auto & segment = result_all[i];
+
+        segment.t0 += data.t_offset;
+        segment.t1 += data.t_offset;
+
+        // the token-level timestamps are -1 when they are not computed
+        for (auto & token : segment.tokens) {
+            if (token.t0 >= 0) {
+                token.t0 += data.t_offset;
+            }
+            if (token.t1 >= 0) {
+                token.t1 += data.t_offset;
+            }
+        }
+
+        if (data.print_realtime) {
+            if (data.print_timestamps) {
+                printf("[%s --> %s]  %s\n", to_timestamp(segment.t0).c_str(), to_timestamp(segment.t1).c_str(), segment.text.c_str());
+            } else {
+                printf("%s", segment.text.c_str());
+                fflush(stdout);
+            }
+        }
+    }
+
+    if (data.new_segment_callback) {
+        data.new_segment_callback(ctx, state, n_new, data.new_segment_callback_user_data);
+    }
+}
+
+int whisper_full_long_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+    struct whisper_full_params   params,
+          whisper_pcm_callback   pcm_callback,
+                          void * pcm_callback_user_data) {
+    const int hop = params.speed_up ? 2*WHISPER_HOP_LENGTH : WHISPER_HOP_LENGTH;
+
+    // a chunk is 5 windows, the last one of which is only used if the audio ends there
+    const int n_frames_window = 100*WHISPER_CHUNK_SIZE;
+    const int n_chunk         = 5*n_frames_window*hop;
+
+    int64_t n_skip = (int64_t) params.offset_ms*WHISPER_SAMPLE_RATE/1000;
+    int64_t n_left = params.duration_ms > 0 ? (int64_t) params.duration_ms*WHISPER_SAMPLE_RATE/1000 : -1;
+
+    whisper_full_long_data data = {
+        /*.new_segment_callback           =*/ params.new_segment_callback,
+        /*.new_segment_callback_user_data =*/ params.new_segment_callback_user_data,
+        /*.print_realtime                 =*/ params.print_realtime,
+        /*.print_timestamps               =*/ params.print_timestamps,
+        /*.t_offset                       =*/ 0,
+    };
+
+    params.offset_ms   = 0;
+    params.duration_ms = 0;
+
+    params.print_progress              = false;
+    params.print_realtime              = false;
+    params.progress_callback           = nullptr;
+    params.progress_callback_user_data = nullptr;
+
+    params.new_segment_callback           = whisper_full_long_segment_callback;
+    params.new_segment_callback_user_data = &data;
+
+    std::vector<float> pcm;
+    pcm.reserve(n_chunk);
+
+    int64_t pcm_offset = 0; // the index of pcm[0] in the audio
+
+    bool eof = false;
+
+    int ret = 0;
+
+    while (true) {
+        // fill the chunk
+        while (!eof && (int) pcm.size() < n_chunk) {
+            const int n_cur = pcm.size();
+
+            pcm.resize(n_chunk);
+
+            int n = pcm_callback(pcm.data() + n_cur, n_chunk - n_cur, pcm_callback_user_data);
+            if (n < 0) {
+                fprintf(stderr, "%s: failed to read the audio\n", __func__);
+                pcm.resize(n_cur);
+                ret = -13;
+                break;
+            }
+
+            if (n == 0) {
+                eof = true;
+            }
+
+            // offset_ms
+            const int n_drop = std::min<int64_t>(n, n_skip);
+            if (n_drop > 0) {
+                memmove(pcm.data() + n_cur, pcm.data() + n_cur + n_drop, (n - n_drop)*sizeof(float));
+                n      -= n_drop;
+                n_skip -= n_drop;
+            }
+
+            // duration_ms
+            if (n_left >= 0) {
+                if (n >= n_left) {
+                    n   = n_left;
+                    eof = true;
+                }
+                n_left -= n;
+            }
+
+            pcm.resize(n_cur + n);
+        }
+
+        if (ret != 0) {
+            break;
+        }
+
+        data.t_offset = (100*pcm_offset)/WHISPER_SAMPLE_RATE;
+
+        // the windows after seek_stop could reach the end of the chunk, which would be taken for the end of the audio
+        state->seek_stop = eof ? -1 : (int) pcm.size()/hop - n_frames_window - 101;
+        state->seek_next = 0;
+
+        ret = whisper_full_with_state(ctx, state, params, pcm.data(), pcm.size());
+        if (ret != 0 || eof || params.detect_language) {
+            break;
+        }
+
+        // stopped before seek_stop - aborted by the encoder_begin_callback
+        if (state->seek_next <= state->seek_stop) {
+            break;
+        }
+
+        // the next chunk continues the transcription of this one
+        params.language        = whisper_lang_str(state->lang_id);
+        params.no_context      = false;
+        params.initial_prompt  = nullptr;
+        params.prompt_tokens   = nullptr;
+        params.prompt_n_tokens = 0;
+
+        const int64_t n_done = (int64_t) state->seek_next*hop;
+
+        pcm.erase(pcm.begin(), pcm.begin() + n_done);
+        pcm_offset += n_done;
+    }
+
+    state->seek_stop = -1;
+
+    return ret;
+}
+
+int whisper_full_long(
+        struct whisper_context * ctx,
+    struct whisper_full_params   params,
+          whisper_pcm_callback   pcm_callback,
+                          void * pcm_callback_user_data) {
+    return whisper_full_long_with_state(ctx, ctx->state, params, pcm_callback, pcm_callback_user_data);
+}
+
 int whisper_full_parallel(
         struct whisper_context * ctx,
         struct whisper_full_params params,
@@ -4820,6 +7064,11 @@ int whisper_full_parallel(
         params_cur.progress_callback = nullptr;
         params_cur.progress_callback_user_data = nullptr;
 
+        // each processor runs on its own CPUs
+        if (params_cur.cpu_offset >= 0) {
+            params_cur.cpu_offset += (i + 1)*params.n_threads;
+        }
+
         workers[i] = std::thread(whisper_full_with_state, ctx, states[i], std::move(params_cur), samples + start_samples, n_samples_cur);
     }
 
@@ -4920,6 +7169,18 @@ int64_t whisper_full_get_segment_t1(struct whisper_context * ctx, int i_segment)
     return ctx->state->result_all[i_segment].t1;
 }
 
+int whisper_full_get_segment_clip_from_state(struct whisper_state * state, int i_segment) {
+    return state->result_all[i_segment].clip;
+}
+
+int whisper_full_get_segment_clip(struct whisper_context * ctx, int i_segment) {
+    return ctx->state->result_all[i_segment].clip;
+}
+
+bool whisper_full_get_segment_speaker_turn_next_from_state(struct whisper_state * state, int i_segment) {
+    return state->result_all[i_segment].speaker_turn_next;
+}
+
 bool whisper_full_get_segment_speaker_turn_next(struct whisper_context * ctx, int i_segment) {
     return ctx->state->result_all[i_segment].speaker_turn_next;
 }
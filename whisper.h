@@ -25,6 +25,12 @@
 #define WHISPER_HOP_LENGTH  160
 #define WHISPER_CHUNK_SIZE  30
 
+// the packed model format: the tensor data is aligned, so that the model can be memory-mapped
+// models are converted to it with examples/quantize (see whisper_model_load() for the layout)
+#define WHISPER_FILE_MAGIC_PACKED   0x67676d70 // "ggmp"
+#define WHISPER_FILE_VERSION_PACKED 1
+#define WHISPER_PACKED_ALIGNMENT    64
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -67,6 +73,7 @@ extern "C" {
 
     struct whisper_context;
     struct whisper_state;
+    struct whisper_encoder_batch;
 
     typedef int whisper_token;
 
@@ -97,6 +104,7 @@ extern "C" {
 
     // Various functions for loading a ggml whisper model.
     // Allocate (almost) all memory needed for the model.
+    // A packed model file is memory-mapped by whisper_init_from_file(), where supported, instead of being read
     // Return NULL on failure
     WHISPER_API struct whisper_context * whisper_init_from_file(const char * path_model);
     WHISPER_API struct whisper_context * whisper_init_from_buffer(void * buffer, size_t buffer_size);
@@ -110,6 +118,23 @@ extern "C" {
 
     WHISPER_API struct whisper_state * whisper_init_state(struct whisper_context * ctx);
 
+    // The state used by the functions without a state argument (nullptr for the contexts created without a state)
+    WHISPER_API struct whisper_state * whisper_get_state(struct whisper_context * ctx);
+
+    // [EXPERIMENTAL] Batching of the encoder passes of concurrent whisper_full_with_state() calls
+    // (see whisper_full_params.encoder_batch)
+    // A call that needs to encode a window waits up to t_wait_ms for other calls that need a window with the same audio
+    // context. Then up to n_batch windows are encoded with a single batched graph, using n_threads threads
+    // The model weights are read once per batch instead of once per window, which helps most with short windows
+    // Needs the compute memory of n_batch states
+    WHISPER_API struct whisper_encoder_batch * whisper_encoder_batch_init(
+        struct whisper_context * ctx,
+                           int   n_batch,
+                           int   t_wait_ms,
+                           int   n_threads);
+
+    WHISPER_API void whisper_encoder_batch_free(struct whisper_encoder_batch * batch);
+
     // Given a context, enable use of OpenVINO for encode inference.
     // model_path: Optional path to OpenVINO encoder IR model. If set to nullptr,
     //                      the path will be generated from the ggml model path that was passed
@@ -344,6 +369,11 @@ extern "C" {
                              float * logits,
                               void * user_data);
 
+    // PCM callback (see whisper_full_long())
+    // Writes up to n_samples_max mono float samples at WHISPER_SAMPLE_RATE to samples
+    // Returns the number of written samples, 0 at the end of the audio, or a negative value on error
+    typedef int (*whisper_pcm_callback)(float * samples, int n_samples_max, void * user_data);
+
     // Parameters for the whisper_full() function
     // If you chnage the order or add new parameters, make sure to update the default values in whisper.cpp:
     // whisper_full_default_params()
@@ -429,6 +459,59 @@ extern "C" {
         // called by each decoder to filter obtained logits
         whisper_logits_filter_callback logits_filter_callback;
         void * logits_filter_callback_user_data;
+
+        // new fields are added below, so that the offsets of the fields above stay those of the bindings
+        // (e.g. bindings/java WhisperFullParams)
+
+        // restrict the decoding to this set of tokens (nullptr = the whole vocabulary)
+        // the decoder computes the logits only for these tokens, which is much faster when only a few of them are of interest
+        const whisper_token * allowed_tokens;
+        int allowed_n_tokens;
+
+        // [EXPERIMENTAL] decode the first temperature_n_parallel temperatures concurrently instead of one after the other
+        // the first successful one in temperature order is used (0 or 1 = sequential fallback), so the result is the same
+        // as with the sequential fallback
+        // each additional temperature is decoded by its own thread, which evaluates the decoder with n_threads_decoder threads
+        // (n_threads if not set), so up to temperature_n_parallel*n_threads_decoder threads run at the same time
+        // each additional temperature also needs its own whisper_state memory
+        // note: the logits_filter_callback can then be called from several threads at the same time
+        int temperature_n_parallel;
+
+        // [EXPERIMENTAL] speculative decoding
+        // a smaller model with the same vocabulary (e.g. tiny or base) proposes up to draft_n_tokens tokens at a time,
+        // which are then verified by this model with a single decoder pass
+        // only used for greedy decoding at temperature 0 - the output is that of this model
+        // the draft model must have the same vocabulary and mel bins - it encodes the spectrogram of this model
+        // each whisper_state creates its own state for the draft model on first use, so a draft model can be shared
+        // by concurrent calls, and does not need a default state (see whisper_init_from_file_no_state())
+        struct whisper_context * draft_ctx;
+        int draft_n_tokens;
+
+        // [EXPERIMENTAL] encode the next 30 s window in a separate thread, while the current window is being decoded
+        // only used with single_segment, where the decoding always consumes the whole window - with timestamps,
+        // the next window starts at the last timestamp of the decoding, which is not known in advance
+        // the encoder thread uses n_threads_encoder threads, and needs its own whisper_state memory
+        bool encode_ahead;
+
+        // [EXPERIMENTAL] speed-up technique: encode the windows with less than 30 s of audio left (e.g. short clips)
+        // with a smaller audio context
+        bool audio_ctx_auto;
+
+        // [EXPERIMENTAL] encode the windows together with those of other calls that use the same batch
+        // see whisper_encoder_batch_init()
+        struct whisper_encoder_batch * encoder_batch;
+
+        // [EXPERIMENTAL] number of threads of each computation stage (0 = n_threads)
+        // the encoder scales well with the number of threads, while the single-token decoder steps are dominated by
+        // the synchronization between the threads and are often faster with fewer of them
+        int n_threads_encoder;
+        int n_threads_decoder;  // -1 = the fastest count up to n_threads, measured once per state on the first window
+        int n_threads_mel;
+
+        // [EXPERIMENTAL] if >= 0, run the computation on the CPUs [cpu_offset, cpu_offset + n_threads) (Linux only)
+        // the threads inherit the CPU affinity of the calling thread, which is restored at the end of the call
+        // whisper_full_parallel() gives each processor its own range of n_threads CPUs
+        int cpu_offset;
     };
 
     // NOTE: this function allocates memory, and it is the responsibility of the caller to free the pointer - see whisper_free_params()
@@ -451,6 +534,58 @@ extern "C" {
                            const float * samples,
                                    int   n_samples);
 
+    // [EXPERIMENTAL] Run several tasks over the same audio, e.g. language identification, transcription and translation
+    // The log mel spectrogram is computed once and each window is encoded once for all tasks that decode it at the same time
+    // A task that is at another window than the others encodes it in its own state, instead of waiting for them
+    // Task i uses params[i] and its results are stored in states[i]. The tasks run concurrently, each one in its own thread
+    // A task with detect_language only identifies the language (see whisper_full_lang_id_from_state())
+    // All tasks must use the same speed_up. The spectrogram is kept in states[0]
+    // Returns 0 on success, or the result of the first task that failed
+    WHISPER_API int whisper_full_multi(
+                struct whisper_context * ctx,
+                 struct whisper_state ** states,
+      const struct whisper_full_params * params,
+                                   int   n_tasks,
+                           const float * samples,
+                                   int   n_samples);
+
+    // [EXPERIMENTAL] Transcribe several short clips (e.g. voice commands) as a single audio
+    // The clips are concatenated, with 1 s of silence after each one, and processed with whisper_full_with_state(),
+    // so that a 30 s window (one encoder pass) covers several clips. The prompt is reset at each clip, as with no_context
+    // Then each segment is assigned to its clip and its timestamps are made relative to the start of that clip. A segment
+    // that straddles a clip boundary is split at the boundary with token_timestamps, and otherwise assigned to the clip
+    // it overlaps the most
+    // The params apply to the concatenated audio and new_segment_callback sees its timestamps
+    // Returns 0 on success. The clip of each segment is given by whisper_full_get_segment_clip()
+    WHISPER_API int whisper_full_clips(
+                struct whisper_context * ctx,
+                  struct whisper_state * state,
+            struct whisper_full_params   params,
+                    const float * const * samples,
+                             const int * n_samples,
+                                   int   n_clips);
+
+    // [EXPERIMENTAL] Transcribe audio of any length with bounded memory
+    // The audio is pulled with pcm_callback and processed in chunks of 5 windows with whisper_full_with_state(). Each
+    // chunk ends where the last full window of the previous one would have started, so no window is cut short, and the
+    // decoding context carries over. Only one chunk of audio, spectrogram and signal energy is kept in memory
+    // The segments are reported with timestamps relative to the start of the audio through new_segment_callback, and
+    // they are released when the next chunk starts - after the call, only those of the last chunk are available
+    // offset_ms and duration_ms apply to the pulled audio, print_progress and progress_callback are not used
+    // The output can differ slightly from whisper_full(), since the spectrogram is normalized per chunk
+    WHISPER_API int whisper_full_long(
+                struct whisper_context * ctx,
+            struct whisper_full_params   params,
+                  whisper_pcm_callback   pcm_callback,
+                                  void * pcm_callback_user_data);
+
+    WHISPER_API int whisper_full_long_with_state(
+                struct whisper_context * ctx,
+                  struct whisper_state * state,
+            struct whisper_full_params   params,
+                  whisper_pcm_callback   pcm_callback,
+                                  void * pcm_callback_user_data);
+
     // Split the input audio in chunks and process each chunk separately using whisper_full_with_state()
     // Result is stored in the default state of the context
     // Not thread safe if executed in parallel on the same context.
@@ -481,8 +616,13 @@ extern "C" {
     WHISPER_API int64_t whisper_full_get_segment_t1           (struct whisper_context * ctx, int i_segment);
     WHISPER_API int64_t whisper_full_get_segment_t1_from_state(struct whisper_state * state, int i_segment);
 
+    // Get the clip of the specified segment (see whisper_full_clips(), 0 otherwise)
+    WHISPER_API int whisper_full_get_segment_clip           (struct whisper_context * ctx, int i_segment);
+    WHISPER_API int whisper_full_get_segment_clip_from_state(struct whisper_state * state, int i_segment);
+
     // Get whether the next segment is predicted as a speaker turn
-    WHISPER_API bool whisper_full_get_segment_speaker_turn_next(struct whisper_context * ctx, int i_segment);
+    WHISPER_API bool whisper_full_get_segment_speaker_turn_next           (struct whisper_context * ctx, int i_segment);
+    WHISPER_API bool whisper_full_get_segment_speaker_turn_next_from_state(struct whisper_state * state, int i_segment);
 
     // Get the text of the specified segment
     WHISPER_API const char * whisper_full_get_segment_text           (struct whisper_context * ctx, int i_segment);